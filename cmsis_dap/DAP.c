@@ -1769,30 +1769,17 @@ uint32_t DAP_ExecuteCommand(const uint8_t *request, uint8_t *response) {
 #include <esp_log.h>
 #define DAP_TAG "swd"
 
-// Setup DAP
-void DAP_Setup(void) {
-
-  // Default settings
-  DAP_Data.debug_port  = 0U;
-  DAP_Data.transfer.idle_cycles = 0U;
-  DAP_Data.transfer.retry_count = 100U;
-  DAP_Data.transfer.match_retry = 0U;
-  DAP_Data.transfer.match_mask  = 0x00000000U;
-#if (DAP_SWD != 0)
-  DAP_Data.swd_conf.turnaround  = 1U;
-  DAP_Data.swd_conf.data_phase  = 0U;
-#endif
-#if (DAP_JTAG != 0)
-  DAP_Data.jtag_dev.count = 0U;
-#endif
-
-  if (DAP_DEFAULT_SWJ_CLOCK >= MAX_SWJ_CLOCK(DELAY_FAST_CYCLES)) {
-    DAP_Data.fast_clock  = 1U;
-    DAP_Data.clock_delay = 1U;
+// Set the SWJ clock of a port
+//   data:  port settings
+//   clock: frequency in Hz
+void DAP_Set_Clock(DAP_Data_t *data, uint32_t clock) {
+  if (clock >= MAX_SWJ_CLOCK(DELAY_FAST_CYCLES)) {
+    data->fast_clock  = 1U;
+    data->clock_delay = 1U;
   } else {
-    DAP_Data.fast_clock  = 0U;
+    data->fast_clock  = 0U;
 
-    uint32_t delay = ((CPU_CLOCK/2U) + (DAP_DEFAULT_SWJ_CLOCK - 1U)) / DAP_DEFAULT_SWJ_CLOCK;
+    uint32_t delay = ((CPU_CLOCK/2U) + (clock - 1U)) / clock;
     if (delay > IO_PORT_WRITE_CYCLES) {
       delay -= IO_PORT_WRITE_CYCLES;
       delay  = (delay + (DELAY_SLOW_CYCLES - 1U)) / DELAY_SLOW_CYCLES;
@@ -1800,10 +1787,35 @@ void DAP_Setup(void) {
       delay  = 1U;
     }
 
-    DAP_Data.clock_delay = delay;
+    data->clock_delay = delay;
 
-    ESP_LOGD(DAP_TAG, "Delay: %lu, delay cycle: %u, MAX_SWJ_CLOCK: %u", delay, ((CPU_CLOCK/2U) + (DAP_DEFAULT_SWJ_CLOCK - 1U)) / DAP_DEFAULT_SWJ_CLOCK, MAX_SWJ_CLOCK(DELAY_FAST_CYCLES));
+    ESP_LOGD(DAP_TAG, "Delay: %lu, delay cycle: %u, MAX_SWJ_CLOCK: %u", delay, ((CPU_CLOCK/2U) + (clock - 1U)) / clock, MAX_SWJ_CLOCK(DELAY_FAST_CYCLES));
   }
+}
+
+// Default settings of a port
+void DAP_Setup_Data(DAP_Data_t *data) {
+  data->debug_port  = 0U;
+  data->transfer.idle_cycles = 0U;
+  data->transfer.retry_count = 100U;
+  data->transfer.match_retry = 0U;
+  data->transfer.match_mask  = 0x00000000U;
+#if (DAP_SWD != 0)
+  data->swd_conf.turnaround  = 1U;
+  data->swd_conf.data_phase  = 0U;
+#endif
+#if (DAP_JTAG != 0)
+  data->jtag_dev.count = 0U;
+#endif
+
+  DAP_Set_Clock(data, DAP_DEFAULT_SWJ_CLOCK);
+}
+
+// Setup DAP
+void DAP_Setup(void) {
+
+  // Default settings
+  DAP_Setup_Data(&DAP_Data);
 
   DAP_SETUP();  // Device specific setup
 }
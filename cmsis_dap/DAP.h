@@ -238,6 +238,18 @@ typedef struct {
 } DAP_Data_t;
 
 extern          DAP_Data_t DAP_Data;            // DAP Data
+
+// SWD port: pins and the clock/transfer settings used to drive them
+typedef struct {
+  uint32_t    swclk;                            // SWCLK pin mask
+  uint32_t    swdio;                            // SWDIO pin mask
+  uint32_t    nreset;                           // nRESET pin mask, 0 if not connected
+  uint8_t     swdio_pin;                        // SWDIO pin number (IO_MUX input enable)
+  uint8_t     padding[3];
+  DAP_Data_t *data;                             // Clock and transfer settings
+} DAP_Port_t;
+
+extern          DAP_Port_t DAP_DefaultPort;     // Port of DAP_Data and the DAP_config.h pins
 extern volatile uint8_t    DAP_TransferAbort;   // Transfer Abort Flag
 
 
@@ -256,6 +268,10 @@ extern void     JTAG_WriteAbort (uint32_t data);
 extern uint8_t  JTAG_Transfer   (uint32_t request, uint32_t *data);
 extern uint8_t  SWD_Transfer    (uint32_t request, uint32_t *data);
 
+extern void     SWJ_Sequence_Port (const DAP_Port_t *port, uint32_t count, const uint8_t *data);
+extern void     SWD_Sequence_Port (const DAP_Port_t *port, uint32_t info,  const uint8_t *swdo, uint8_t *swdi);
+extern uint8_t  SWD_Transfer_Port (const DAP_Port_t *port, uint32_t request, uint32_t *data);
+
 extern void     Delayms         (uint32_t delay);
 
 extern uint32_t SWO_Transport      (const uint8_t *request, uint8_t *response);
@@ -287,6 +303,8 @@ extern uint32_t DAP_ProcessCommand       (const uint8_t *request, uint8_t *respo
 extern uint32_t DAP_ExecuteCommand       (const uint8_t *request, uint8_t *response);
 
 extern void     DAP_Setup (void);
+extern void     DAP_Setup_Data (DAP_Data_t *data);
+extern void     DAP_Set_Clock (DAP_Data_t *data, uint32_t clock);
 
 // Configurable delay for clock generation
 #ifndef DELAY_SLOW_CYCLES
@@ -99,41 +99,56 @@ static inline void PORT_JTAG_SETUP(void)
     (void)0; // Not supported
 }
 
-static inline void PORT_SWD_SETUP(void)
+// Pin setup of any SWD port, nrst < 0 if the port has no reset line
+static inline void PORT_SWD_SETUP_PINS(uint32_t swclk, uint32_t swdio, int32_t nrst)
 {
     // Set SWCLK HIGH, pull-up only
-    gpio_ll_output_enable(&GPIO, PIN_SWCLK);
-    gpio_ll_od_disable(&GPIO, PIN_SWCLK);
-    gpio_ll_set_level(&GPIO, PIN_SWCLK, 1);
-    gpio_ll_pulldown_dis(&GPIO, PIN_SWCLK);
-    gpio_ll_pullup_en(&GPIO, PIN_SWCLK);
-    gpio_ll_pin_filter_disable(&GPIO, PIN_SWCLK);
+    gpio_ll_output_enable(&GPIO, swclk);
+    gpio_ll_od_disable(&GPIO, swclk);
+    gpio_ll_set_level(&GPIO, swclk, 1);
+    gpio_ll_pulldown_dis(&GPIO, swclk);
+    gpio_ll_pullup_en(&GPIO, swclk);
+    gpio_ll_pin_filter_disable(&GPIO, swclk);
 
 
     // Set SWDIO HIGH, pull-up only
-    gpio_ll_output_enable(&GPIO, PIN_SWDIO);
-    gpio_ll_od_disable(&GPIO, PIN_SWDIO);
-    gpio_ll_set_level(&GPIO, PIN_SWDIO, 1);
-    gpio_ll_pulldown_dis(&GPIO, PIN_SWDIO);
-    gpio_ll_pullup_en(&GPIO, PIN_SWDIO);
-    gpio_ll_pin_filter_disable(&GPIO, PIN_SWDIO);
+    gpio_ll_output_enable(&GPIO, swdio);
+    gpio_ll_od_disable(&GPIO, swdio);
+    gpio_ll_set_level(&GPIO, swdio, 1);
+    gpio_ll_pulldown_dis(&GPIO, swdio);
+    gpio_ll_pullup_en(&GPIO, swdio);
+    gpio_ll_pin_filter_disable(&GPIO, swdio);
 
     // Set RESET HIGH, pull-up only
-    gpio_ll_output_enable(&GPIO, PIN_nRST);
-    gpio_ll_od_disable(&GPIO, PIN_nRST);
-    gpio_ll_set_level(&GPIO, PIN_nRST, 1);
-    gpio_ll_pulldown_dis(&GPIO, PIN_nRST);
-    gpio_ll_pullup_en(&GPIO, PIN_nRST);
+    if (nrst >= 0) {
+        gpio_ll_output_enable(&GPIO, nrst);
+        gpio_ll_od_disable(&GPIO, nrst);
+        gpio_ll_set_level(&GPIO, nrst, 1);
+        gpio_ll_pulldown_dis(&GPIO, nrst);
+        gpio_ll_pullup_en(&GPIO, nrst);
+    }
+}
+
+static inline void PORT_OFF_PINS(uint32_t swclk, uint32_t swdio, int32_t nrst)
+{
+    gpio_ll_output_disable(&GPIO, swclk);
+    gpio_ll_output_disable(&GPIO, swdio);
+    gpio_ll_input_enable(&GPIO, swclk);
+    gpio_ll_input_enable(&GPIO, swdio);
+    if (nrst >= 0) {
+        gpio_ll_output_disable(&GPIO, nrst);
+        gpio_ll_input_enable(&GPIO, nrst);
+    }
+}
+
+static inline void PORT_SWD_SETUP(void)
+{
+    PORT_SWD_SETUP_PINS(PIN_SWCLK, PIN_SWDIO, PIN_nRST);
 }
 
 static inline void PORT_OFF(void)
 {
-    gpio_ll_output_disable(&GPIO, PIN_SWCLK);
-    gpio_ll_output_disable(&GPIO, PIN_SWDIO);
-    gpio_ll_output_disable(&GPIO, PIN_nRST);
-    gpio_ll_input_enable(&GPIO, PIN_SWCLK);
-    gpio_ll_input_enable(&GPIO, PIN_SWDIO);
-    gpio_ll_input_enable(&GPIO, PIN_nRST);
+    PORT_OFF_PINS(PIN_SWCLK, PIN_SWDIO, PIN_nRST);
 }
 
 static __always_inline uint32_t PIN_SWCLK_TCK_IN(void)
@@ -29,10 +29,23 @@
 #include "DAP_config.h"
 #include "DAP.h"
 
-// SW Macros
+// SW Macros, the port pins are loaded into swclk/swdio/swdio_mux locals of each function
 
-#define PIN_SWCLK_SET PIN_SWCLK_TCK_SET
-#define PIN_SWCLK_CLR PIN_SWCLK_TCK_CLR
+#define SW_PORT_LOCALS(port)                                            \
+  const uint32_t swclk = (port)->swclk;                                 \
+  const uint32_t swdio = (port)->swdio;                                 \
+  const uint32_t swdio_mux = GPIO_PIN_MUX_REG[(port)->swdio_pin];       \
+  DAP_Data_t *const dap = (port)->data;                                 \
+  (void)swdio_mux
+
+#define PIN_SWCLK_SET()       GPIO.out_w1ts = swclk
+#define PIN_SWCLK_CLR()       GPIO.out_w1tc = swclk
+#define PIN_SWDIO_SET()       GPIO.out_w1ts = swdio
+#define PIN_SWDIO_CLR()       GPIO.out_w1tc = swdio
+#define PIN_SWDIO_GET()       ((GPIO.in & swdio) ? 1U : 0U)
+#define PIN_SWDIO_PUT(bit)    if ((bit) & 1U) { PIN_SWDIO_SET(); } else { PIN_SWDIO_CLR(); }
+#define PIN_SWDIO_DRIVE()     GPIO.enable_w1ts = swdio; PIN_INPUT_DISABLE(swdio_mux)
+#define PIN_SWDIO_RELEASE()   GPIO.enable_w1tc = swdio; PIN_INPUT_ENABLE(swdio_mux)
 
 #define SW_CLOCK_CYCLE()                \
   PIN_SWCLK_CLR();                      \
@@ -41,7 +54,7 @@
   PIN_DELAY()
 
 #define SW_WRITE_BIT(bit)               \
-  PIN_SWDIO_OUT(bit);                   \
+  PIN_SWDIO_PUT(bit);                   \
   PIN_SWCLK_CLR();                      \
   PIN_DELAY();                          \
   PIN_SWCLK_SET();                      \
@@ -50,11 +63,21 @@
 #define SW_READ_BIT(bit)                \
   PIN_SWCLK_CLR();                      \
   PIN_DELAY();                          \
-  bit = PIN_SWDIO_IN();                 \
+  bit = PIN_SWDIO_GET();                \
   PIN_SWCLK_SET();                      \
   PIN_DELAY()
 
-#define PIN_DELAY() PIN_DELAY_SLOW(DAP_Data.clock_delay)
+#define PIN_DELAY() PIN_DELAY_SLOW(dap->clock_delay)
+
+
+// Port of the CMSIS-DAP commands and the default swd_host context
+DAP_Port_t DAP_DefaultPort = {
+  .swclk     = 1UL << PIN_SWCLK,
+  .swdio     = 1UL << PIN_SWDIO,
+  .nreset    = 1UL << PIN_nRST,
+  .swdio_pin = PIN_SWDIO,
+  .data      = &DAP_Data,
+};
 
 
 // Generate SWJ Sequence
@@ -62,7 +85,8 @@
 //   data:   pointer to sequence bit data
 //   return: none
 #if ((DAP_SWD != 0) || (DAP_JTAG != 0))
-void IRAM_ATTR SWJ_Sequence (uint32_t count, const uint8_t *data) {
+void IRAM_ATTR SWJ_Sequence_Port (const DAP_Port_t *port, uint32_t count, const uint8_t *data) {
+  SW_PORT_LOCALS(port);
   uint32_t val;
   uint32_t n;
 
@@ -74,15 +98,19 @@ void IRAM_ATTR SWJ_Sequence (uint32_t count, const uint8_t *data) {
       n = 8U;
     }
     if (val & 1U) {
-      PIN_SWDIO_TMS_SET();
+      PIN_SWDIO_SET();
     } else {
-      PIN_SWDIO_TMS_CLR();
+      PIN_SWDIO_CLR();
     }
     SW_CLOCK_CYCLE();
     val >>= 1;
     n--;
   }
 }
+
+void IRAM_ATTR SWJ_Sequence (uint32_t count, const uint8_t *data) {
+  SWJ_Sequence_Port(&DAP_DefaultPort, count, data);
+}
 #endif
 
 
@@ -92,7 +120,8 @@ void IRAM_ATTR SWJ_Sequence (uint32_t count, const uint8_t *data) {
 //   swdi:   pointer to SWDIO captured data
 //   return: none
 #if (DAP_SWD != 0)
-void IRAM_ATTR SWD_Sequence (uint32_t info, const uint8_t *swdo, uint8_t *swdi) {
+void IRAM_ATTR SWD_Sequence_Port (const DAP_Port_t *port, uint32_t info, const uint8_t *swdo, uint8_t *swdi) {
+  SW_PORT_LOCALS(port);
   uint32_t val;
   uint32_t bit;
   uint32_t n, k;
@@ -123,6 +152,10 @@ void IRAM_ATTR SWD_Sequence (uint32_t info, const uint8_t *swdo, uint8_t *swdi)
     }
   }
 }
+
+void IRAM_ATTR SWD_Sequence (uint32_t info, const uint8_t *swdo, uint8_t *swdi) {
+  SWD_Sequence_Port(&DAP_DefaultPort, info, swdo, swdi);
+}
 #endif
 
 
@@ -134,7 +167,8 @@ void IRAM_ATTR SWD_Sequence (uint32_t info, const uint8_t *swdo, uint8_t *swdi)
 //   data:    DATA[31:0]
 //   return:  ACK[2:0]
 #define SWD_TransferFunction(speed)     /**/                                    \
-static inline __attribute__((always_inline)) uint8_t SWD_Transfer##speed (uint32_t request, uint32_t *data) {         \
+static inline __attribute__((always_inline)) uint8_t SWD_Transfer##speed (const DAP_Port_t *port, uint32_t request, uint32_t *data) { \
+  SW_PORT_LOCALS(port);                                                         \
   uint32_t ack;                                                                 \
   uint32_t bit;                                                                 \
   uint32_t val;                                                                 \
@@ -162,8 +196,8 @@ static inline __attribute__((always_inline)) uint8_t SWD_Transfer##speed (uint32
   SW_WRITE_BIT(1U);                     /* Park Bit */                          \
                                                                                 \
   /* Turnaround */                                                              \
-  PIN_SWDIO_OUT_DISABLE();                                                      \
-  for (n = DAP_Data.swd_conf.turnaround; n; n--) {                              \
+  PIN_SWDIO_RELEASE();                                                          \
+  for (n = dap->swd_conf.turnaround; n; n--) {                                  \
     SW_CLOCK_CYCLE();                                                           \
   }                                                                             \
                                                                                 \
@@ -193,16 +227,16 @@ static inline __attribute__((always_inline)) uint8_t SWD_Transfer##speed (uint32
       }                                                                         \
       if (data) { *data = val; }                                                \
       /* Turnaround */                                                          \
-      for (n = DAP_Data.swd_conf.turnaround; n; n--) {                          \
+      for (n = dap->swd_conf.turnaround; n; n--) {                              \
         SW_CLOCK_CYCLE();                                                       \
       }                                                                         \
-      PIN_SWDIO_OUT_ENABLE();                                                   \
+      PIN_SWDIO_DRIVE();                                                        \
     } else {                                                                    \
       /* Turnaround */                                                          \
-      for (n = DAP_Data.swd_conf.turnaround; n; n--) {                          \
+      for (n = dap->swd_conf.turnaround; n; n--) {                              \
         SW_CLOCK_CYCLE();                                                       \
       }                                                                         \
-      PIN_SWDIO_OUT_ENABLE();                                                   \
+      PIN_SWDIO_DRIVE();                                                        \
       /* Write data */                                                          \
       val = *data;                                                              \
       parity = 0U;                                                              \
@@ -215,48 +249,48 @@ static inline __attribute__((always_inline)) uint8_t SWD_Transfer##speed (uint32
     }                                                                           \
     /* Capture Timestamp */                                                     \
     if (request & DAP_TRANSFER_TIMESTAMP) {                                     \
-      DAP_Data.timestamp = TIMESTAMP_GET();                                     \
+      dap->timestamp = TIMESTAMP_GET();                                         \
     }                                                                           \
     /* Idle cycles */                                                           \
-    n = DAP_Data.transfer.idle_cycles;                                          \
+    n = dap->transfer.idle_cycles;                                              \
     if (n) {                                                                    \
-      PIN_SWDIO_OUT(0U);                                                        \
+      PIN_SWDIO_PUT(0U);                                                        \
       for (; n; n--) {                                                          \
         SW_CLOCK_CYCLE();                                                       \
       }                                                                         \
     }                                                                           \
-    PIN_SWDIO_OUT(1U);                                                          \
+    PIN_SWDIO_PUT(1U);                                                          \
     return ((uint8_t)ack);                                                      \
   }                                                                             \
                                                                                 \
   if ((ack == DAP_TRANSFER_WAIT) || (ack == DAP_TRANSFER_FAULT)) {              \
     /* WAIT or FAULT response */                                                \
-    if (DAP_Data.swd_conf.data_phase && ((request & DAP_TRANSFER_RnW) != 0U)) { \
+    if (dap->swd_conf.data_phase && ((request & DAP_TRANSFER_RnW) != 0U)) {     \
       for (n = 32U+1U; n; n--) {                                                \
         SW_CLOCK_CYCLE();               /* Dummy Read RDATA[0:31] + Parity */   \
       }                                                                         \
     }                                                                           \
     /* Turnaround */                                                            \
-    for (n = DAP_Data.swd_conf.turnaround; n; n--) {                            \
+    for (n = dap->swd_conf.turnaround; n; n--) {                                \
       SW_CLOCK_CYCLE();                                                         \
     }                                                                           \
-    PIN_SWDIO_OUT_ENABLE();                                                     \
-    if (DAP_Data.swd_conf.data_phase && ((request & DAP_TRANSFER_RnW) == 0U)) { \
-      PIN_SWDIO_OUT(0U);                                                        \
+    PIN_SWDIO_DRIVE();                                                          \
+    if (dap->swd_conf.data_phase && ((request & DAP_TRANSFER_RnW) == 0U)) {     \
+      PIN_SWDIO_PUT(0U);                                                        \
       for (n = 32U+1U; n; n--) {                                                \
         SW_CLOCK_CYCLE();               /* Dummy Write WDATA[0:31] + Parity */  \
       }                                                                         \
     }                                                                           \
-    PIN_SWDIO_OUT(1U);                                                          \
+    PIN_SWDIO_PUT(1U);                                                          \
     return ((uint8_t)ack);                                                      \
   }                                                                             \
                                                                                 \
   /* Protocol error */                                                          \
-  for (n = DAP_Data.swd_conf.turnaround + 32U + 1U; n; n--) {                   \
+  for (n = dap->swd_conf.turnaround + 32U + 1U; n; n--) {                       \
     SW_CLOCK_CYCLE();                   /* Back off data phase */               \
   }                                                                             \
-  PIN_SWDIO_OUT_ENABLE();                                                       \
-  PIN_SWDIO_OUT(1U);                                                            \
+  PIN_SWDIO_DRIVE();                                                            \
+  PIN_SWDIO_PUT(1U);                                                            \
   return ((uint8_t)ack);                                                        \
 }
 
@@ -266,21 +300,30 @@ static inline __attribute__((always_inline)) uint8_t SWD_Transfer##speed (uint32
 SWD_TransferFunction(Fast)
 
 #undef  PIN_DELAY
-#define PIN_DELAY() PIN_DELAY_SLOW(DAP_Data.clock_delay)
+#define PIN_DELAY() PIN_DELAY_SLOW(dap->clock_delay)
 SWD_TransferFunction(Slow)
 
 
 // SWD Transfer I/O
+//   port:    pins and transfer settings
 //   request: A[3:2] RnW APnDP
 //   data:    DATA[31:0]
 //   return:  ACK[2:0]
-uint8_t IRAM_ATTR SWD_Transfer(uint32_t request, uint32_t *data) {
-  if (DAP_Data.fast_clock) {
-    return SWD_TransferFast(request, data);
+uint8_t IRAM_ATTR SWD_Transfer_Port(const DAP_Port_t *port, uint32_t request, uint32_t *data) {
+  if (port->data->fast_clock) {
+    return SWD_TransferFast(port, request, data);
   } else {
-    return SWD_TransferSlow(request, data);
+    return SWD_TransferSlow(port, request, data);
   }
 }
 
+// SWD Transfer I/O
+//   request: A[3:2] RnW APnDP
+//   data:    DATA[31:0]
+//   return:  ACK[2:0]
+uint8_t IRAM_ATTR SWD_Transfer(uint32_t request, uint32_t *data) {
+  return SWD_Transfer_Port(&DAP_DefaultPort, request, data);
+}
+
 
 #endif  /* (DAP_SWD != 0) */
@@ -154,6 +154,14 @@
 #define SYSRESETREQ    0x00000004  // Reset System (except Debug)
 #define VECTKEY        0x05FA0000  // Write Key
 
+// SCB: Coprocessor Access Control Register
+#define NVIC_CPACR     (NVIC_Addr + 0x0D88)
+#define CPACR_CP10_CP11 0x00F00000 // CP10/CP11 (FPU) access
+
+// FPU: Media and VFP Feature Register 0
+#define NVIC_MVFR0     (NVIC_Addr + 0x0F40)
+#define MVFR0_SP       0x000000F0  // Single precision support
+
 // NVIC: Debug Fault Status Register
 #define NVIC_DFSR      (NVIC_Addr + 0x0D30)
 #define HALTED         0x00000001  // Halt Flag
@@ -0,0 +1,325 @@
+/**
+ * @file    swd_async.c
+ * @brief   Implementation of swd_async.h
+ */
+
+#include <stdbool.h>
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/event_groups.h>
+#include <freertos/semphr.h>
+
+#include "swd_async.h"
+#include "swd_host.h"
+
+#include <esp_log.h>
+#define ASYNC_TAG "swd_async"
+
+#ifndef CONFIG_ESP_SWD_ASYNC_MAX_OPS
+#define CONFIG_ESP_SWD_ASYNC_MAX_OPS 8
+#endif
+
+#ifndef CONFIG_ESP_SWD_ASYNC_CHUNK_SIZE
+#define CONFIG_ESP_SWD_ASYNC_CHUNK_SIZE 1024
+#endif
+
+#ifndef CONFIG_ESP_SWD_ASYNC_TASK_STACK
+#define CONFIG_ESP_SWD_ASYNC_TASK_STACK 3072
+#endif
+
+#ifndef CONFIG_ESP_SWD_ASYNC_TASK_PRIO
+#define CONFIG_ESP_SWD_ASYNC_TASK_PRIO 10
+#endif
+
+#ifndef CONFIG_ESP_SWD_ASYNC_TASK_CORE
+#define CONFIG_ESP_SWD_ASYNC_TASK_CORE -1
+#endif
+
+// One event group bit per slot, FreeRTOS leaves 24 usable bits
+#if CONFIG_ESP_SWD_ASYNC_MAX_OPS > 24
+#error "CONFIG_ESP_SWD_ASYNC_MAX_OPS must not exceed 24"
+#endif
+
+struct swd_async_op {
+    uint32_t address;
+    uint8_t *data;
+    uint32_t size;
+    volatile uint32_t transferred;
+    swd_async_cb_t cb;
+    void *cb_arg;
+    swd_ctx_t *ctx;     // Context of the submitting task
+    volatile swd_async_state_t state;
+    volatile bool cancel;
+    bool write;
+    bool in_use;
+    uint8_t slot;
+};
+
+static swd_async_op_t op_pool[CONFIG_ESP_SWD_ASYNC_MAX_OPS];
+static portMUX_TYPE pool_lock = portMUX_INITIALIZER_UNLOCKED;
+static QueueHandle_t op_queue = NULL;
+static EventGroupHandle_t op_done = NULL;
+static SemaphoreHandle_t init_lock = NULL;
+static StaticSemaphore_t init_lock_buf;
+
+static bool swd_async_final(swd_async_state_t state)
+{
+    return state != SWD_ASYNC_PENDING && state != SWD_ASYNC_RUNNING;
+}
+
+static swd_async_state_t swd_async_execute(swd_async_op_t *op)
+{
+    uint32_t n;
+    uint8_t ok;
+
+    while (op->transferred < op->size) {
+        if (op->cancel) {
+            return SWD_ASYNC_CANCELLED;
+        }
+
+        n = op->size - op->transferred;
+        if (n > CONFIG_ESP_SWD_ASYNC_CHUNK_SIZE) {
+            n = CONFIG_ESP_SWD_ASYNC_CHUNK_SIZE;
+        }
+
+        if (op->write) {
+            ok = swd_write_memory(op->address + op->transferred, op->data + op->transferred, n);
+        } else {
+            ok = swd_read_memory(op->address + op->transferred, op->data + op->transferred, n);
+        }
+
+        if (!ok) {
+            if (op->cancel) {
+                // Aborted in the middle of a block, leave the DP in a clean state
+                swd_ctx_set_abort(op->ctx, 0);
+                swd_clear_errors();
+                return SWD_ASYNC_CANCELLED;
+            }
+
+            ESP_LOGE(ASYNC_TAG, "Transfer failed at 0x%lx", op->address + op->transferred);
+            return SWD_ASYNC_FAILED;
+        }
+
+        op->transferred += n;
+    }
+
+    return SWD_ASYNC_DONE;
+}
+
+static void swd_async_worker(void *arg)
+{
+    QueueHandle_t queue = arg;
+    swd_async_op_t *op = NULL;
+    swd_async_state_t result;
+    swd_async_cb_t cb;
+    void *cb_arg;
+
+    while (true) {
+        if (xQueueReceive(queue, &op, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+
+        swd_ctx_bind(op->ctx);
+        swd_ctx_set_abort(op->ctx, 0);
+
+        portENTER_CRITICAL(&pool_lock);
+        if (op->cancel) {
+            result = SWD_ASYNC_CANCELLED;
+        } else {
+            op->state = SWD_ASYNC_RUNNING;
+            result = SWD_ASYNC_RUNNING;
+        }
+        portEXIT_CRITICAL(&pool_lock);
+
+        if (result == SWD_ASYNC_RUNNING) {
+            result = swd_async_execute(op);
+        }
+
+        swd_ctx_set_abort(op->ctx, 0);
+        cb = op->cb;
+        cb_arg = op->cb_arg;
+
+        // Once the state is final the slot may be released and reused at any time,
+        // so the done bit goes up first and nothing in op is touched afterwards
+        xEventGroupSetBits(op_done, 1UL << op->slot);
+        op->state = result;
+
+        if (cb != NULL) {
+            cb(op, result, cb_arg);
+        }
+    }
+}
+
+static swd_async_op_t *swd_async_submit(bool write, uint32_t address, uint8_t *data, uint32_t size, swd_async_cb_t cb, void *cb_arg)
+{
+    swd_async_op_t *op = NULL;
+
+    if (op_queue == NULL && !swd_async_init()) {
+        return NULL;
+    }
+
+    portENTER_CRITICAL(&pool_lock);
+    for (uint32_t i = 0; i < CONFIG_ESP_SWD_ASYNC_MAX_OPS; i++) {
+        if (!op_pool[i].in_use) {
+            op = &op_pool[i];
+            op->in_use = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&pool_lock);
+
+    if (op == NULL) {
+        ESP_LOGE(ASYNC_TAG, "No free operation slot");
+        return NULL;
+    }
+
+    op->address = address;
+    op->data = data;
+    op->size = size;
+    op->transferred = 0;
+    op->cb = cb;
+    op->cb_arg = cb_arg;
+    op->ctx = swd_ctx_current();
+    swd_ctx_acquire(op->ctx);
+    op->state = SWD_ASYNC_PENDING;
+    op->cancel = false;
+    op->write = write;
+    xEventGroupClearBits(op_done, 1UL << op->slot);
+
+    if (xQueueSend(op_queue, &op, 0) != pdTRUE) {
+        ESP_LOGE(ASYNC_TAG, "Queue full");
+        swd_ctx_release(op->ctx);
+        op->in_use = false;
+        return NULL;
+    }
+
+    return op;
+}
+
+// op_queue is published last, a task that sees it set finds the worker running
+static uint8_t swd_async_setup(void)
+{
+    QueueHandle_t queue;
+
+    if (op_queue != NULL) {
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < CONFIG_ESP_SWD_ASYNC_MAX_OPS; i++) {
+        op_pool[i].slot = i;
+        op_pool[i].in_use = false;
+    }
+
+    if (op_done == NULL) {
+        op_done = xEventGroupCreate();
+        if (op_done == NULL) {
+            return 0;
+        }
+    }
+
+    queue = xQueueCreate(CONFIG_ESP_SWD_ASYNC_MAX_OPS, sizeof(swd_async_op_t *));
+    if (queue == NULL) {
+        return 0;
+    }
+
+    BaseType_t core = CONFIG_ESP_SWD_ASYNC_TASK_CORE < 0 ? tskNO_AFFINITY : CONFIG_ESP_SWD_ASYNC_TASK_CORE;
+    if (xTaskCreatePinnedToCore(swd_async_worker, "swd_async", CONFIG_ESP_SWD_ASYNC_TASK_STACK, queue,
+                                CONFIG_ESP_SWD_ASYNC_TASK_PRIO, NULL, core) != pdPASS) {
+        ESP_LOGE(ASYNC_TAG, "Failed to create worker");
+        vQueueDelete(queue);
+        return 0;
+    }
+
+    op_queue = queue;
+    return 1;
+}
+
+uint8_t swd_async_init(void)
+{
+    uint8_t ret;
+
+    // Two tasks submitting their first transfer at once must not start two workers
+    if (init_lock == NULL) {
+        portENTER_CRITICAL(&pool_lock);
+        if (init_lock == NULL) {
+            init_lock = xSemaphoreCreateMutexStatic(&init_lock_buf);
+        }
+        portEXIT_CRITICAL(&pool_lock);
+    }
+
+    xSemaphoreTake(init_lock, portMAX_DELAY);
+    ret = swd_async_setup();
+    xSemaphoreGive(init_lock);
+
+    return ret;
+}
+
+swd_async_op_t *swd_write_memory_async(uint32_t address, uint8_t *data, uint32_t size, swd_async_cb_t cb, void *cb_arg)
+{
+    return swd_async_submit(true, address, data, size, cb, cb_arg);
+}
+
+swd_async_op_t *swd_read_memory_async(uint32_t address, uint8_t *data, uint32_t size, swd_async_cb_t cb, void *cb_arg)
+{
+    return swd_async_submit(false, address, data, size, cb, cb_arg);
+}
+
+swd_async_state_t swd_async_poll(const swd_async_op_t *op)
+{
+    return op->state;
+}
+
+swd_async_state_t swd_async_wait(swd_async_op_t *op, TickType_t timeout)
+{
+    if (xEventGroupWaitBits(op_done, 1UL << op->slot, pdFALSE, pdTRUE, timeout) & (1UL << op->slot)) {
+        // The worker sets the bit just before the final state
+        while (!swd_async_final(op->state)) {
+            vTaskDelay(1);
+        }
+    }
+
+    return op->state;
+}
+
+uint32_t swd_async_progress(const swd_async_op_t *op)
+{
+    return op->transferred;
+}
+
+uint8_t swd_async_cancel(swd_async_op_t *op)
+{
+    uint8_t ret = 0;
+
+    portENTER_CRITICAL(&pool_lock);
+    if (op->state == SWD_ASYNC_PENDING || op->state == SWD_ASYNC_RUNNING) {
+        op->cancel = true;
+        if (op->state == SWD_ASYNC_RUNNING) {
+            swd_ctx_set_abort(op->ctx, 1);
+        }
+        ret = 1;
+    }
+    portEXIT_CRITICAL(&pool_lock);
+
+    return ret;
+}
+
+// The handle must have reached a final state before it is released
+void swd_async_release(swd_async_op_t *op)
+{
+    if (op == NULL) {
+        return;
+    }
+
+    if (!swd_async_final(op->state)) {
+        ESP_LOGW(ASYNC_TAG, "Releasing an unfinished operation, cancelling it first");
+        swd_async_cancel(op);
+        swd_async_wait(op, portMAX_DELAY);
+    }
+
+    swd_ctx_release(op->ctx);
+    portENTER_CRITICAL(&pool_lock);
+    op->in_use = false;
+    portEXIT_CRITICAL(&pool_lock);
+}
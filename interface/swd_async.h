@@ -0,0 +1,49 @@
+/**
+ * @file    swd_async.h
+ * @brief   Non-blocking memory transfers executed by a dedicated SWD worker task
+ *
+ * Transfers are queued to the worker and return a handle immediately. Completion
+ * can be polled, waited for, or reported through a callback (called from the
+ * worker task). A running transfer can be cancelled; the abort is delivered
+ * through the abort flag of its context so the current block stops at the next
+ * SWD transfer. Each transfer runs on the swd_ctx_t of the task that queued it.
+ *
+ * The callback runs after the state became final. Release the handle either from
+ * the callback or from the task that polls/waits, as a released slot is reused.
+ * test/host runs the worker on Linux against a simulated target.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    SWD_ASYNC_PENDING,      // Queued, not started yet
+    SWD_ASYNC_RUNNING,      // Being transferred by the worker
+    SWD_ASYNC_DONE,         // Completed successfully
+    SWD_ASYNC_FAILED,       // SWD error, see swd_async_progress() for the bytes that made it
+    SWD_ASYNC_CANCELLED,    // Cancelled by swd_async_cancel()
+} swd_async_state_t;
+
+typedef struct swd_async_op swd_async_op_t;
+
+// Called from the worker task once the operation reached a final state
+typedef void (*swd_async_cb_t)(swd_async_op_t *op, swd_async_state_t state, void *arg);
+
+uint8_t swd_async_init(void);
+swd_async_op_t *swd_write_memory_async(uint32_t address, uint8_t *data, uint32_t size, swd_async_cb_t cb, void *cb_arg);
+swd_async_op_t *swd_read_memory_async(uint32_t address, uint8_t *data, uint32_t size, swd_async_cb_t cb, void *cb_arg);
+swd_async_state_t swd_async_poll(const swd_async_op_t *op);
+swd_async_state_t swd_async_wait(swd_async_op_t *op, TickType_t timeout);
+uint32_t swd_async_progress(const swd_async_op_t *op);
+uint8_t swd_async_cancel(swd_async_op_t *op);
+void swd_async_release(swd_async_op_t *op);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,275 @@
+/**
+ * @file    swd_flash.c
+ * @brief   Implementation of swd_flash.h
+ */
+
+#include <stdlib.h>
+#include <esp_rom_crc.h>
+#include <esp_memory_utils.h>
+
+#include "swd_flash.h"
+
+#include <esp_log.h>
+#define FLASH_TAG "swd_flash"
+
+// Smallest data cache line of the supported chips
+#define FLASH_CACHE_LINE 32
+
+// Bitwise reflected CRC32 (0xEDB88320), position independent Thumb-1 code:
+// r0 = address, r1 = length, r2 = ~initial CRC, returns the final CRC in r0
+static const uint32_t crc32_code[] = {
+    0x4B08B430, // push {r4, r5}; ldr r3, =0xEDB88320
+    0xD00A2900, // loop: cmp r1, #0; beq done
+    0x30017804, // ldrb r4, [r0]; adds r0, #1
+    0x25084062, // eors r2, r4; movs r5, #8
+    0xD3000852, // bit: lsrs r2, r2, #1; bcc next
+    0x3D01405A, // eors r2, r3; next: subs r5, #1
+    0x3901D1FA, // bne bit; subs r1, #1
+    0x43D0E7F2, // b loop; done: mvns r0, r2
+    0x4770BC30, // pop {r4, r5}; bx lr
+    0xEDB88320,
+};
+
+typedef struct {
+    const swd_flash_config_t *cfg;
+    uint32_t addr;
+    uint32_t size;
+    const uint8_t *data;        // Image in ESP32 memory, NULL when fetched
+    swd_flash_fetch_cb_t fetch;
+    void *arg;
+    uint8_t *stage;             // One page for fetched images
+} flash_job_t;
+
+static uint32_t flash_page_len(const flash_job_t *job, uint32_t page)
+{
+    uint32_t ofs = page * job->cfg->page_size;
+    uint32_t len = job->size - ofs;
+    return (len > job->cfg->page_size) ? job->cfg->page_size : len;
+}
+
+static uint32_t flash_page_buf(const flash_job_t *job, uint32_t page)
+{
+    return job->cfg->buf_addr[page % job->cfg->buf_count];
+}
+
+// Pull data held in mapped flash or PSRAM into the cache with one read per line, so cache
+// misses happen here and not in the middle of an SWD block transfer
+void swd_flash_prefetch(const void *data, uint32_t len)
+{
+    const volatile uint8_t *p = data;
+
+    if (len == 0 || esp_ptr_internal(data)) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < len; i += FLASH_CACHE_LINE) {
+        (void)p[i];
+    }
+    (void)p[len - 1];
+}
+
+static uint8_t flash_upload(flash_job_t *job, uint32_t page)
+{
+    uint32_t ofs = page * job->cfg->page_size;
+    uint32_t len = flash_page_len(job, page);
+    uint8_t *src;
+
+    if (job->data != NULL) {
+        src = (uint8_t *)job->data + ofs;
+        swd_flash_prefetch(src, len);
+    } else {
+        if (job->fetch(job->addr + ofs, job->stage, len, job->arg) != len) {
+            ESP_LOGE(FLASH_TAG, "Fetch failed at 0x%08lx", job->addr + ofs);
+            return 0;
+        }
+        src = job->stage;
+    }
+
+    if (!swd_write_memory(flash_page_buf(job, page), src, len)) {
+        ESP_LOGE(FLASH_TAG, "Upload failed at 0x%08lx", job->addr + ofs);
+        return 0;
+    }
+
+    return 1;
+}
+
+static uint8_t flash_start(flash_job_t *job, uint32_t page)
+{
+    const swd_flash_config_t *cfg = job->cfg;
+    uint32_t adr = job->addr + page * cfg->page_size;
+
+    return swd_flash_syscall_exec_async(&cfg->sys_call, cfg->program_page, adr, flash_page_len(job, page), flash_page_buf(job, page), 0);
+}
+
+static uint8_t flash_wait(const swd_flash_config_t *cfg)
+{
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint32_t prev;
+    uint8_t ok;
+
+    if (cfg->timeout_us == 0) {
+        return swd_flash_syscall_wait_result(FLASHALGO_RETURN_BOOL, NULL);
+    }
+
+    // The algorithm's own deadline, only for this call
+    swd_ctx_lock(ctx);
+    prev = swd_get_halt_timeout();
+    swd_set_halt_timeout(cfg->timeout_us);
+    ok = swd_flash_syscall_wait_result(FLASHALGO_RETURN_BOOL, NULL);
+    swd_set_halt_timeout(prev);
+    swd_ctx_unlock(ctx);
+    return ok;
+}
+
+static uint8_t flash_finish(flash_job_t *job, uint32_t page, uint8_t wait)
+{
+    uint8_t ok = wait ? flash_wait(job->cfg) : swd_flash_syscall_result(FLASHALGO_RETURN_BOOL, NULL);
+
+    if (!ok) {
+        ESP_LOGE(FLASH_TAG, "ProgramPage failed at 0x%08lx", job->addr + page * job->cfg->page_size);
+    }
+
+    return ok;
+}
+
+// Pages go uploaded -> started -> done, at most buf_count of them are in target RAM
+static uint8_t flash_run(flash_job_t *job)
+{
+    uint32_t pages = (job->size + job->cfg->page_size - 1) / job->cfg->page_size;
+    uint32_t uploaded = 0, started = 0, done = 0;
+    uint8_t halted;
+
+    while (done < pages) {
+        // Keep the core busy, start the next page as soon as the previous one finished
+        if (started == done && started < uploaded) {
+            if (!flash_start(job, started)) {
+                return 0;
+            }
+            started++;
+            continue;
+        }
+
+        if (uploaded < pages && uploaded - done < job->cfg->buf_count) {
+            if (!flash_upload(job, uploaded)) {
+                return 0;
+            }
+            uploaded++;
+
+            if (started > done) {
+                if (!swd_is_halted(&halted)) {
+                    return 0;
+                }
+
+                if (halted) {
+                    if (!flash_finish(job, done, 0)) {
+                        return 0;
+                    }
+                    done++;
+                }
+            }
+            continue;
+        }
+
+        // All buffers are full, nothing to do until the running page finished
+        if (!flash_finish(job, done, 1)) {
+            return 0;
+        }
+        done++;
+    }
+
+    return 1;
+}
+
+static uint8_t flash_check_config(const swd_flash_config_t *cfg)
+{
+    if (cfg->buf_count == 0 || cfg->buf_count > CONFIG_ESP_SWD_FLASH_MAX_BUFFERS || cfg->page_size == 0) {
+        ESP_LOGE(FLASH_TAG, "Invalid pipeline config");
+        return 0;
+    }
+
+    return 1;
+}
+
+// Program size bytes of data at addr
+uint8_t swd_flash_program(const swd_flash_config_t *cfg, uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    flash_job_t job = {
+        .cfg = cfg,
+        .addr = addr,
+        .size = size,
+        .data = data,
+    };
+
+    if (!flash_check_config(cfg)) {
+        return 0;
+    }
+
+    return flash_run(&job);
+}
+
+// Program size bytes at addr, pulling the image page by page through fetch
+uint8_t swd_flash_program_stream(const swd_flash_config_t *cfg, uint32_t addr, uint32_t size, swd_flash_fetch_cb_t fetch, void *arg)
+{
+    uint8_t ret;
+    flash_job_t job = {
+        .cfg = cfg,
+        .addr = addr,
+        .size = size,
+        .fetch = fetch,
+        .arg = arg,
+    };
+
+    if (!flash_check_config(cfg)) {
+        return 0;
+    }
+
+    job.stage = malloc(cfg->page_size);
+    if (job.stage == NULL) {
+        ESP_LOGE(FLASH_TAG, "No memory for a %lu byte page", cfg->page_size);
+        return 0;
+    }
+
+    ret = flash_run(&job);
+    free(job.stage);
+    return ret;
+}
+
+// CRC32 of size bytes of target memory at addr, computed by the target in the first page buffer.
+// Compatible with esp_rom_crc32_le(0, ...).
+uint8_t swd_flash_crc32(const swd_flash_config_t *cfg, uint32_t addr, uint32_t size, uint32_t *crc)
+{
+    uint32_t code_addr = cfg->buf_addr[0];
+
+    if (!flash_check_config(cfg) || cfg->page_size < sizeof(crc32_code)) {
+        return 0;
+    }
+
+    if (!swd_write_memory(code_addr, (uint8_t *)crc32_code, sizeof(crc32_code))) {
+        ESP_LOGE(FLASH_TAG, "CRC routine upload failed");
+        return 0;
+    }
+
+    if (!swd_flash_syscall_exec(&cfg->sys_call, code_addr | 1, addr, size, 0xFFFFFFFF, 0, FLASHALGO_RETURN_VALUE, crc)) {
+        ESP_LOGE(FLASH_TAG, "CRC routine failed at 0x%08lx", addr);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Verify programmed flash against data by CRC instead of reading it back
+uint8_t swd_flash_verify_crc(const swd_flash_config_t *cfg, uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    uint32_t crc;
+
+    if (!swd_flash_crc32(cfg, addr, size, &crc)) {
+        return 0;
+    }
+
+    if (crc != esp_rom_crc32_le(0, data, size)) {
+        ESP_LOGE(FLASH_TAG, "CRC mismatch at 0x%08lx, target 0x%08lx", addr, crc);
+        return 0;
+    }
+
+    return 1;
+}
@@ -0,0 +1,49 @@
+/**
+ * @file    swd_flash.h
+ * @brief   Pipelined flash download through a CMSIS flash algorithm
+ *
+ * Target RAM is split into two or more page buffers. While ProgramPage runs on
+ * one buffer (started with swd_flash_syscall_exec_async()), the next pages are
+ * written into the free buffers through the MEM-AP, and DHCSR is checked between
+ * uploads so a finished page is followed by the next one right away. The flash
+ * must already be erased and the algorithm initialised with Init().
+ *
+ * swd_flash_verify_crc() checks the result without reading it back: a small CRC32
+ * routine is placed in the first page buffer and run with the algorithm's stack
+ * and breakpoint, and its result is compared with esp_rom_crc32_le() of the image.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "swd_host.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef CONFIG_ESP_SWD_FLASH_MAX_BUFFERS
+#define CONFIG_ESP_SWD_FLASH_MAX_BUFFERS 4
+#endif
+
+typedef struct {
+    program_syscall_t sys_call;
+    uint32_t program_page;      // ProgramPage(adr, sz, buf) entry point
+    uint32_t page_size;
+    uint32_t timeout_us;        // Per ProgramPage call, 0 for the swd_get_halt_timeout() deadline
+    uint8_t buf_count;          // 2 or more to overlap uploads with programming
+    uint32_t buf_addr[CONFIG_ESP_SWD_FLASH_MAX_BUFFERS];   // Page buffers in target RAM
+} swd_flash_config_t;
+
+// Fill dst with len bytes of the image at flash address addr, returns the bytes written
+typedef uint32_t (*swd_flash_fetch_cb_t)(uint32_t addr, uint8_t *dst, uint32_t len, void *arg);
+
+uint8_t swd_flash_program(const swd_flash_config_t *cfg, uint32_t addr, const uint8_t *data, uint32_t size);
+uint8_t swd_flash_program_stream(const swd_flash_config_t *cfg, uint32_t addr, uint32_t size, swd_flash_fetch_cb_t fetch, void *arg);
+uint8_t swd_flash_crc32(const swd_flash_config_t *cfg, uint32_t addr, uint32_t size, uint32_t *crc);
+void swd_flash_prefetch(const void *data, uint32_t len);
+uint8_t swd_flash_verify_crc(const swd_flash_config_t *cfg, uint32_t addr, const uint8_t *data, uint32_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,824 @@
+/**
+ * @file    swd_flm.c
+ * @brief   Implementation of swd_flm.h
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_rom_crc.h>
+
+#include "swd_flm.h"
+
+#include <esp_log.h>
+#define FLM_TAG "swd_flm"
+
+#ifndef CONFIG_ESP_SWD_FLM_STACK_SIZE
+#define CONFIG_ESP_SWD_FLM_STACK_SIZE 1024
+#endif
+
+#ifndef CONFIG_ESP_SWD_FLM_CACHE_ENTRIES
+#define CONFIG_ESP_SWD_FLM_CACHE_ENTRIES 2
+#endif
+
+#ifndef CONFIG_ESP_SWD_FLM_HASH_CACHE_ENTRIES
+#define CONFIG_ESP_SWD_FLM_HASH_CACHE_ENTRIES 2
+#endif
+
+// BKPT #0 followed by b . (0xE7FE), the algorithms return here
+#define FLM_HEADER_WORD     0xE7FEBE00
+#define FLM_HEADER_SIZE     8
+#define FLM_MAX_SEGMENTS    4
+
+#define ELF_CLASS32         1
+#define ELF_DATA_LSB        1
+#define ELF_MACHINE_ARM     40
+#define ELF_PT_LOAD         1
+#define ELF_PF_W            2
+#define ELF_SHT_SYMTAB      2
+#define ELF_SHN_LORESERVE   0xff00
+
+// FlashDevice from FlashOS.h, offsets of the natural-aligned struct
+#define DEV_ADR_OFS         132
+#define DEV_SIZE_OFS        136
+#define DEV_PAGE_OFS        140
+#define DEV_EMPTY_OFS       148
+#define DEV_TO_PROG_OFS     152
+#define DEV_TO_ERASE_OFS    156
+#define DEV_SECTORS_OFS     160
+#define DEV_SECTOR_END      0xFFFFFFFF
+
+typedef struct {
+    uint8_t ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint32_t entry;
+    uint32_t phoff;
+    uint32_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} elf_ehdr_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t vaddr;
+    uint32_t paddr;
+    uint32_t filesz;
+    uint32_t memsz;
+    uint32_t flags;
+    uint32_t align;
+} elf_phdr_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t type;
+    uint32_t flags;
+    uint32_t addr;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t link;
+    uint32_t info;
+    uint32_t addralign;
+    uint32_t entsize;
+} elf_shdr_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t value;
+    uint32_t size;
+    uint8_t info;
+    uint8_t other;
+    uint16_t shndx;
+} elf_sym_t;
+
+// The file is read either from memory or from a partition
+typedef struct {
+    const uint8_t *mem;
+    const esp_partition_t *part;
+    uint32_t offset;
+    uint32_t size;
+} flm_src_t;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t vaddr;
+    uint32_t filesz;
+    uint32_t memsz;
+} flm_segment_t;
+
+typedef struct {
+    uint8_t valid;
+    uint8_t seg_count;
+    uint32_t crc;
+    uint32_t size;
+    uint32_t ram_start;
+    uint32_t ram_size;
+    flm_segment_t seg[FLM_MAX_SEGMENTS];
+    swd_flm_t flm;
+} flm_cache_t;
+
+static flm_cache_t flm_cache[CONFIG_ESP_SWD_FLM_CACHE_ENTRIES];
+static uint8_t flm_cache_next = 0;
+
+// Per-sector CRCs of an image, see swd_flm_program_diff()
+typedef struct {
+    uint32_t tag;
+    uint32_t addr;
+    uint32_t size;
+    uint32_t count;
+    uint32_t layout;        // flm_layout_crc() of the algorithm the CRCs were computed for
+    uint8_t erased_value;
+    uint32_t *crc;
+} flm_hash_t;
+
+static flm_hash_t flm_hash[CONFIG_ESP_SWD_FLM_HASH_CACHE_ENTRIES];
+static uint8_t flm_hash_next = 0;
+
+static const struct {
+    const char *name;
+    size_t field;
+} flm_entries[] = {
+    {"Init", offsetof(swd_flm_t, init)},
+    {"UnInit", offsetof(swd_flm_t, uninit)},
+    {"EraseChip", offsetof(swd_flm_t, erase_chip)},
+    {"EraseSector", offsetof(swd_flm_t, erase_sector)},
+    {"ProgramPage", offsetof(swd_flm_t, program_page)},
+    {"Verify", offsetof(swd_flm_t, verify)},
+    {"BlankCheck", offsetof(swd_flm_t, blank_check)},
+};
+
+static uint8_t flm_read(const flm_src_t *src, uint32_t ofs, void *dst, uint32_t len)
+{
+    if (ofs > src->size || len > src->size - ofs) {
+        return 0;
+    }
+
+    if (src->mem != NULL) {
+        memcpy(dst, src->mem + ofs, len);
+        return 1;
+    }
+
+    return esp_partition_read(src->part, src->offset + ofs, dst, len) == ESP_OK;
+}
+
+// Entry index of a table at ofs, an offset that wraps around is rejected like one past the end
+static uint8_t flm_read_entry(const flm_src_t *src, uint32_t ofs, uint32_t index, void *dst, uint32_t len)
+{
+    uint64_t pos = (uint64_t)ofs + (uint64_t)index * len;
+
+    if (pos > src->size) {
+        return 0;
+    }
+
+    return flm_read(src, (uint32_t)pos, dst, len);
+}
+
+static uint32_t flm_get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint8_t flm_crc(const flm_src_t *src, uint32_t *crc)
+{
+    uint8_t buf[256];
+    uint32_t n;
+
+    *crc = 0;
+    for (uint32_t ofs = 0; ofs < src->size; ofs += n) {
+        n = src->size - ofs;
+        if (n > sizeof(buf)) {
+            n = sizeof(buf);
+        }
+
+        if (!flm_read(src, ofs, buf, n)) {
+            return 0;
+        }
+        *crc = esp_rom_crc32_le(*crc, buf, n);
+    }
+
+    return 1;
+}
+
+static uint8_t flm_read_shdr(const flm_src_t *src, const elf_ehdr_t *eh, uint32_t index, elf_shdr_t *sh)
+{
+    if (index >= eh->shnum) {
+        return 0;
+    }
+
+    return flm_read_entry(src, eh->shoff, index, sh, sizeof(elf_shdr_t));
+}
+
+static uint8_t flm_parse_device(const flm_src_t *src, uint32_t ofs, swd_flm_t *flm)
+{
+    uint8_t dev[DEV_SECTORS_OFS];
+    uint8_t sector[8];
+    uint32_t i;
+
+    if (!flm_read(src, ofs, dev, sizeof(dev))) {
+        return 0;
+    }
+
+    flm->flash_start = flm_get32(&dev[DEV_ADR_OFS]);
+    flm->flash_size = flm_get32(&dev[DEV_SIZE_OFS]);
+    flm->page_size = flm_get32(&dev[DEV_PAGE_OFS]);
+    flm->erased_value = dev[DEV_EMPTY_OFS];
+    flm->program_timeout = flm_get32(&dev[DEV_TO_PROG_OFS]);
+    flm->erase_timeout = flm_get32(&dev[DEV_TO_ERASE_OFS]);
+
+    for (i = 0; ; i++) {
+        if (!flm_read_entry(src, ofs + DEV_SECTORS_OFS, i, sector, sizeof(sector))) {
+            return 0;
+        }
+
+        if (flm_get32(&sector[0]) == DEV_SECTOR_END && flm_get32(&sector[4]) == DEV_SECTOR_END) {
+            break;
+        }
+
+        if (i >= CONFIG_ESP_SWD_FLM_MAX_SECTORS) {
+            ESP_LOGE(FLM_TAG, "More than %d sector groups", CONFIG_ESP_SWD_FLM_MAX_SECTORS);
+            return 0;
+        }
+
+        flm->sectors[i].size = flm_get32(&sector[0]);
+        flm->sectors[i].addr = flm_get32(&sector[4]);
+
+        // flm_sector() divides by the size and picks the last group starting below an address
+        if (flm->sectors[i].size == 0 || (i > 0 && flm->sectors[i].addr <= flm->sectors[i - 1].addr)) {
+            ESP_LOGE(FLM_TAG, "Invalid sector group %lu: 0x%lx bytes at 0x%08lx", i, flm->sectors[i].size, flm->sectors[i].addr);
+            return 0;
+        }
+    }
+
+    flm->sector_count = i;
+    return flm->page_size != 0 && flm->flash_size != 0 && i != 0;
+}
+
+// Look up the entry points and the FlashDevice description in the symbol table
+static uint8_t flm_parse_symbols(const flm_src_t *src, const elf_ehdr_t *eh, uint32_t load_base, swd_flm_t *flm)
+{
+    elf_shdr_t symtab, strtab, sh;
+    elf_sym_t sym;
+    char name[16];
+    uint32_t i, n, dev_ofs = 0;
+
+    for (i = 0; i < eh->shnum; i++) {
+        if (!flm_read_shdr(src, eh, i, &symtab)) {
+            return 0;
+        }
+        if (symtab.type == ELF_SHT_SYMTAB) {
+            break;
+        }
+    }
+
+    if (i == eh->shnum || !flm_read_shdr(src, eh, symtab.link, &strtab)) {
+        ESP_LOGE(FLM_TAG, "No symbol table");
+        return 0;
+    }
+
+    for (i = 0; i < symtab.size / sizeof(elf_sym_t); i++) {
+        if (!flm_read_entry(src, symtab.offset, i, &sym, sizeof(sym))) {
+            return 0;
+        }
+
+        if (sym.name == 0 || sym.name >= strtab.size || sym.name > UINT32_MAX - strtab.offset) {
+            continue;
+        }
+
+        n = strtab.size - sym.name;
+        if (n > sizeof(name)) {
+            n = sizeof(name);
+        }
+        memset(name, 0, sizeof(name));
+        if (!flm_read(src, strtab.offset + sym.name, name, n)) {
+            return 0;
+        }
+
+        if (strncmp(name, "FlashDevice", sizeof(name)) == 0) {
+            // Not loaded, read through the section that holds it
+            if (sym.shndx >= ELF_SHN_LORESERVE || !flm_read_shdr(src, eh, sym.shndx, &sh)
+                    || sym.value < sh.addr || sym.value - sh.addr >= sh.size || sym.value - sh.addr > UINT32_MAX - sh.offset) {
+                return 0;
+            }
+            dev_ofs = sh.offset + (sym.value - sh.addr);
+            continue;
+        }
+
+        for (uint32_t k = 0; k < sizeof(flm_entries) / sizeof(flm_entries[0]); k++) {
+            if (strncmp(name, flm_entries[k].name, sizeof(name)) == 0) {
+                *(uint32_t *)((uint8_t *)flm + flm_entries[k].field) = load_base + sym.value;
+                break;
+            }
+        }
+    }
+
+    if (dev_ofs == 0 || !flm_parse_device(src, dev_ofs, flm)) {
+        ESP_LOGE(FLM_TAG, "No valid FlashDevice");
+        return 0;
+    }
+
+    if (flm->program_page == 0) {
+        ESP_LOGE(FLM_TAG, "No ProgramPage");
+        return 0;
+    }
+
+    return 1;
+}
+
+// Code and data at the bottom of RAM, stack at the top, page buffers in between
+static uint8_t flm_layout(uint32_t ram_start, uint32_t ram_size, uint32_t image_end, swd_flm_t *flm)
+{
+    uint32_t top = (ram_start + ram_size) & ~7UL;
+    uint32_t buf_start = (image_end + 7) & ~7UL;
+    uint32_t count;
+
+    if (top < buf_start || top - buf_start < CONFIG_ESP_SWD_FLM_STACK_SIZE
+            || top - buf_start - CONFIG_ESP_SWD_FLM_STACK_SIZE < flm->page_size) {
+        ESP_LOGE(FLM_TAG, "Algorithm and one %lu byte page don't fit in %lu bytes of RAM", flm->page_size, ram_size);
+        return 0;
+    }
+
+    count = (top - CONFIG_ESP_SWD_FLM_STACK_SIZE - buf_start) / flm->page_size;
+    if (count > CONFIG_ESP_SWD_FLASH_MAX_BUFFERS) {
+        count = CONFIG_ESP_SWD_FLASH_MAX_BUFFERS;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        flm->buf_addr[i] = buf_start + i * flm->page_size;
+    }
+
+    flm->buf_count = count;
+    flm->image_addr = ram_start;
+    flm->image_size = buf_start - ram_start;
+    flm->sys_call.breakpoint = ram_start + 1;
+    flm->sys_call.stack_pointer = top;
+    return 1;
+}
+
+static uint8_t flm_parse(const flm_src_t *src, uint32_t ram_start, uint32_t ram_size, flm_cache_t *entry)
+{
+    elf_ehdr_t eh;
+    elf_phdr_t ph;
+    uint32_t load_base = ram_start + FLM_HEADER_SIZE;
+    uint32_t end = 0, rw_vaddr = 0;
+    uint8_t has_rw = 0;
+
+    memset(entry, 0, sizeof(*entry));
+
+    // Everything below is computed relative to load_base, which must not wrap either
+    if (ram_size <= FLM_HEADER_SIZE || ram_size > UINT32_MAX - ram_start) {
+        ESP_LOGE(FLM_TAG, "Invalid RAM range 0x%08lx+%lu", ram_start, ram_size);
+        return 0;
+    }
+
+    if (!flm_read(src, 0, &eh, sizeof(eh)) || memcmp(eh.ident, "\x7F" "ELF", 4) != 0
+            || eh.ident[4] != ELF_CLASS32 || eh.ident[5] != ELF_DATA_LSB || eh.machine != ELF_MACHINE_ARM
+            || eh.phentsize != sizeof(elf_phdr_t) || eh.shentsize != sizeof(elf_shdr_t)) {
+        ESP_LOGE(FLM_TAG, "Not a 32-bit little endian ARM ELF");
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < eh.phnum; i++) {
+        if (!flm_read_entry(src, eh.phoff, i, &ph, sizeof(ph))) {
+            return 0;
+        }
+
+        if (ph.type != ELF_PT_LOAD || ph.memsz == 0) {
+            continue;
+        }
+
+        if (entry->seg_count >= FLM_MAX_SEGMENTS || ph.filesz > ph.memsz) {
+            ESP_LOGE(FLM_TAG, "Unsupported segment layout");
+            return 0;
+        }
+
+        // Every segment has to fit the RAM after the header before anything is laid out
+        if (ph.memsz > ram_size - FLM_HEADER_SIZE || ph.vaddr > ram_size - FLM_HEADER_SIZE - ph.memsz
+                || ph.offset > src->size || ph.filesz > src->size - ph.offset) {
+            ESP_LOGE(FLM_TAG, "Segment 0x%08lx+%lu outside RAM or file", ph.vaddr, ph.memsz);
+            return 0;
+        }
+
+        entry->seg[entry->seg_count].offset = ph.offset;
+        entry->seg[entry->seg_count].vaddr = ph.vaddr;
+        entry->seg[entry->seg_count].filesz = ph.filesz;
+        entry->seg[entry->seg_count].memsz = ph.memsz;
+        entry->seg_count++;
+
+        // RWPI: SB points at the writable (PrgData) segment
+        if ((ph.flags & ELF_PF_W) && !has_rw) {
+            rw_vaddr = ph.vaddr;
+            has_rw = 1;
+        }
+
+        if (ph.vaddr + ph.memsz > end) {
+            end = ph.vaddr + ph.memsz;
+        }
+    }
+
+    if (entry->seg_count == 0) {
+        ESP_LOGE(FLM_TAG, "Nothing to load");
+        return 0;
+    }
+
+    if (!flm_parse_symbols(src, &eh, load_base, &entry->flm)
+            || !flm_layout(ram_start, ram_size, load_base + end, &entry->flm)) {
+        return 0;
+    }
+
+    entry->flm.sys_call.static_base = load_base + (has_rw ? rw_vaddr : end);
+    return 1;
+}
+
+static uint8_t flm_upload(const flm_src_t *src, const flm_cache_t *entry)
+{
+    uint32_t header[FLM_HEADER_SIZE / 4] = {FLM_HEADER_WORD, 0};
+    uint32_t load_base = entry->flm.image_addr + FLM_HEADER_SIZE;
+    uint8_t buf[256];
+    uint32_t n;
+
+    if (!swd_write_memory(entry->flm.image_addr, (uint8_t *)header, sizeof(header))) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < entry->seg_count; i++) {
+        const flm_segment_t *seg = &entry->seg[i];
+
+        for (uint32_t ofs = 0; ofs < seg->memsz; ofs += n) {
+            n = seg->memsz - ofs;
+            if (n > sizeof(buf)) {
+                n = sizeof(buf);
+            }
+
+            // File contents first, zero-initialised data after it
+            if (ofs < seg->filesz) {
+                if (n > seg->filesz - ofs) {
+                    n = seg->filesz - ofs;
+                }
+                if (!flm_read(src, seg->offset + ofs, buf, n)) {
+                    return 0;
+                }
+            } else {
+                memset(buf, 0, n);
+            }
+
+            if (!swd_write_memory(load_base + seg->vaddr + ofs, buf, n)) {
+                ESP_LOGE(FLM_TAG, "Upload failed at 0x%08lx", load_base + seg->vaddr + ofs);
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+static uint8_t flm_load(const flm_src_t *src, uint32_t ram_start, uint32_t ram_size, swd_flm_t *out)
+{
+    flm_cache_t *entry = NULL;
+    uint32_t crc;
+
+    if (!flm_crc(src, &crc)) {
+        ESP_LOGE(FLM_TAG, "Read failed");
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < CONFIG_ESP_SWD_FLM_CACHE_ENTRIES; i++) {
+        if (flm_cache[i].valid && flm_cache[i].crc == crc && flm_cache[i].size == src->size
+                && flm_cache[i].ram_start == ram_start && flm_cache[i].ram_size == ram_size) {
+            entry = &flm_cache[i];
+            ESP_LOGD(FLM_TAG, "Using cached layout");
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        entry = &flm_cache[flm_cache_next];
+        flm_cache_next = (flm_cache_next + 1) % CONFIG_ESP_SWD_FLM_CACHE_ENTRIES;
+
+        if (!flm_parse(src, ram_start, ram_size, entry)) {
+            entry->valid = 0;
+            return 0;
+        }
+
+        entry->crc = crc;
+        entry->size = src->size;
+        entry->ram_start = ram_start;
+        entry->ram_size = ram_size;
+        entry->valid = 1;
+    }
+
+    if (!flm_upload(src, entry)) {
+        return 0;
+    }
+
+    *out = entry->flm;
+    return 1;
+}
+
+// Load an FLM held in ESP32 memory into target RAM at ram_start
+uint8_t swd_flm_load(const uint8_t *elf, uint32_t size, uint32_t ram_start, uint32_t ram_size, swd_flm_t *out)
+{
+    flm_src_t src = {
+        .mem = elf,
+        .size = size,
+    };
+
+    return flm_load(&src, ram_start, ram_size, out);
+}
+
+// Load an FLM stored at offset of a partition
+uint8_t swd_flm_load_partition(const esp_partition_t *part, uint32_t offset, uint32_t size, uint32_t ram_start, uint32_t ram_size, swd_flm_t *out)
+{
+    flm_src_t src = {
+        .part = part,
+        .offset = offset,
+        .size = size,
+    };
+
+    return flm_load(&src, ram_start, ram_size, out);
+}
+
+// FlashDevice timeouts are in ms, 0 keeps the swd_get_halt_timeout() deadline
+static uint32_t flm_timeout_us(uint32_t ms)
+{
+    return (ms > UINT32_MAX / 1000) ? UINT32_MAX : ms * 1000;
+}
+
+// Pipeline config for swd_flash_program() using the page buffers of a loaded algorithm
+void swd_flm_flash_config(const swd_flm_t *flm, swd_flash_config_t *cfg)
+{
+    cfg->sys_call = flm->sys_call;
+    cfg->program_page = flm->program_page;
+    cfg->page_size = flm->page_size;
+    cfg->timeout_us = flm_timeout_us(flm->program_timeout);
+    cfg->buf_count = flm->buf_count;
+    memcpy(cfg->buf_addr, flm->buf_addr, sizeof(cfg->buf_addr));
+}
+
+void swd_flm_cache_clear(void)
+{
+    memset(flm_cache, 0, sizeof(flm_cache));
+    flm_cache_next = 0;
+}
+
+// Sector holding addr, 0 if it's outside the device
+static uint8_t flm_sector(const swd_flm_t *flm, uint32_t addr, uint32_t *start, uint32_t *size)
+{
+    uint32_t ofs = addr - flm->flash_start;
+
+    if (addr < flm->flash_start || ofs >= flm->flash_size) {
+        return 0;
+    }
+
+    for (int32_t i = flm->sector_count - 1; i >= 0; i--) {
+        if (ofs >= flm->sectors[i].addr) {
+            *size = flm->sectors[i].size;
+            *start = flm->flash_start + flm->sectors[i].addr + ((ofs - flm->sectors[i].addr) / *size) * *size;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t flm_crc_fill(uint32_t crc, uint8_t value, uint32_t len)
+{
+    uint8_t fill[64];
+    uint32_t n;
+
+    memset(fill, value, sizeof(fill));
+    for (; len > 0; len -= n) {
+        n = (len > sizeof(fill)) ? sizeof(fill) : len;
+        crc = esp_rom_crc32_le(crc, fill, n);
+    }
+
+    return crc;
+}
+
+// CRC of a sector after programming: the image where it covers the sector, erased elsewhere
+static uint32_t flm_expected_crc(const swd_flm_t *flm, uint32_t sec, uint32_t sec_size, uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    uint32_t lo = (addr > sec) ? addr : sec;
+    uint32_t hi = (addr + size < sec + sec_size) ? addr + size : sec + sec_size;
+    uint32_t crc;
+
+    crc = flm_crc_fill(0, flm->erased_value, lo - sec);
+    crc = esp_rom_crc32_le(crc, data + (lo - addr), hi - lo);
+    return flm_crc_fill(crc, flm->erased_value, sec + sec_size - hi);
+}
+
+static uint32_t flm_sector_count(const swd_flm_t *flm, uint32_t addr, uint32_t size)
+{
+    uint32_t sec, sec_size, count = 0;
+
+    for (uint32_t pos = addr; pos < addr + size; pos = sec + sec_size) {
+        if (!flm_sector(flm, pos, &sec, &sec_size)) {
+            return 0;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+// Identifies the sector layout of an algorithm for the hash cache
+static uint32_t flm_layout_crc(const swd_flm_t *flm)
+{
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)&flm->flash_start, sizeof(flm->flash_start));
+
+    crc = esp_rom_crc32_le(crc, (const uint8_t *)&flm->flash_size, sizeof(flm->flash_size));
+    return esp_rom_crc32_le(crc, (const uint8_t *)flm->sectors, flm->sector_count * sizeof(swd_flm_sector_t));
+}
+
+// Per-sector CRCs of the image, from the cache when tag was seen before
+static const uint32_t *flm_image_hashes(const swd_flm_t *flm, uint32_t addr, const uint8_t *data, uint32_t size, uint32_t tag, uint32_t **owned)
+{
+    flm_hash_t *entry;
+    uint32_t *crc;
+    uint32_t count, sec, sec_size, i = 0;
+
+    *owned = NULL;
+    count = flm_sector_count(flm, addr, size);
+    if (count == 0) {
+        ESP_LOGE(FLM_TAG, "Image 0x%08lx+%lu is outside the flash", addr, size);
+        return NULL;
+    }
+
+    // The CRCs depend on the sector layout too, an entry made with another algorithm
+    // only matches when it splits the image into the same sectors
+    if (tag != 0) {
+        for (uint32_t k = 0; k < CONFIG_ESP_SWD_FLM_HASH_CACHE_ENTRIES; k++) {
+            if (flm_hash[k].crc != NULL && flm_hash[k].tag == tag && flm_hash[k].addr == addr && flm_hash[k].size == size
+                    && flm_hash[k].count == count && flm_hash[k].erased_value == flm->erased_value
+                    && flm_hash[k].layout == flm_layout_crc(flm)) {
+                return flm_hash[k].crc;
+            }
+        }
+    }
+
+    crc = malloc(count * sizeof(uint32_t));
+    if (crc == NULL) {
+        return NULL;
+    }
+
+    for (uint32_t pos = addr; pos < addr + size; pos = sec + sec_size) {
+        flm_sector(flm, pos, &sec, &sec_size);
+        crc[i++] = flm_expected_crc(flm, sec, sec_size, addr, data, size);
+    }
+
+    if (tag == 0) {
+        *owned = crc;
+        return crc;
+    }
+
+    entry = &flm_hash[flm_hash_next];
+    flm_hash_next = (flm_hash_next + 1) % CONFIG_ESP_SWD_FLM_HASH_CACHE_ENTRIES;
+    free(entry->crc);
+    entry->tag = tag;
+    entry->addr = addr;
+    entry->size = size;
+    entry->count = count;
+    entry->layout = flm_layout_crc(flm);
+    entry->erased_value = flm->erased_value;
+    entry->crc = crc;
+    return crc;
+}
+
+// On-target CRC, read-back when the routine can't run
+static uint8_t flm_target_crc(const swd_flash_config_t *cfg, uint32_t sec, uint32_t sec_size, uint32_t *crc)
+{
+    uint8_t buf[256];
+    uint32_t n;
+
+    if (swd_flash_crc32(cfg, sec, sec_size, crc)) {
+        return 1;
+    }
+
+    ESP_LOGW(FLM_TAG, "On-target CRC failed, reading 0x%08lx back", sec);
+    swd_clear_errors();
+
+    *crc = 0;
+    for (uint32_t ofs = 0; ofs < sec_size; ofs += n) {
+        n = (sec_size - ofs > sizeof(buf)) ? sizeof(buf) : sec_size - ofs;
+        if (!swd_read_memory(sec + ofs, buf, n)) {
+            return 0;
+        }
+        *crc = esp_rom_crc32_le(*crc, buf, n);
+    }
+
+    return 1;
+}
+
+// Erase and program the sectors [start, end) with the matching part of the image
+static uint8_t flm_program_run(const swd_flm_t *flm, const swd_flash_config_t *cfg, uint32_t start, uint32_t end,
+                               uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint32_t sec, sec_size, prev;
+    uint32_t lo = (addr > start) ? addr : start;
+    uint32_t hi = (addr + size < end) ? addr + size : end;
+    uint8_t ok = 1;
+
+    swd_ctx_lock(ctx);
+    prev = swd_get_halt_timeout();
+    if (flm->erase_timeout != 0) {
+        swd_set_halt_timeout(flm_timeout_us(flm->erase_timeout));
+    }
+
+    for (uint32_t pos = start; pos < end && ok; pos = sec + sec_size) {
+        flm_sector(flm, pos, &sec, &sec_size);
+        ok = swd_flash_syscall_exec(&flm->sys_call, flm->erase_sector, sec, 0, 0, 0, FLASHALGO_RETURN_BOOL, NULL);
+        if (!ok) {
+            ESP_LOGE(FLM_TAG, "EraseSector failed at 0x%08lx", sec);
+        }
+    }
+
+    swd_set_halt_timeout(prev);
+    swd_ctx_unlock(ctx);
+
+    return ok && swd_flash_program(cfg, lo, data + (lo - addr), hi - lo);
+}
+
+// Program an image, erasing and writing only the sectors whose contents differ. tag identifies
+// the image contents for the sector hash cache, 0 to not cache them. The algorithm must be
+// initialised for programming.
+uint8_t swd_flm_program_diff(const swd_flm_t *flm, uint32_t addr, const uint8_t *data, uint32_t size, uint32_t tag, swd_flm_diff_stats_t *stats)
+{
+    swd_flash_config_t cfg;
+    const uint32_t *expected;
+    uint32_t *owned;
+    uint32_t sec, sec_size, crc, i = 0;
+    uint32_t run_start = 0, run_end = 0;
+    uint8_t ret = 0;
+
+    if (flm->erase_sector == 0) {
+        ESP_LOGE(FLM_TAG, "No EraseSector");
+        return 0;
+    }
+
+    expected = flm_image_hashes(flm, addr, data, size, tag, &owned);
+    if (expected == NULL) {
+        return 0;
+    }
+
+    swd_flm_flash_config(flm, &cfg);
+    if (stats != NULL) {
+        stats->sectors = 0;
+        stats->programmed = 0;
+    }
+
+    // Neighbouring sectors that differ are programmed as one run to keep the pipeline full
+    for (uint32_t pos = addr; pos < addr + size; pos = sec + sec_size, i++) {
+        flm_sector(flm, pos, &sec, &sec_size);
+
+        if (!flm_target_crc(&cfg, sec, sec_size, &crc)) {
+            goto out;
+        }
+
+        if (stats != NULL) {
+            stats->sectors++;
+        }
+
+        if (crc == expected[i]) {
+            if (run_end != run_start && !flm_program_run(flm, &cfg, run_start, run_end, addr, data, size)) {
+                goto out;
+            }
+            run_start = run_end = 0;
+            continue;
+        }
+
+        if (run_end == run_start) {
+            run_start = sec;
+        }
+        run_end = sec + sec_size;
+
+        if (stats != NULL) {
+            stats->programmed++;
+        }
+    }
+
+    if (run_end != run_start && !flm_program_run(flm, &cfg, run_start, run_end, addr, data, size)) {
+        goto out;
+    }
+
+    ret = 1;
+
+out:
+    free(owned);
+    return ret;
+}
+
+void swd_flm_hash_cache_clear(void)
+{
+    for (uint32_t i = 0; i < CONFIG_ESP_SWD_FLM_HASH_CACHE_ENTRIES; i++) {
+        free(flm_hash[i].crc);
+    }
+    memset(flm_hash, 0, sizeof(flm_hash));
+    flm_hash_next = 0;
+}
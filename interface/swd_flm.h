@@ -0,0 +1,78 @@
+/**
+ * @file    swd_flm.h
+ * @brief   CMSIS-Pack flash algorithm (.FLM) loader
+ *
+ * An FLM is a position independent ARM ELF. Its PT_LOAD segments are placed
+ * behind a BKPT header at the start of the given target RAM, the stack at the
+ * end, and the space in between is split into as many page buffers as fit
+ * (up to CONFIG_ESP_SWD_FLASH_MAX_BUFFERS). Entry points and the FlashDevice
+ * description come from the symbol table. Parse results are kept in a small
+ * RAM cache keyed by the CRC32 of the file and the RAM layout, so loading the
+ * same algorithm again only uploads it.
+ *
+ * swd_flm_program_diff() compares the CRC32 of every sector the image covers
+ * (computed on the target, read back as a fallback) with the CRC the sector will
+ * have after programming, and only erases and programs the ones that differ.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <esp_partition.h>
+#include "swd_host.h"
+#include "swd_flash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef CONFIG_ESP_SWD_FLM_MAX_SECTORS
+#define CONFIG_ESP_SWD_FLM_MAX_SECTORS 8
+#endif
+
+typedef struct {
+    uint32_t size;
+    uint32_t addr;          // Offset from flash_start where sectors of this size begin
+} swd_flm_sector_t;
+
+typedef struct {
+    program_syscall_t sys_call;
+    // Entry points in target RAM, 0 when the algorithm doesn't provide one
+    uint32_t init;
+    uint32_t uninit;
+    uint32_t erase_chip;
+    uint32_t erase_sector;
+    uint32_t program_page;
+    uint32_t verify;
+    uint32_t blank_check;
+    // FlashDevice description
+    uint32_t flash_start;
+    uint32_t flash_size;
+    uint32_t page_size;
+    uint32_t program_timeout;   // ms
+    uint32_t erase_timeout;     // ms
+    uint8_t erased_value;
+    uint8_t sector_count;
+    swd_flm_sector_t sectors[CONFIG_ESP_SWD_FLM_MAX_SECTORS];
+    // Target RAM layout
+    uint32_t image_addr;
+    uint32_t image_size;
+    uint8_t buf_count;
+    uint32_t buf_addr[CONFIG_ESP_SWD_FLASH_MAX_BUFFERS];
+} swd_flm_t;
+
+typedef struct {
+    uint32_t sectors;       // Sectors covered by the image
+    uint32_t programmed;    // Sectors that differed and were erased and programmed
+} swd_flm_diff_stats_t;
+
+uint8_t swd_flm_load(const uint8_t *elf, uint32_t size, uint32_t ram_start, uint32_t ram_size, swd_flm_t *out);
+uint8_t swd_flm_load_partition(const esp_partition_t *part, uint32_t offset, uint32_t size, uint32_t ram_start, uint32_t ram_size, swd_flm_t *out);
+void swd_flm_flash_config(const swd_flm_t *flm, swd_flash_config_t *cfg);
+void swd_flm_cache_clear(void);
+uint8_t swd_flm_program_diff(const swd_flm_t *flm, uint32_t addr, const uint8_t *data, uint32_t size, uint32_t tag, swd_flm_diff_stats_t *stats);
+void swd_flm_hash_cache_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
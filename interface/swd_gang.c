@@ -0,0 +1,705 @@
+/**
+ * @file    swd_gang.c
+ * @brief   Implementation of swd_gang.h
+ */
+
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include <esp_rom_sys.h>
+
+// DAP_config.h first, DAP.h only has the swd_conf member when DAP_SWD is defined
+#include "DAP_config.h"
+#include "DAP.h"
+#include "swd_gang.h"
+#include "debug_cm.h"
+
+#include <esp_log.h>
+#define GANG_TAG "swd_gang"
+
+#define GANG_CSW_VALUE  (CSW_RESERVED | CSW_MSTRDBG | CSW_HPROT | CSW_DBGSTAT | CSW_SADDRINC | CSW_SIZE32)
+#define GANG_AUTOINC    1024
+
+#define GANG_DHCSR      0xE000EDF0
+#define GANG_DCRSR      0xE000EDF4
+#define GANG_DCRDR      0xE000EDF8
+#define GANG_REGWnR     (1 << 16)
+
+#define GANG_MAX_RETRY      100
+#define GANG_MAX_RECOVERY   3
+#define GANG_REGRDY_TIMEOUT_US 1000
+
+#ifndef CONFIG_ESP_SWD_RESET_PULSE_US
+#define CONFIG_ESP_SWD_RESET_PULSE_US 1000
+#endif
+
+#ifndef CONFIG_ESP_SWD_RESET_RECOVER_US
+#define CONFIG_ESP_SWD_RESET_RECOVER_US 1000
+#endif
+
+typedef struct {
+    uint32_t clk_mask;
+    uint32_t io_mask[CONFIG_ESP_SWD_GANG_MAX_LANES];
+    uint8_t io_pin[CONFIG_ESP_SWD_GANG_MAX_LANES];
+    int8_t nrst_pin;
+    uint8_t lane_count;
+    uint32_t connected;
+    swd_gang_lane_status_t status[CONFIG_ESP_SWD_GANG_MAX_LANES];
+} gang_state_t;
+
+static gang_state_t gang;
+
+#define FOR_EACH_LANE(lanes, i) \
+    for (uint32_t i = 0; i < gang.lane_count; i++) if ((lanes) & (1UL << (i)))
+
+static uint32_t gang_io_mask(uint32_t lanes)
+{
+    uint32_t mask = 0;
+
+    FOR_EACH_LANE(lanes, i) {
+        mask |= gang.io_mask[i];
+    }
+
+    return mask;
+}
+
+static __always_inline void gang_delay(uint32_t delay)
+{
+    if (delay) {
+        PIN_DELAY_SLOW(delay);
+    }
+}
+
+static __always_inline void gang_write_bit(uint32_t clk, uint32_t io, uint32_t bit, uint32_t delay)
+{
+    if (bit & 1) {
+        GPIO.out_w1ts = io;
+    } else {
+        GPIO.out_w1tc = io;
+    }
+    GPIO.out_w1tc = clk;
+    gang_delay(delay);
+    GPIO.out_w1ts = clk;
+    gang_delay(delay);
+}
+
+static __always_inline uint32_t gang_read_bit(uint32_t clk, uint32_t delay)
+{
+    uint32_t in;
+
+    GPIO.out_w1tc = clk;
+    gang_delay(delay);
+    in = GPIO.in;
+    GPIO.out_w1ts = clk;
+    gang_delay(delay);
+    return in;
+}
+
+static __always_inline void gang_clock_cycle(uint32_t clk, uint32_t delay)
+{
+    GPIO.out_w1tc = clk;
+    gang_delay(delay);
+    GPIO.out_w1ts = clk;
+    gang_delay(delay);
+}
+
+// Park lanes that left lockstep: SWDIO driven low looks like idle cycles to their target
+static void gang_park(uint32_t lanes)
+{
+    uint32_t io = gang_io_mask(lanes);
+    GPIO.out_w1tc = io;
+    GPIO.enable_w1ts = io;
+}
+
+static void IRAM_ATTR gang_sequence(uint32_t lanes, uint32_t count, const uint8_t *data)
+{
+    uint32_t clk = gang.clk_mask;
+    uint32_t io = gang_io_mask(lanes);
+    uint32_t delay = DAP_Data.fast_clock ? 0 : DAP_Data.clock_delay;
+    uint32_t val = 0, n = 0;
+
+    while (count--) {
+        if (n == 0) {
+            val = *data++;
+            n = 8;
+        }
+        gang_write_bit(clk, io, val, delay);
+        val >>= 1;
+        n--;
+    }
+}
+
+// One SWD transfer on all lanes in lockstep. Write data is shared, read data is
+// returned per lane in rdata. Returns the lanes that completed with OK and good parity.
+static uint32_t IRAM_ATTR gang_transfer(uint32_t lanes, uint32_t request, uint32_t wdata, uint32_t *rdata)
+{
+    uint32_t clk = gang.clk_mask;
+    uint32_t io = gang_io_mask(lanes);
+    uint32_t delay = DAP_Data.fast_clock ? 0 : DAP_Data.clock_delay;
+    uint32_t ack_in[3];
+    uint32_t data_in[33];
+    uint32_t parity, bit, n;
+    uint32_t ok = 0, dropped;
+
+    parity = ((request >> 0) & 1) + ((request >> 1) & 1) + ((request >> 2) & 1) + ((request >> 3) & 1);
+
+    // Packet request
+    gang_write_bit(clk, io, 1, delay);
+    gang_write_bit(clk, io, request >> 0, delay);
+    gang_write_bit(clk, io, request >> 1, delay);
+    gang_write_bit(clk, io, request >> 2, delay);
+    gang_write_bit(clk, io, request >> 3, delay);
+    gang_write_bit(clk, io, parity, delay);
+    gang_write_bit(clk, io, 0, delay);
+    gang_write_bit(clk, io, 1, delay);
+
+    // Turnaround
+    GPIO.enable_w1tc = io;
+    for (n = DAP_Data.swd_conf.turnaround; n; n--) {
+        gang_clock_cycle(clk, delay);
+    }
+
+    // Acknowledge of every lane with one GPIO.in sample per bit
+    ack_in[0] = gang_read_bit(clk, delay);
+    ack_in[1] = gang_read_bit(clk, delay);
+    ack_in[2] = gang_read_bit(clk, delay);
+
+    FOR_EACH_LANE(lanes, i) {
+        uint32_t m = gang.io_mask[i];
+        uint8_t ack = ((ack_in[0] & m) ? 1 : 0) | ((ack_in[1] & m) ? 2 : 0) | ((ack_in[2] & m) ? 4 : 0);
+
+        gang.status[i].last_ack = ack;
+        if (ack == DAP_TRANSFER_OK) {
+            ok |= (1UL << i);
+        } else if (ack == DAP_TRANSFER_WAIT) {
+            gang.status[i].wait_count++;
+        } else if (ack == DAP_TRANSFER_FAULT) {
+            gang.status[i].fault_count++;
+        } else {
+            gang.status[i].protocol_errors++;
+        }
+    }
+
+    dropped = lanes & ~ok;
+    io = gang_io_mask(ok);
+
+    if (ok == 0) {
+        // Nobody is in a data phase, hand the line back after the turnaround
+        for (n = DAP_Data.swd_conf.turnaround; n; n--) {
+            gang_clock_cycle(clk, delay);
+        }
+        gang_park(dropped);
+        return 0;
+    }
+
+    if (request & DAP_TRANSFER_RnW) {
+        for (n = 0; n < 33; n++) {
+            data_in[n] = gang_read_bit(clk, delay);
+            if (n == 0 && dropped) {
+                // The first data cycle is the turnaround of the lanes that didn't answer OK
+                gang_park(dropped);
+            }
+        }
+
+        for (n = DAP_Data.swd_conf.turnaround; n; n--) {
+            gang_clock_cycle(clk, delay);
+        }
+        GPIO.enable_w1ts = io;
+
+        FOR_EACH_LANE(ok, i) {
+            uint32_t m = gang.io_mask[i];
+            uint32_t val = 0;
+
+            parity = 0;
+            for (n = 0; n < 32; n++) {
+                bit = (data_in[n] & m) ? 1 : 0;
+                parity += bit;
+                val |= bit << n;
+            }
+
+            if (((data_in[32] & m) ? 1 : 0) != (parity & 1)) {
+                gang.status[i].parity_errors++;
+                gang.status[i].last_ack = DAP_TRANSFER_ERROR;
+                ok &= ~(1UL << i);
+                continue;
+            }
+
+            if (rdata) {
+                rdata[i] = val;
+            }
+        }
+    } else {
+        for (n = DAP_Data.swd_conf.turnaround; n; n--) {
+            gang_clock_cycle(clk, delay);
+        }
+        GPIO.enable_w1ts = io;
+        gang_park(dropped);
+
+        parity = 0;
+        for (n = 0; n < 32; n++) {
+            bit = (wdata >> n) & 1;
+            parity += bit;
+            gang_write_bit(clk, io, bit, delay);
+        }
+        gang_write_bit(clk, io, parity, delay);
+    }
+
+    // Idle cycles
+    for (n = DAP_Data.transfer.idle_cycles; n; n--) {
+        gang_write_bit(clk, io, 0, delay);
+    }
+    GPIO.out_w1ts = io;
+
+    if (lanes & ~ok) {
+        gang_park(lanes & ~ok);
+    }
+
+    return ok;
+}
+
+// A single lane may retry WAIT like swd_transfer_retry(), lanes in lockstep can't
+static uint32_t gang_xfer(uint32_t lanes, uint32_t request, uint32_t wdata, uint32_t *rdata)
+{
+    uint32_t ok = 0;
+
+    if (lanes == 0) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < GANG_MAX_RETRY; i++) {
+        ok = gang_transfer(lanes, request, wdata, rdata);
+        if (ok == lanes || (lanes & (lanes - 1)) != 0) {
+            break;
+        }
+
+        // Single lane: only WAIT is worth retrying
+        if (gang.status[__builtin_ctz(lanes)].last_ack != DAP_TRANSFER_WAIT) {
+            break;
+        }
+
+        // Release the parked line again for the retry
+        GPIO.out_w1ts = gang_io_mask(lanes);
+    }
+
+    if (ok != lanes) {
+        // Drive the SWDIO of the remaining lanes high again for the next request
+        GPIO.out_w1ts = gang_io_mask(ok);
+    }
+
+    return ok;
+}
+
+static uint32_t gang_write_dp(uint32_t lanes, uint8_t adr, uint32_t val)
+{
+    return gang_xfer(lanes, SWD_REG_DP | SWD_REG_W | SWD_REG_ADR(adr), val, NULL);
+}
+
+static uint32_t gang_read_dp(uint32_t lanes, uint8_t adr, uint32_t *vals)
+{
+    return gang_xfer(lanes, SWD_REG_DP | SWD_REG_R | SWD_REG_ADR(adr), 0, vals);
+}
+
+static uint32_t gang_write_ap(uint32_t lanes, uint8_t adr, uint32_t val)
+{
+    return gang_xfer(lanes, SWD_REG_AP | SWD_REG_W | SWD_REG_ADR(adr), val, NULL);
+}
+
+// Line reset, JTAG to SWD switch, line reset and IDCODE read on the given lanes
+static uint32_t gang_line_init(uint32_t lanes, uint32_t *idcode)
+{
+    static const uint8_t ones[8] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    static const uint8_t jtag2swd[2] = {0x9e, 0xe7};
+    static const uint8_t idle[1] = {0x00};
+
+    // Release parked lanes first so they see the line reset
+    GPIO.out_w1ts = gang_io_mask(lanes);
+
+    gang_sequence(lanes, 51, ones);
+    gang_sequence(lanes, 16, jtag2swd);
+    gang_sequence(lanes, 51, ones);
+    gang_sequence(lanes, 8, idle);
+
+    return gang_read_dp(lanes, DP_IDCODE, idcode);
+}
+
+static uint32_t gang_power_up(uint32_t lanes)
+{
+    uint32_t stat[CONFIG_ESP_SWD_GANG_MAX_LANES];
+    uint32_t pending;
+
+    lanes = gang_write_dp(lanes, DP_ABORT, STKCMPCLR | STKERRCLR | WDERRCLR | ORUNERRCLR);
+    lanes = gang_write_dp(lanes, DP_SELECT, 0);
+    lanes = gang_write_dp(lanes, DP_CTRL_STAT, CSYSPWRUPREQ | CDBGPWRUPREQ);
+
+    pending = lanes;
+    for (uint32_t t = 0; t < 100 && pending; t++) {
+        uint32_t ok = gang_read_dp(pending, DP_CTRL_STAT, stat);
+        lanes &= ~(pending & ~ok);
+        pending = ok;
+
+        FOR_EACH_LANE(ok, i) {
+            if ((stat[i] & (CDBGPWRUPACK | CSYSPWRUPACK)) == (CDBGPWRUPACK | CSYSPWRUPACK)) {
+                pending &= ~(1UL << i);
+            }
+        }
+    }
+    lanes &= ~pending;
+
+    return gang_write_dp(lanes, DP_CTRL_STAT, CSYSPWRUPREQ | CDBGPWRUPREQ | TRNNORMAL | MASKLANE);
+}
+
+// Bring a lane that left lockstep back to a known state
+static uint8_t gang_recover_lane(uint32_t lane)
+{
+    uint32_t idcode[CONFIG_ESP_SWD_GANG_MAX_LANES];
+    uint32_t mask = 1UL << lane;
+
+    gang.status[lane].recoveries++;
+
+    // Cancel a transfer the AP may still be stalling on, the link might be out of sync so the ACK is ignored
+    gang_write_dp(mask, DP_ABORT, DAPABORT | STKCMPCLR | STKERRCLR | WDERRCLR | ORUNERRCLR);
+
+    if (gang_line_init(mask, idcode) != mask) {
+        return 0;
+    }
+
+    if (gang_write_dp(mask, DP_ABORT, DAPABORT | STKCMPCLR | STKERRCLR | WDERRCLR | ORUNERRCLR) != mask) {
+        return 0;
+    }
+
+    return gang_power_up(mask) == mask;
+}
+
+static uint32_t gang_do_write_memory(uint32_t lanes, uint32_t address, const uint8_t *data, uint32_t size)
+{
+    uint32_t n, word;
+
+    lanes = gang_write_dp(lanes, DP_SELECT, 0);
+    lanes = gang_write_ap(lanes, AP_CSW, GANG_CSW_VALUE);
+
+    while (size && lanes) {
+        n = GANG_AUTOINC - (address & (GANG_AUTOINC - 1));
+        if (n > size) {
+            n = size;
+        }
+
+        lanes = gang_write_ap(lanes, AP_TAR, address);
+        for (uint32_t i = 0; i < n && lanes; i += 4) {
+            memcpy(&word, data + i, 4);
+            lanes = gang_write_ap(lanes, AP_DRW, word);
+        }
+
+        address += n;
+        data += n;
+        size -= n;
+    }
+
+    return gang_read_dp(lanes, DP_RDBUFF, NULL);
+}
+
+static uint32_t gang_do_read_word(uint32_t lanes, uint32_t addr, uint32_t *vals)
+{
+    lanes = gang_write_dp(lanes, DP_SELECT, 0);
+    lanes = gang_write_ap(lanes, AP_CSW, GANG_CSW_VALUE);
+    lanes = gang_write_ap(lanes, AP_TAR, addr);
+    lanes = gang_xfer(lanes, SWD_REG_AP | SWD_REG_R | AP_DRW, 0, NULL);
+    return gang_read_dp(lanes, DP_RDBUFF, vals);
+}
+
+static uint32_t gang_do_write_word(uint32_t lanes, uint32_t addr, uint32_t val)
+{
+    lanes = gang_write_dp(lanes, DP_SELECT, 0);
+    lanes = gang_write_ap(lanes, AP_CSW, GANG_CSW_VALUE);
+    lanes = gang_write_ap(lanes, AP_TAR, addr);
+    lanes = gang_write_ap(lanes, AP_DRW, val);
+    return gang_read_dp(lanes, DP_RDBUFF, NULL);
+}
+
+// Wait for S_REGRDY (or S_HALT) on every lane, lanes that never get there are dropped.
+// timeout_us 0 waits forever.
+static uint32_t gang_wait_dhcsr(uint32_t lanes, uint32_t flag, uint32_t timeout_us)
+{
+    uint32_t dhcsr[CONFIG_ESP_SWD_GANG_MAX_LANES];
+    uint32_t pending = lanes;
+    int64_t start = esp_timer_get_time();
+    int64_t elapsed;
+
+    while (pending) {
+        uint32_t ok = gang_do_read_word(pending, GANG_DHCSR, dhcsr);
+        lanes &= ~(pending & ~ok);
+        pending = ok;
+
+        FOR_EACH_LANE(ok, i) {
+            if (dhcsr[i] & flag) {
+                pending &= ~(1UL << i);
+            }
+        }
+
+        if (!pending) {
+            break;
+        }
+
+        elapsed = esp_timer_get_time() - start;
+        if (timeout_us != 0 && elapsed >= timeout_us) {
+            ESP_LOGE(GANG_TAG, "DHCSR wait timeout after %lld us", elapsed);
+            break;
+        }
+
+        // Same back-off as swd_wait_until_halted(), erases end up sleeping
+        if (elapsed < CONFIG_ESP_SWD_HALT_SPIN_US) {
+            continue;
+        } else if (elapsed < CONFIG_ESP_SWD_HALT_DELAY_US) {
+            esp_rom_delay_us(CONFIG_ESP_SWD_HALT_DELAY_STEP_US);
+            taskYIELD();
+        } else {
+            vTaskDelay(1);
+        }
+    }
+
+    return lanes & ~pending;
+}
+
+static uint32_t gang_write_core_register(uint32_t lanes, uint32_t n, uint32_t val)
+{
+    lanes = gang_do_write_word(lanes, GANG_DCRDR, val);
+    lanes = gang_do_write_word(lanes, GANG_DCRSR, n | GANG_REGWnR);
+    return gang_wait_dhcsr(lanes, S_REGRDY, GANG_REGRDY_TIMEOUT_US);
+}
+
+static uint32_t gang_syscall_start(uint32_t lanes, const uint32_t *regs)
+{
+    static const uint8_t reg_num[] = {0, 1, 2, 3, 9, 13, 14, 15, 16};
+
+    for (uint32_t i = 0; i < sizeof(reg_num) && lanes; i++) {
+        lanes = gang_write_core_register(lanes, reg_num[i], regs[i]);
+    }
+
+    lanes = gang_do_write_word(lanes, GANG_DHCSR, DBGKEY | C_DEBUGEN | C_MASKINTS | C_HALT);
+    return gang_do_write_word(lanes, GANG_DHCSR, DBGKEY | C_DEBUGEN | C_MASKINTS);
+}
+
+static uint32_t gang_syscall_finish(uint32_t lanes, uint32_t *r0)
+{
+    lanes = gang_wait_dhcsr(lanes, S_HALT, swd_get_halt_timeout());
+    lanes = gang_do_write_word(lanes, GANG_DCRSR, 0);
+    lanes = gang_wait_dhcsr(lanes, S_REGRDY, GANG_REGRDY_TIMEOUT_US);
+    lanes = gang_do_read_word(lanes, GANG_DCRDR, r0);
+    //remove the C_MASKINTS
+    return gang_do_write_word(lanes, GANG_DHCSR, DBGKEY | C_DEBUGEN | C_HALT);
+}
+
+uint8_t swd_gang_init(const swd_gang_config_t *cfg)
+{
+    if (cfg->lane_count == 0 || cfg->lane_count > CONFIG_ESP_SWD_GANG_MAX_LANES || cfg->swclk_pin >= 32) {
+        return 0;
+    }
+
+    memset(&gang, 0, sizeof(gang));
+    gang.clk_mask = 1UL << cfg->swclk_pin;
+    gang.nrst_pin = cfg->nrst_pin;
+    gang.lane_count = cfg->lane_count;
+
+    // Make sure the CMSIS-DAP transfer settings (clock, turnaround) are initialised
+    DAP_Setup();
+
+    gpio_ll_output_enable(&GPIO, cfg->swclk_pin);
+    gpio_ll_od_disable(&GPIO, cfg->swclk_pin);
+    gpio_ll_set_level(&GPIO, cfg->swclk_pin, 1);
+    gpio_ll_pin_filter_disable(&GPIO, cfg->swclk_pin);
+
+    for (uint32_t i = 0; i < cfg->lane_count; i++) {
+        uint8_t pin = cfg->swdio_pin[i];
+
+        // Every lane has to be in the bank covered by one GPIO.in read
+        if (pin >= 32 || (1UL << pin) == gang.clk_mask) {
+            ESP_LOGE(GANG_TAG, "Invalid SWDIO pin %u for lane %lu", pin, i);
+            return 0;
+        }
+
+        gang.io_pin[i] = pin;
+        gang.io_mask[i] = 1UL << pin;
+
+        // Input stays enabled so turnarounds only need to touch the output enable
+        gpio_ll_input_enable(&GPIO, pin);
+        gpio_ll_output_enable(&GPIO, pin);
+        gpio_ll_od_disable(&GPIO, pin);
+        gpio_ll_set_level(&GPIO, pin, 1);
+        gpio_ll_pulldown_dis(&GPIO, pin);
+        gpio_ll_pullup_en(&GPIO, pin);
+        gpio_ll_pin_filter_disable(&GPIO, pin);
+    }
+
+    // Open drain, every target may also pull the shared reset line low on its own
+    if (gang.nrst_pin >= 0) {
+        gpio_ll_set_level(&GPIO, gang.nrst_pin, 1);
+        gpio_ll_od_enable(&GPIO, gang.nrst_pin);
+        gpio_ll_output_enable(&GPIO, gang.nrst_pin);
+        gpio_ll_pullup_en(&GPIO, gang.nrst_pin);
+    }
+
+    return 1;
+}
+
+// Connect to every lane, returns the lanes that are ready for lockstep transfers
+uint32_t swd_gang_connect(void)
+{
+    uint32_t idcode[CONFIG_ESP_SWD_GANG_MAX_LANES];
+    uint32_t all = (1UL << gang.lane_count) - 1;
+    uint32_t lanes;
+
+    lanes = gang_line_init(all, idcode);
+    lanes = gang_power_up(lanes);
+
+    FOR_EACH_LANE(all, i) {
+        gang.status[i].connected = (lanes >> i) & 1;
+        if (!gang.status[i].connected) {
+            ESP_LOGW(GANG_TAG, "Lane %lu failed to connect, ack %u", i, gang.status[i].last_ack);
+        }
+    }
+
+    gang.connected = lanes;
+    return lanes;
+}
+
+// Pulse the shared nRST and connect again, returns the lanes that are ready afterwards
+uint32_t swd_gang_reset(void)
+{
+    if (gang.nrst_pin < 0) {
+        return 0;
+    }
+
+    gpio_ll_set_level(&GPIO, gang.nrst_pin, 0);
+    esp_rom_delay_us(CONFIG_ESP_SWD_RESET_PULSE_US);
+    gpio_ll_set_level(&GPIO, gang.nrst_pin, 1);
+    esp_rom_delay_us(CONFIG_ESP_SWD_RESET_RECOVER_US);
+
+    return swd_gang_connect();
+}
+
+// Write word aligned data to every connected lane, returns the lanes that got it
+uint32_t swd_gang_write_memory(uint32_t address, const uint8_t *data, uint32_t size)
+{
+    uint32_t lanes, failed;
+
+    if ((address & 0x3) || (size & 0x3) || size == 0) {
+        return 0;
+    }
+
+    lanes = gang_do_write_memory(gang.connected, address, data, size);
+    failed = gang.connected & ~lanes;
+
+    // Serial recovery: finish diverged lanes one at a time with WAIT retries
+    FOR_EACH_LANE(failed, i) {
+        for (uint32_t attempt = 0; attempt < GANG_MAX_RECOVERY; attempt++) {
+            if (gang_recover_lane(i) && gang_do_write_memory(1UL << i, address, data, size)) {
+                lanes |= (1UL << i);
+                break;
+            }
+        }
+    }
+
+    return lanes;
+}
+
+// Read a word from every connected lane into vals[lane]
+uint32_t swd_gang_read_word(uint32_t addr, uint32_t *vals)
+{
+    uint32_t lanes = gang_do_read_word(gang.connected, addr, vals);
+    uint32_t failed = gang.connected & ~lanes;
+
+    FOR_EACH_LANE(failed, i) {
+        if (gang_recover_lane(i) && gang_do_read_word(1UL << i, addr, vals)) {
+            lanes |= (1UL << i);
+        }
+    }
+
+    return lanes;
+}
+
+uint32_t swd_gang_write_word(uint32_t addr, uint32_t val)
+{
+    uint32_t lanes = gang_do_write_word(gang.connected, addr, val);
+    uint32_t failed = gang.connected & ~lanes;
+
+    FOR_EACH_LANE(failed, i) {
+        if (gang_recover_lane(i) && gang_do_write_word(1UL << i, addr, val)) {
+            lanes |= (1UL << i);
+        }
+    }
+
+    return lanes;
+}
+
+// Run a flash algorithm function on every connected lane. With FLASHALGO_RETURN_VALUE
+// ret_out[lane] receives R0. Returns the lanes on which the call succeeded.
+// Lanes still running after swd_get_halt_timeout() of the calling task are dropped.
+uint32_t swd_gang_flash_syscall_exec(const program_syscall_t *sys_call, uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4,
+                                     flash_algo_return_t return_type, uint32_t *ret_out)
+{
+    uint32_t r0[CONFIG_ESP_SWD_GANG_MAX_LANES];
+    uint32_t regs[9] = {
+        arg1, arg2, arg3, arg4,         // R0-R3
+        sys_call->static_base,          // R9
+        sys_call->stack_pointer,        // R13
+        sys_call->breakpoint,           // R14
+        entry,                          // R15
+        0x01000000,                     // xPSR: T = 1, ISR = 0
+    };
+    uint32_t started, done, failed, result = 0;
+
+    started = gang_syscall_start(gang.connected, regs);
+
+    // Lanes that failed before the algorithm ran are safe to start again
+    failed = gang.connected & ~started;
+    FOR_EACH_LANE(failed, i) {
+        if (gang_recover_lane(i) && gang_syscall_start(1UL << i, regs)) {
+            started |= (1UL << i);
+        }
+    }
+
+    done = gang_syscall_finish(started, r0);
+
+    // The algorithm already ran on these, only collect the result again
+    failed = started & ~done;
+    FOR_EACH_LANE(failed, i) {
+        if (gang_recover_lane(i) && gang_syscall_finish(1UL << i, r0)) {
+            done |= (1UL << i);
+        }
+    }
+
+    FOR_EACH_LANE(done, i) {
+        if (return_type == FLASHALGO_RETURN_POINTER) {
+            // Flash verify functions return pointer to byte following the buffer if successful.
+            if (r0[i] == (arg1 + arg2)) {
+                result |= (1UL << i);
+            }
+        } else if (return_type == FLASHALGO_RETURN_VALUE) {
+            if (ret_out != NULL) {
+                ret_out[i] = r0[i];
+            }
+            result |= (1UL << i);
+        } else if (r0[i] == 0) {
+            result |= (1UL << i);
+        } else {
+            ESP_LOGW(GANG_TAG, "Lane %lu returned 0x%lx", i, r0[i]);
+        }
+    }
+
+    return result;
+}
+
+uint8_t swd_gang_get_lane_status(uint8_t lane, swd_gang_lane_status_t *status)
+{
+    if (lane >= gang.lane_count) {
+        return 0;
+    }
+
+    *status = gang.status[lane];
+    return 1;
+}
+
+uint32_t swd_gang_connected_lanes(void)
+{
+    return gang.connected;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file    swd_gang.h
+ * @brief   Lockstep programming of several targets on parallel SWD buses
+ *
+ * All lanes share one SWCLK pin and have their own SWDIO pin. Request and write
+ * data are driven on every SWDIO line with a single GPIO.out_w1ts/out_w1tc store,
+ * and ACK/read data of all lanes is sampled with one GPIO.in read. A lane whose
+ * ACK or parity diverges (WAIT, FAULT, no response) is parked with SWDIO low and
+ * finished afterwards on its own through a serial recovery path.
+ *
+ * Gang pins must be in the first GPIO bank (GPIO0-31), and the targets are
+ * expected to be identical Cortex-M parts with the SCS at 0xE000E000.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "swd_host.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef CONFIG_ESP_SWD_GANG_MAX_LANES
+#define CONFIG_ESP_SWD_GANG_MAX_LANES 8
+#endif
+
+typedef struct {
+    uint8_t swclk_pin;
+    int8_t nrst_pin;        // Shared open drain reset, -1 if not connected
+    uint8_t lane_count;
+    uint8_t swdio_pin[CONFIG_ESP_SWD_GANG_MAX_LANES];
+} swd_gang_config_t;
+
+typedef struct {
+    uint8_t last_ack;       // ACK of the last transfer this lane took part in
+    uint8_t connected;
+    uint32_t wait_count;
+    uint32_t fault_count;
+    uint32_t parity_errors;
+    uint32_t protocol_errors;
+    uint32_t recoveries;    // Times the lane was finished through the serial path
+} swd_gang_lane_status_t;
+
+uint8_t swd_gang_init(const swd_gang_config_t *cfg);
+uint32_t swd_gang_connect(void);
+uint32_t swd_gang_reset(void);
+uint32_t swd_gang_write_memory(uint32_t address, const uint8_t *data, uint32_t size);
+uint32_t swd_gang_read_word(uint32_t addr, uint32_t *vals);
+uint32_t swd_gang_write_word(uint32_t addr, uint32_t val);
+uint32_t swd_gang_flash_syscall_exec(const program_syscall_t *sys_call, uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4,
+                                     flash_algo_return_t return_type, uint32_t *ret_out);
+uint8_t swd_gang_get_lane_status(uint8_t lane, swd_gang_lane_status_t *status);
+uint32_t swd_gang_connected_lanes(void);
+
+#ifdef __cplusplus
+}
+#endif
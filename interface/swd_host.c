@@ -21,10 +21,32 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <esp_timer.h>
+#include <esp_rom_sys.h>
+#include <sdkconfig.h>
+
+#if CONFIG_ESP_SWD_PSRAM_STAGING
+#include <stdbool.h>
+#include <freertos/semphr.h>
+#include <esp_heap_caps.h>
+#include <esp_memory_utils.h>
+#include <soc/soc_caps.h>
+// GDMA copies out of PSRAM where the AHB GDMA can reach it (ESP32-S3), memcpy bursts elsewhere
+#if SOC_AHB_GDMA_SUPPORT_PSRAM && __has_include(<esp_cache.h>)
+#include <esp_async_memcpy.h>
+#include <esp_cache.h>
+#define SWD_STAGE_DMA 1
+#else
+#define SWD_STAGE_DMA 0
+#endif
+#endif
 
 #include "swd_host.h"
+#include "swd_romtable.h"
 #include "debug_cm.h"
 #include "DAP_config.h"
 #include "DAP.h"
@@ -39,21 +61,53 @@
 #define TARGET_AUTO_INCREMENT_PAGE_SIZE (1024)
 #endif
 
-// Default NVIC and Core debug base addresses
-// TODO: Read these addresses from ROM.
-#define NVIC_Addr    (0xe000e000)
-#define DBG_Addr     (0xe000edf0)
+// NVIC and Core debug base addresses, the SCS base is replaced by the one
+// found in the ROM table (see swd_romtable_discover())
+#define SCS_DEFAULT_Addr (0xe000e000)
+#define NVIC_Addr    (swd_ctx_current()->scs_addr)
+#define DBG_Addr     (swd_ctx_current()->scs_addr + DBG_OFS)
 
 // AP CSW register, base value
 #define CSW_VALUE (CSW_RESERVED | CSW_MSTRDBG | CSW_HPROT | CSW_DBGSTAT | CSW_SADDRINC)
 
-#define DCRDR 0xE000EDF8
-#define DCRSR 0xE000EDF4
-#define DHCSR 0xE000EDF0
 #define REGWnR (1 << 16)
 
+// Number of APs whose CSW/TAR state is cached
+#ifndef CONFIG_ESP_SWD_MAX_AP
+#define CONFIG_ESP_SWD_MAX_AP 4
+#endif
+
+// Number of targets sharing one SWD bus in multi-drop mode
+#ifndef CONFIG_ESP_SWD_MAX_TARGETS
+#define CONFIG_ESP_SWD_MAX_TARGETS 4
+#endif
+
 #define MAX_SWD_RETRY 100//10
-#define MAX_TIMEOUT   UINT32_MAX  // Timeout for syscalls on target
+
+// Internal RAM ping-pong buffers between PSRAM and the SWD loop
+#ifndef CONFIG_ESP_SWD_PSRAM_STAGE_SIZE
+#define CONFIG_ESP_SWD_PSRAM_STAGE_SIZE 1024
+#endif
+
+// Connect sequence delays, see swd_init_debug()
+#ifndef CONFIG_ESP_SWD_BOOT_SETTLE_US
+#define CONFIG_ESP_SWD_BOOT_SETTLE_US 100
+#endif
+
+#ifndef CONFIG_ESP_SWD_RESET_PULSE_US
+#define CONFIG_ESP_SWD_RESET_PULSE_US 1000
+#endif
+
+#ifndef CONFIG_ESP_SWD_RESET_RECOVER_US
+#define CONFIG_ESP_SWD_RESET_RECOVER_US 1000
+#endif
+
+#ifndef CONFIG_ESP_SWD_POWERUP_TIMEOUT_US
+#define CONFIG_ESP_SWD_POWERUP_TIMEOUT_US 10000
+#endif
+
+#define SWD_STAGE_ALIGN 32      // PSRAM cache line, GDMA burst alignment
+#define SWD_STAGE_MIN   64      // Smaller transfers go direct
 
 // Use the CMSIS-Core definition if available.
 #if !defined(SCB_AIRCR_PRIGROUP_Pos)
@@ -62,8 +116,19 @@
 #endif
 
 typedef struct {
-    uint32_t select;
+    uint32_t idr;
     uint32_t csw;
+    uint32_t tar;
+    uint32_t autoinc_size;
+    uint8_t tar_valid;
+} AP_STATE;
+
+typedef struct {
+    uint32_t select;
+    uint8_t ap_sel;     // AP used when the APSEL bits of an address are 0
+    uint8_t ap_count;   // Number of APs found by swd_ap_enumerate()
+    uint32_t ap_present; // Bit per APSEL with a non-zero IDR, APSEL may have holes
+    AP_STATE ap[CONFIG_ESP_SWD_MAX_AP];
 } DAP_STATE;
 
 typedef struct {
@@ -71,40 +136,213 @@ typedef struct {
     uint32_t xpsr;
 } DEBUG_STATE;
 
-static SWD_CONNECT_TYPE reset_connect = CONNECT_NORMAL;
+// Registers read or written while halted, indexed by swd_reg_cache_slot()
+#define REG_CACHE_SLOTS 64
+
+typedef struct {
+    uint32_t val[REG_CACHE_SLOTS];
+    uint64_t valid;
+    uint8_t halted;     // S_HALT seen since the last invalidation
+    uint32_t hits;
+    uint32_t misses;
+} REG_CACHE;
+
+#if CONFIG_ESP_SWD_PSRAM_STAGING
+typedef struct {
+    uint8_t *buf[2];            // Allocated on the first PSRAM transfer
+    SemaphoreHandle_t done;     // Given by the GDMA copy callback
+} STAGE_STATE;
+#endif
+
+typedef struct {
+    uint32_t targetsel;
+    // Saved while another target is selected
+    DAP_STATE state;
+    uint32_t scs_addr;
+    swd_rom_state_t rom;
+} MULTIDROP_TARGET;
+
+// Everything needed to drive one target, see swd_ctx_bind()
+struct swd_ctx {
+    DAP_Port_t *port;
+    DAP_Port_t own_port;        // Port of created contexts, the default one uses DAP_DefaultPort
+    DAP_Data_t own_data;
+    uint8_t swclk_pin;
+    uint8_t swdio_pin;
+    int8_t nrst_pin;
+    volatile uint8_t abort;
+    uint32_t clock_hz;          // 0 for DAP_DEFAULT_SWJ_CLOCK
+    DAP_STATE dap_state;
+    SWD_CONNECT_TYPE reset_connect;
+    uint32_t soft_reset;
+    uint32_t halt_timeout_us;   // swd_wait_until_halted() deadline, 0 for none
+    uint32_t scs_addr;
+    MULTIDROP_TARGET multidrop_targets[CONFIG_ESP_SWD_MAX_TARGETS];
+    uint8_t multidrop_count;
+    uint8_t multidrop_current;
+    swd_rom_state_t rom;
+    REG_CACHE reg_cache;
+    DEBUG_STATE last_state;     // Last state written by swd_write_debug_state()
+    uint8_t last_state_valid;   // Core is halted at the breakpoint of a finished syscall
+    uint32_t syscall_expected;  // FLASHALGO_RETURN_POINTER result of the running syscall
+    swd_connect_timing_t timing;
+    uint8_t session_valid;      // Link set up by swd_init_debug(), see swd_resume()
+    SemaphoreHandle_t lock;     // Recursive, see swd_ctx_lock()
+    StaticSemaphore_t lock_buf;
+    uint32_t users;             // References held by services, see swd_ctx_acquire()
+#if CONFIG_ESP_SWD_PSRAM_STAGING
+    STAGE_STATE stage;
+#endif
+};
+
+static swd_ctx_t default_ctx = {
+    .port = &DAP_DefaultPort,
+    .swclk_pin = PIN_SWCLK,
+    .swdio_pin = PIN_SWDIO,
+    .nrst_pin = PIN_nRST,
+    .reset_connect = CONNECT_NORMAL,
+    .soft_reset = SYSRESETREQ,
+    .halt_timeout_us = CONFIG_ESP_SWD_HALT_TIMEOUT_US,
+    .scs_addr = SCS_DEFAULT_Addr,
+};
+
+// Context of the calling task, NULL for the default one
+static __thread swd_ctx_t *bound_ctx = NULL;
+
+swd_ctx_t *IRAM_ATTR swd_ctx_current(void)
+{
+    return (bound_ctx != NULL) ? bound_ctx : &default_ctx;
+}
+
+static portMUX_TYPE ctx_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Serialise the tasks sharing ctx. The lock is recursive, so a task can also hold it
+// across a sequence of swd_* calls that must not be interleaved with other tasks.
+void IRAM_ATTR swd_ctx_lock(swd_ctx_t *ctx)
+{
+    // The default context is static, its mutex is created on first use
+    if (ctx->lock == NULL) {
+        portENTER_CRITICAL(&ctx_mux);
+        if (ctx->lock == NULL) {
+            ctx->lock = xSemaphoreCreateRecursiveMutexStatic(&ctx->lock_buf);
+        }
+        portEXIT_CRITICAL(&ctx_mux);
+    }
+
+    xSemaphoreTakeRecursive(ctx->lock, portMAX_DELAY);
+}
+
+void IRAM_ATTR swd_ctx_unlock(swd_ctx_t *ctx)
+{
+    xSemaphoreGiveRecursive(ctx->lock);
+}
+
+// Services that keep using ctx after the call that handed it over returns hold a
+// reference until they are done, swd_ctx_destroy() refuses to free a referenced context
+void swd_ctx_acquire(swd_ctx_t *ctx)
+{
+    portENTER_CRITICAL(&ctx_mux);
+    ctx->users++;
+    portEXIT_CRITICAL(&ctx_mux);
+}
+
+void swd_ctx_release(swd_ctx_t *ctx)
+{
+    portENTER_CRITICAL(&ctx_mux);
+    if (ctx->users > 0) {
+        ctx->users--;
+    }
+    portEXIT_CRITICAL(&ctx_mux);
+}
+
+static swd_ctx_t *IRAM_ATTR swd_ctx_enter(void)
+{
+    swd_ctx_t *ctx = swd_ctx_current();
+
+    swd_ctx_lock(ctx);
+    return ctx;
+}
+
+static void IRAM_ATTR swd_ctx_leave(swd_ctx_t **ctx)
+{
+    swd_ctx_unlock(*ctx);
+}
+
+// Holds the lock of the calling task's context until the enclosing function returns,
+// first statement of every public entry point that touches the context or the wire
+#define SWD_CTX_GUARD() swd_ctx_t *ctx_guard __attribute__((cleanup(swd_ctx_leave))) = swd_ctx_enter()
+
+static void swd_reg_cache_invalidate(swd_ctx_t *ctx)
+{
+    ctx->reg_cache.valid = 0;
+    ctx->reg_cache.halted = 0;
+}
+
+// S_RESET_ST clears on read, so every DHCSR read has to check it: after a reset the
+// cached registers are stale even if the core is halted again by the next read
+static void IRAM_ATTR swd_reg_cache_check_reset(swd_ctx_t *ctx, uint32_t dhcsr)
+{
+    if (dhcsr & S_RESET_ST) {
+        swd_reg_cache_invalidate(ctx);
+        ctx->last_state_valid = 0;
+    }
+}
+
+static void swd_nreset_out(swd_ctx_t *ctx, uint32_t bit)
+{
+    if (!(bit & 1)) {
+        swd_reg_cache_invalidate(ctx);
+        ctx->last_state_valid = 0;
+        ctx->session_valid = 0;
+    }
 
-static DAP_STATE dap_state;
-static uint32_t  soft_reset = SYSRESETREQ;
+    if (ctx->nrst_pin >= 0) {
+        gpio_ll_set_level(&GPIO, ctx->nrst_pin, bit & 1);
+    }
+}
 
 static uint32_t swd_get_apsel(uint32_t adr)
 {
-    uint32_t apsel = 0; // target_get_apsel();
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint32_t apsel = adr & 0xff000000;
     if (!apsel)
-        return adr & 0xff000000;
+        return ((uint32_t)ctx->dap_state.ap_sel) << 24;
     else
         return apsel;
 }
 
-void swd_set_reset_connect(SWD_CONNECT_TYPE type)
+// Cached state of the AP addressed by adr, NULL if it's beyond the cached range
+static AP_STATE *swd_get_ap_state(uint32_t adr)
 {
-    reset_connect = type;
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint32_t ap = swd_get_apsel(adr) >> 24;
+    return (ap < CONFIG_ESP_SWD_MAX_AP) ? &ctx->dap_state.ap[ap] : NULL;
 }
 
-void IRAM_ATTR int2array(uint8_t *res, uint32_t data, uint8_t len)
+static void swd_reset_ap_state(swd_ctx_t *ctx)
 {
-    uint8_t i = 0;
-
-    for (i = 0; i < len; i++) {
-        res[i] = (data >> 8 * i) & 0xff;
+    for (uint32_t i = 0; i < CONFIG_ESP_SWD_MAX_AP; i++) {
+        ctx->dap_state.ap[i].csw = 0xffffffff;
+        ctx->dap_state.ap[i].tar_valid = 0;
+        if (ctx->dap_state.ap[i].autoinc_size == 0) {
+            ctx->dap_state.ap[i].autoinc_size = TARGET_AUTO_INCREMENT_PAGE_SIZE;
+        }
     }
 }
 
-uint8_t IRAM_ATTR swd_transfer_retry(uint32_t req, uint32_t *data)
+// Internal callers already hold the context lock through the public entry point,
+// so the per transfer path skips it
+static uint8_t IRAM_ATTR swd_transfer(swd_ctx_t *ctx, uint32_t req, uint32_t *data)
 {
-    uint8_t i, ack;
+    uint8_t i, ack = DAP_TRANSFER_ERROR;
 
     for (i = 0; i < MAX_SWD_RETRY; i++) {
-        ack = SWD_Transfer(req, data);
+        // CMSIS-DAP aborts only apply to the context sharing its port
+        if (ctx->abort || (ctx == &default_ctx && DAP_TransferAbort)) {
+            return DAP_TRANSFER_ERROR;
+        }
+
+        ack = SWD_Transfer_Port(ctx->port, req, data);
 
         // if ack != WAIT
         if (ack != DAP_TRANSFER_WAIT) {
@@ -115,40 +353,151 @@ uint8_t IRAM_ATTR swd_transfer_retry(uint32_t req, uint32_t *data)
     return ack;
 }
 
+// Track TAR after an auto-incremented access of size bytes starting at addr
+static void swd_update_tar(AP_STATE *ap, uint32_t addr, uint32_t size)
+{
+    if (ap == NULL) {
+        return;
+    }
+
+    ap->tar = addr + size;
+    // Incrementing across the auto-increment boundary is implementation defined
+    ap->tar_valid = ((ap->tar & (ap->autoinc_size - 1)) != 0);
+}
+
+// Write TAR unless the AP already points at addr
+static uint8_t IRAM_ATTR swd_write_tar(uint32_t addr)
+{
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint8_t tmp_in[4];
+    uint8_t req;
+    AP_STATE *ap = swd_get_ap_state(0);
+
+    if (ap != NULL && ap->tar_valid && ap->tar == addr) {
+        return 1;
+    }
+
+    req = SWD_REG_AP | SWD_REG_W | AP_TAR;
+    int2array(tmp_in, addr, 4);
+
+    if (swd_transfer(ctx, req, (uint32_t *)tmp_in) != DAP_TRANSFER_OK) {
+        if (ap != NULL) {
+            ap->tar_valid = 0;
+        }
+        return 0;
+    }
+
+    if (ap != NULL) {
+        ap->tar = addr;
+        ap->tar_valid = 1;
+    }
+
+    return 1;
+}
+
+static uint32_t swd_get_autoinc_size(void)
+{
+    AP_STATE *ap = swd_get_ap_state(0);
+    return (ap != NULL) ? ap->autoinc_size : TARGET_AUTO_INCREMENT_PAGE_SIZE;
+}
+
+void swd_set_reset_connect(SWD_CONNECT_TYPE type)
+{
+    SWD_CTX_GUARD();
+
+    swd_ctx_current()->reset_connect = type;
+}
+
+void IRAM_ATTR int2array(uint8_t *res, uint32_t data, uint8_t len)
+{
+    uint8_t i = 0;
+
+    for (i = 0; i < len; i++) {
+        res[i] = (data >> 8 * i) & 0xff;
+    }
+}
+
+uint8_t IRAM_ATTR swd_transfer_retry(uint32_t req, uint32_t *data)
+{
+    SWD_CTX_GUARD();
+
+    return swd_transfer(ctx_guard, req, data);
+}
+
 void swd_set_soft_reset(uint32_t soft_reset_type)
 {
-    soft_reset = soft_reset_type;
+    SWD_CTX_GUARD();
+
+    swd_ctx_current()->soft_reset = soft_reset_type;
+}
+
+// Deadline of swd_wait_until_halted() for the calling task's context, 0 waits forever.
+// Flash algorithms with their own timeouts set it around their calls.
+void swd_set_halt_timeout(uint32_t timeout_us)
+{
+    SWD_CTX_GUARD();
+
+    swd_ctx_current()->halt_timeout_us = timeout_us;
+}
+
+uint32_t swd_get_halt_timeout(void)
+{
+    SWD_CTX_GUARD();
+
+    return swd_ctx_current()->halt_timeout_us;
 }
 
 uint8_t swd_init(void)
 {
-    //TODO - DAP_Setup puts GPIO pins in a hi-z state which can
-    //       cause problems on re-init.  This needs to be investigated
-    //       and fixed.
-    DAP_Setup();
-    PORT_SWD_SETUP();
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+
+    if (ctx == &default_ctx) {
+        //TODO - DAP_Setup puts GPIO pins in a hi-z state which can
+        //       cause problems on re-init.  This needs to be investigated
+        //       and fixed.
+        DAP_Setup();
+    }
+
+    if (ctx->clock_hz != 0) {
+        DAP_Set_Clock(ctx->port->data, ctx->clock_hz);
+    }
+
+    PORT_SWD_SETUP_PINS(ctx->swclk_pin, ctx->swdio_pin, ctx->nrst_pin);
     return 1;
 }
 
 uint8_t swd_off(void)
 {
-    gpio_set_level(CONFIG_ESP_SWD_BOOT_PIN, 1);
-    vTaskDelay(pdMS_TO_TICKS(20));
-    PIN_nRESET_OUT(0);
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+
+    // The BOOT pin belongs to the target of the default context
+    if (ctx == &default_ctx) {
+        gpio_set_level(CONFIG_ESP_SWD_BOOT_PIN, 1);
+        vTaskDelay(pdMS_TO_TICKS(20));
+    }
+    swd_nreset_out(ctx, 0);
     vTaskDelay(pdMS_TO_TICKS(350));
-    PIN_nRESET_OUT(1);
+    swd_nreset_out(ctx, 1);
     vTaskDelay(pdMS_TO_TICKS(100));;
 
-    gpio_reset_pin(CONFIG_ESP_SWD_BOOT_PIN);
-    gpio_reset_pin(PIN_SWCLK);
-    gpio_reset_pin(PIN_SWDIO);
-    gpio_reset_pin(PIN_nRST);
+    if (ctx == &default_ctx) {
+        gpio_reset_pin(CONFIG_ESP_SWD_BOOT_PIN);
+    }
+    gpio_reset_pin(ctx->swclk_pin);
+    gpio_reset_pin(ctx->swdio_pin);
+    if (ctx->nrst_pin >= 0) {
+        gpio_reset_pin(ctx->nrst_pin);
+    }
 
     return 1;
 }
 
 uint8_t IRAM_ATTR swd_clear_errors(void)
 {
+    SWD_CTX_GUARD();
+
     if (!swd_write_dp(DP_ABORT, STKCMPCLR | STKERRCLR | WDERRCLR | ORUNERRCLR)) {
         return 0;
     }
@@ -158,12 +507,14 @@ uint8_t IRAM_ATTR swd_clear_errors(void)
 // Read debug port register.
 uint8_t IRAM_ATTR swd_read_dp(uint8_t adr, uint32_t *val)
 {
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
     uint32_t tmp_in;
     uint8_t tmp_out[4];
     uint8_t ack;
     uint32_t tmp;
     tmp_in = SWD_REG_DP | SWD_REG_R | SWD_REG_ADR(adr);
-    ack = swd_transfer_retry(tmp_in, (uint32_t *)tmp_out);
+    ack = swd_transfer(ctx, tmp_in, (uint32_t *)tmp_out);
     *val = 0;
     tmp = tmp_out[3];
     *val |= (tmp << 24);
@@ -179,20 +530,22 @@ uint8_t IRAM_ATTR swd_read_dp(uint8_t adr, uint32_t *val)
 // Write debug port register
 uint8_t IRAM_ATTR swd_write_dp(uint8_t adr, uint32_t val)
 {
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
     uint32_t req;
     uint8_t data[4];
     uint8_t ack;
 
     //check if the right bank is already selected
-    if ((adr == DP_SELECT) && (dap_state.select == val)) {
+    if ((adr == DP_SELECT) && (ctx->dap_state.select == val)) {
         return 1;
     }
 
     req = SWD_REG_DP | SWD_REG_W | SWD_REG_ADR(adr);
     int2array(data, val, 4);
-    ack = swd_transfer_retry(req, (uint32_t *)data);
+    ack = swd_transfer(ctx, req, (uint32_t *)data);
     if ((ack == DAP_TRANSFER_OK) && (adr == DP_SELECT)) {
-        dap_state.select = val;
+        ctx->dap_state.select = val;
     }
 
     return (ack == 0x01);
@@ -201,9 +554,12 @@ uint8_t IRAM_ATTR swd_write_dp(uint8_t adr, uint32_t val)
 // Read access port register.
 uint8_t IRAM_ATTR swd_read_ap(uint32_t adr, uint32_t *val)
 {
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
     uint8_t tmp_in, ack;
     uint8_t tmp_out[4];
     uint32_t tmp;
+    AP_STATE *ap;
     uint32_t apsel = swd_get_apsel(adr);
     uint32_t bank_sel = adr & APBANKSEL;
 
@@ -213,8 +569,14 @@ uint8_t IRAM_ATTR swd_read_ap(uint32_t adr, uint32_t *val)
 
     tmp_in = SWD_REG_AP | SWD_REG_R | SWD_REG_ADR(adr);
     // first dummy read
-    swd_transfer_retry(tmp_in, (uint32_t *)tmp_out);
-    ack = swd_transfer_retry(tmp_in, (uint32_t *)tmp_out);
+    swd_transfer(ctx, tmp_in, (uint32_t *)tmp_out);
+    ack = swd_transfer(ctx, tmp_in, (uint32_t *)tmp_out);
+
+    // DRW reads auto-increment TAR
+    if ((adr & 0xfc) == AP_DRW && (ap = swd_get_ap_state(adr)) != NULL) {
+        ap->tar_valid = 0;
+    }
+
     *val = 0;
     tmp = tmp_out[3];
     *val |= (tmp << 24);
@@ -230,22 +592,25 @@ uint8_t IRAM_ATTR swd_read_ap(uint32_t adr, uint32_t *val)
 // Write access port register
 uint8_t IRAM_ATTR swd_write_ap(uint32_t adr, uint32_t val)
 {
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
     uint8_t data[4];
     uint8_t req, ack;
     uint32_t apsel = swd_get_apsel(adr);
     uint32_t bank_sel = adr & APBANKSEL;
+    uint32_t reg = adr & 0xfc;
+    AP_STATE *ap = swd_get_ap_state(adr);
 
     if (!swd_write_dp(DP_SELECT, apsel | bank_sel)) {
         return 0;
     }
 
-    switch (adr) {
+    switch (reg) {
         case AP_CSW:
-            if (dap_state.csw == val) {
+            if (ap != NULL && ap->csw == val) {
                 return 1;
             }
 
-            dap_state.csw = val;
             break;
 
         default:
@@ -255,12 +620,28 @@ uint8_t IRAM_ATTR swd_write_ap(uint32_t adr, uint32_t val)
     req = SWD_REG_AP | SWD_REG_W | SWD_REG_ADR(adr);
     int2array(data, val, 4);
 
-    if (swd_transfer_retry(req, (uint32_t *)data) != 0x01) {
+    if (swd_transfer(ctx, req, (uint32_t *)data) != 0x01) {
+        // Don't trust the cached CSW/TAR after a failed or aborted write
+        if (ap != NULL) {
+            ap->csw = 0xffffffff;
+            ap->tar_valid = 0;
+        }
         return 0;
     }
 
+    if (ap != NULL) {
+        if (reg == AP_CSW) {
+            ap->csw = val;
+        } else if (reg == AP_TAR) {
+            ap->tar = val;
+            ap->tar_valid = 1;
+        } else if (reg == AP_DRW) {
+            ap->tar_valid = 0;
+        }
+    }
+
     req = SWD_REG_DP | SWD_REG_R | SWD_REG_ADR(DP_RDBUFF);
-    ack = swd_transfer_retry(req, NULL);
+    ack = swd_transfer(ctx, req, NULL);
     return (ack == 0x01);
 }
 
@@ -269,9 +650,11 @@ uint8_t IRAM_ATTR swd_write_ap(uint32_t adr, uint32_t val)
 // size is in bytes.
 static IRAM_ATTR uint8_t swd_write_block(uint32_t address, uint8_t *data, uint32_t size)
 {
-    uint8_t tmp_in[4], req;
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint8_t req;
     uint32_t size_in_words;
     uint32_t i, ack;
+    AP_STATE *ap;
 
     if (size == 0) {
         return 0;
@@ -285,18 +668,20 @@ static IRAM_ATTR uint8_t swd_write_block(uint32_t address, uint8_t *data, uint32
     }
 
     // TAR write
-    req = SWD_REG_AP | SWD_REG_W | (1 << 2);
-    int2array(tmp_in, address, 4);
-
-    if (swd_transfer_retry(req, (uint32_t *)tmp_in) != 0x01) {
+    if (!swd_write_tar(address)) {
         return 0;
     }
 
+    ap = swd_get_ap_state(0);
+    if (ap != NULL) {
+        ap->tar_valid = 0;
+    }
+
     // DRW write
     req = SWD_REG_AP | SWD_REG_W | (3 << 2);
 
     for (i = 0; i < size_in_words; i++) {
-        if (swd_transfer_retry(req, (uint32_t *)data) != 0x01) {
+        if (swd_transfer(ctx, req, (uint32_t *)data) != 0x01) {
             return 0;
         }
 
@@ -305,7 +690,10 @@ static IRAM_ATTR uint8_t swd_write_block(uint32_t address, uint8_t *data, uint32
 
     // dummy read
     req = SWD_REG_DP | SWD_REG_R | SWD_REG_ADR(DP_RDBUFF);
-    ack = swd_transfer_retry(req, NULL);
+    ack = swd_transfer(ctx, req, NULL);
+    if (ack == 0x01) {
+        swd_update_tar(ap, address, size_in_words * 4);
+    }
     return (ack == 0x01);
 }
 
@@ -313,9 +701,11 @@ static IRAM_ATTR uint8_t swd_write_block(uint32_t address, uint8_t *data, uint32
 // size is in bytes.
 static uint8_t IRAM_ATTR swd_read_block(uint32_t address, uint8_t *data, uint32_t size)
 {
-    uint8_t tmp_in[4], req, ack;
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint8_t req, ack;
     uint32_t size_in_words;
     uint32_t i;
+    AP_STATE *ap;
 
     if (size == 0) {
         return 0;
@@ -328,23 +718,25 @@ static uint8_t IRAM_ATTR swd_read_block(uint32_t address, uint8_t *data, uint32_
     }
 
     // TAR write
-    req = SWD_REG_AP | SWD_REG_W | AP_TAR;
-    int2array(tmp_in, address, 4);
-
-    if (swd_transfer_retry(req, (uint32_t *)tmp_in) != DAP_TRANSFER_OK) {
+    if (!swd_write_tar(address)) {
         return 0;
     }
 
+    ap = swd_get_ap_state(0);
+    if (ap != NULL) {
+        ap->tar_valid = 0;
+    }
+
     // read data
     req = SWD_REG_AP | SWD_REG_R | AP_DRW;
 
     // initiate first read, data comes back in next read
-    if (swd_transfer_retry(req, NULL) != 0x01) {
+    if (swd_transfer(ctx, req, NULL) != 0x01) {
         return 0;
     }
 
     for (i = 0; i < (size_in_words - 1); i++) {
-        if (swd_transfer_retry(req, (uint32_t *)data) != DAP_TRANSFER_OK) {
+        if (swd_transfer(ctx, req, (uint32_t *)data) != DAP_TRANSFER_OK) {
             return 0;
         }
 
@@ -353,35 +745,44 @@ static uint8_t IRAM_ATTR swd_read_block(uint32_t address, uint8_t *data, uint32_
 
     // read last word
     req = SWD_REG_DP | SWD_REG_R | SWD_REG_ADR(DP_RDBUFF);
-    ack = swd_transfer_retry(req, (uint32_t *)data);
+    ack = swd_transfer(ctx, req, (uint32_t *)data);
+    if (ack == 0x01) {
+        swd_update_tar(ap, address, size_in_words * 4);
+    }
     return (ack == 0x01);
 }
 
-// Read target memory.
-static uint8_t IRAM_ATTR swd_read_data(uint32_t addr, uint32_t *val)
+// Read target memory, inc is the TAR increment of the current CSW size.
+static uint8_t IRAM_ATTR swd_read_data(uint32_t addr, uint32_t *val, uint32_t inc)
 {
-    uint8_t tmp_in[4];
+    swd_ctx_t *ctx = swd_ctx_current();
     uint8_t tmp_out[4];
     uint8_t req, ack;
     uint32_t tmp;
-    // put addr in TAR register
-    int2array(tmp_in, addr, 4);
-    req = SWD_REG_AP | SWD_REG_W | (1 << 2);
+    AP_STATE *ap = swd_get_ap_state(0);
 
-    if (swd_transfer_retry(req, (uint32_t *)tmp_in) != 0x01) {
+    // put addr in TAR register
+    if (!swd_write_tar(addr)) {
         return 0;
     }
 
+    if (ap != NULL) {
+        ap->tar_valid = 0;
+    }
+
     // read data
     req = SWD_REG_AP | SWD_REG_R | (3 << 2);
 
-    if (swd_transfer_retry(req, (uint32_t *)tmp_out) != 0x01) {
+    if (swd_transfer(ctx, req, (uint32_t *)tmp_out) != 0x01) {
         return 0;
     }
 
     // dummy read
     req = SWD_REG_DP | SWD_REG_R | SWD_REG_ADR(DP_RDBUFF);
-    ack = swd_transfer_retry(req, (uint32_t *)tmp_out);
+    ack = swd_transfer(ctx, req, (uint32_t *)tmp_out);
+    if (ack == 0x01) {
+        swd_update_tar(ap, addr, inc);
+    }
     *val = 0;
     tmp = tmp_out[3];
     *val |= (tmp << 24);
@@ -394,41 +795,50 @@ static uint8_t IRAM_ATTR swd_read_data(uint32_t addr, uint32_t *val)
     return (ack == 0x01);
 }
 
-// Write target memory.
-static uint8_t IRAM_ATTR swd_write_data(uint32_t address, uint32_t data)
+// Write target memory, inc is the TAR increment of the current CSW size.
+static uint8_t IRAM_ATTR swd_write_data(uint32_t address, uint32_t data, uint32_t inc)
 {
+    swd_ctx_t *ctx = swd_ctx_current();
     uint8_t tmp_in[4];
     uint8_t req, ack;
-    // put addr in TAR register
-    int2array(tmp_in, address, 4);
-    req = SWD_REG_AP | SWD_REG_W | (1 << 2);
+    AP_STATE *ap = swd_get_ap_state(0);
 
-    if (swd_transfer_retry(req, (uint32_t *)tmp_in) != 0x01) {
+    // put addr in TAR register
+    if (!swd_write_tar(address)) {
         return 0;
     }
 
+    if (ap != NULL) {
+        ap->tar_valid = 0;
+    }
+
     // write data
     int2array(tmp_in, data, 4);
     req = SWD_REG_AP | SWD_REG_W | (3 << 2);
 
-    if (swd_transfer_retry(req, (uint32_t *)tmp_in) != 0x01) {
+    if (swd_transfer(ctx, req, (uint32_t *)tmp_in) != 0x01) {
         return 0;
     }
 
     // dummy read
     req = SWD_REG_DP | SWD_REG_R | SWD_REG_ADR(DP_RDBUFF);
-    ack = swd_transfer_retry(req, NULL);
+    ack = swd_transfer(ctx, req, NULL);
+    if (ack == 0x01) {
+        swd_update_tar(ap, address, inc);
+    }
     return (ack == 0x01) ? 1 : 0;
 }
 
 // Read 32-bit word from target memory.
 uint8_t IRAM_ATTR swd_read_word(uint32_t addr, uint32_t *val)
 {
+    SWD_CTX_GUARD();
+
     if (!swd_write_ap(AP_CSW, CSW_VALUE | CSW_SIZE32)) {
         return 0;
     }
 
-    if (!swd_read_data(addr, val)) {
+    if (!swd_read_data(addr, val, 4)) {
         return 0;
     }
 
@@ -438,11 +848,19 @@ uint8_t IRAM_ATTR swd_read_word(uint32_t addr, uint32_t *val)
 // Write 32-bit word to target memory.
 uint8_t IRAM_ATTR swd_write_word(uint32_t addr, uint32_t val)
 {
+    SWD_CTX_GUARD();
+
+    // Resume or reset done through plain memory writes
+    if (addr == DBG_Addr || addr == NVIC_AIRCR) {
+        swd_reg_cache_invalidate(swd_ctx_current());
+        swd_ctx_current()->last_state_valid = 0;
+    }
+
     if (!swd_write_ap(AP_CSW, CSW_VALUE | CSW_SIZE32)) {
         return 0;
     }
 
-    if (!swd_write_data(addr, val)) {
+    if (!swd_write_data(addr, val, 4)) {
         return 0;
     }
 
@@ -452,13 +870,14 @@ uint8_t IRAM_ATTR swd_write_word(uint32_t addr, uint32_t val)
 // Read 8-bit byte from target memory.
 uint8_t IRAM_ATTR swd_read_byte(uint32_t addr, uint8_t *val)
 {
+    SWD_CTX_GUARD();
     uint32_t tmp;
 
     if (!swd_write_ap(AP_CSW, CSW_VALUE | CSW_SIZE8)) {
         return 0;
     }
 
-    if (!swd_read_data(addr, &tmp)) {
+    if (!swd_read_data(addr, &tmp, 1)) {
         return 0;
     }
 
@@ -469,6 +888,7 @@ uint8_t IRAM_ATTR swd_read_byte(uint32_t addr, uint8_t *val)
 // Write 8-bit byte to target memory.
 uint8_t IRAM_ATTR swd_write_byte(uint32_t addr, uint8_t val)
 {
+    SWD_CTX_GUARD();
     uint32_t tmp;
 
     if (!swd_write_ap(AP_CSW, CSW_VALUE | CSW_SIZE8)) {
@@ -477,7 +897,7 @@ uint8_t IRAM_ATTR swd_write_byte(uint32_t addr, uint8_t val)
 
     tmp = val << ((addr & 0x03) << 3);
 
-    if (!swd_write_data(addr, tmp)) {
+    if (!swd_write_data(addr, tmp, 1)) {
         return 0;
     }
 
@@ -486,9 +906,10 @@ uint8_t IRAM_ATTR swd_write_byte(uint32_t addr, uint8_t val)
 
 // Read unaligned data from target memory.
 // size is in bytes.
-uint8_t IRAM_ATTR swd_read_memory(uint32_t address, uint8_t *data, uint32_t size)
+static uint8_t IRAM_ATTR swd_read_memory_direct(uint32_t address, uint8_t *data, uint32_t size)
 {
     uint32_t n;
+    uint32_t autoinc_size = swd_get_autoinc_size();
 
     // Read bytes until word aligned
     while ((size > 0) && (address & 0x3)) {
@@ -504,7 +925,7 @@ uint8_t IRAM_ATTR swd_read_memory(uint32_t address, uint8_t *data, uint32_t size
     // Read word aligned blocks
     while (size > 3) {
         // Limit to auto increment page size
-        n = TARGET_AUTO_INCREMENT_PAGE_SIZE - (address & (TARGET_AUTO_INCREMENT_PAGE_SIZE - 1));
+        n = autoinc_size - (address & (autoinc_size - 1));
 
         if (size < n) {
             n = size & 0xFFFFFFFC; // Only count complete words remaining
@@ -535,9 +956,10 @@ uint8_t IRAM_ATTR swd_read_memory(uint32_t address, uint8_t *data, uint32_t size
 
 // Write unaligned data to target memory.
 // size is in bytes.
-uint8_t IRAM_ATTR swd_write_memory(uint32_t address, uint8_t *data, uint32_t size)
+static uint8_t IRAM_ATTR swd_write_memory_direct(uint32_t address, uint8_t *data, uint32_t size)
 {
     uint32_t n = 0;
+    uint32_t autoinc_size = swd_get_autoinc_size();
 
     // Write bytes until word aligned
     while ((size > 0) && (address & 0x3)) {
@@ -553,7 +975,7 @@ uint8_t IRAM_ATTR swd_write_memory(uint32_t address, uint8_t *data, uint32_t siz
     // Write word aligned blocks
     while (size > 3) {
         // Limit to auto increment page size
-        n = TARGET_AUTO_INCREMENT_PAGE_SIZE - (address & (TARGET_AUTO_INCREMENT_PAGE_SIZE - 1));
+        n = autoinc_size - (address & (autoinc_size - 1));
 
         if (size < n) {
             n = size & 0xFFFFFFFC; // Only count complete words remaining
@@ -582,467 +1004,610 @@ uint8_t IRAM_ATTR swd_write_memory(uint32_t address, uint8_t *data, uint32_t siz
     return 1;
 }
 
-// Execute system call.
-static uint8_t IRAM_ATTR swd_write_debug_state(DEBUG_STATE *state)
+#if CONFIG_ESP_SWD_PSRAM_STAGING
+static void swd_stage_free(STAGE_STATE *st)
 {
-    uint32_t i, status;
-
-    if (!swd_write_dp(DP_SELECT, 0)) {
-        return 0;
+    for (uint32_t i = 0; i < 2; i++) {
+        heap_caps_free(st->buf[i]);
+        st->buf[i] = NULL;
     }
 
-    // R0, R1, R2, R3
-    for (i = 0; i < 4; i++) {
-        if (!swd_write_core_register(i, state->r[i])) {
-            ESP_LOGE(DAP_TAG, "Failed to set R0-3");
-            return 0;
-        }
+    if (st->done != NULL) {
+        vSemaphoreDelete(st->done);
+        st->done = NULL;
     }
+}
 
-    // R9
-    if (!swd_write_core_register(9, state->r[9])) {
-        ESP_LOGE(DAP_TAG, "Failed to set R9");
-        return 0;
-    }
+#if SWD_STAGE_DMA
+static async_memcpy_handle_t stage_dma = NULL;
+static portMUX_TYPE stage_lock = portMUX_INITIALIZER_UNLOCKED;
 
-    // R13, R14, R15
-    for (i = 13; i < 16; i++) {
-        if (!swd_write_core_register(i, state->r[i])) {
-            ESP_LOGE(DAP_TAG, "Failed to set R13-15");
-            return 0;
-        }
-    }
+static bool IRAM_ATTR swd_stage_copy_done(async_memcpy_handle_t handle, async_memcpy_event_t *event, void *arg)
+{
+    BaseType_t woken = pdFALSE;
 
-    // xPSR
-    if (!swd_write_core_register(16, state->xpsr)) {
-        ESP_LOGE(DAP_TAG, "Failed to set xPSR");
-        return 0;
-    }
+    xSemaphoreGiveFromISR((SemaphoreHandle_t)arg, &woken);
+    return woken == pdTRUE;
+}
+#endif
 
-    if (!swd_write_word(DBG_HCSR, DBGKEY | C_DEBUGEN | C_MASKINTS | C_HALT)) {
-        ESP_LOGE(DAP_TAG, "Failed to set halt");
-        return 0;
+// Allocate the ping-pong buffers of the calling task's context on first use
+static uint8_t swd_stage_init(STAGE_STATE *st)
+{
+    if (st->buf[0] != NULL) {
+        return 1;
     }
 
-    if (!swd_write_word(DBG_HCSR, DBGKEY | C_DEBUGEN | C_MASKINTS)) {
-        ESP_LOGE(DAP_TAG, "Failed to set unhalt");
-        return 0;
+    for (uint32_t i = 0; i < 2; i++) {
+        st->buf[i] = heap_caps_aligned_alloc(SWD_STAGE_ALIGN, CONFIG_ESP_SWD_PSRAM_STAGE_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA);
     }
+    st->done = xSemaphoreCreateBinary();
 
-    // check status
-    if (!swd_read_dp(DP_CTRL_STAT, &status)) {
-        ESP_LOGE(DAP_TAG, "Failed to check status");
+    if (st->buf[0] == NULL || st->buf[1] == NULL || st->done == NULL) {
+        ESP_LOGE(DAP_TAG, "Failed to allocate PSRAM staging buffers");
+        swd_stage_free(st);
         return 0;
     }
 
-    if (status & (STICKYERR | WDATAERR)) {
-        ESP_LOGE(DAP_TAG, "Status has error");
-        return 0;
+#if SWD_STAGE_DMA
+    if (stage_dma == NULL) {
+        async_memcpy_config_t cfg = ASYNC_MEMCPY_DEFAULT_CONFIG();
+        async_memcpy_handle_t handle = NULL;
+
+        cfg.sram_trans_align = 4;
+        cfg.psram_trans_align = SWD_STAGE_ALIGN;
+
+        if (esp_async_memcpy_install(&cfg, &handle) == ESP_OK) {
+            portENTER_CRITICAL(&stage_lock);
+            if (stage_dma == NULL) {
+                stage_dma = handle;
+                handle = NULL;
+            }
+            portEXIT_CRITICAL(&stage_lock);
+
+            // Another context installed the driver first
+            if (handle != NULL) {
+                esp_async_memcpy_uninstall(handle);
+            }
+        }
     }
+#endif
 
     return 1;
 }
 
-uint8_t IRAM_ATTR swd_read_core_register(uint32_t n, uint32_t *val)
+// Copy one chunk of PSRAM into a staging buffer. Returns 1 when the copy runs on
+// GDMA and st->done must be taken before the buffer is used, 0 when it's done.
+static uint8_t swd_stage_fill(STAGE_STATE *st, uint8_t *dst, const uint8_t *src, uint32_t n)
 {
-    int i = 0, timeout = 100;
+#if SWD_STAGE_DMA
+    // GDMA reads PSRAM directly, so the cache lines of src are written back first
+    if (stage_dma != NULL && ((uintptr_t)src % SWD_STAGE_ALIGN) == 0 && (n % SWD_STAGE_ALIGN) == 0 &&
+            esp_cache_msync((void *)src, n, ESP_CACHE_MSYNC_FLAG_DIR_C2M) == ESP_OK &&
+            esp_async_memcpy(stage_dma, dst, (void *)src, n, swd_stage_copy_done, st->done) == ESP_OK) {
+        return 1;
+    }
+#endif
 
-    if (!swd_write_word(DCRSR, n)) {
-        return 0;
+    memcpy(dst, src, n);
+    return 0;
+}
+
+// Write from PSRAM: chunk N+1 is copied into internal RAM while chunk N goes out
+static uint8_t swd_write_memory_staged(STAGE_STATE *st, uint32_t address, const uint8_t *data, uint32_t size)
+{
+    uint32_t ofs = 0;
+    uint32_t n, next;
+    uint8_t cur = 0;
+    uint8_t pending;
+    uint8_t ret = 1;
+
+    // First chunk ends word aligned on the target so the others need no byte accesses
+    n = CONFIG_ESP_SWD_PSRAM_STAGE_SIZE - (address & 0x3);
+    if (n > size) {
+        n = size;
     }
 
-    // wait for S_REGRDY
-    for (i = 0; i < timeout; i++) {
-        if (!swd_read_word(DHCSR, val)) {
-            return 0;
+    pending = swd_stage_fill(st, st->buf[cur], data, n);
+
+    while (ofs < size) {
+        if (pending) {
+            xSemaphoreTake(st->done, portMAX_DELAY);
         }
 
-        if (*val & S_REGRDY) {
+        next = size - ofs - n;
+        if (next > CONFIG_ESP_SWD_PSRAM_STAGE_SIZE) {
+            next = CONFIG_ESP_SWD_PSRAM_STAGE_SIZE;
+        }
+        pending = (next > 0) ? swd_stage_fill(st, st->buf[cur ^ 1], data + ofs + n, next) : 0;
+
+        if (!swd_write_memory_direct(address + ofs, st->buf[cur], n)) {
+            ret = 0;
             break;
         }
-    }
 
-    if (i == timeout) {
-        ESP_LOGE(DAP_TAG, "Timeout");
-        return 0;
+        ofs += n;
+        n = next;
+        cur ^= 1;
     }
 
-    if (!swd_read_word(DCRDR, val)) {
-        return 0;
+    // Don't leave a copy running into a buffer the next call reuses
+    if (pending) {
+        xSemaphoreTake(st->done, portMAX_DELAY);
     }
 
-    return 1;
+    return ret;
 }
 
-uint8_t IRAM_ATTR swd_write_core_register(uint32_t n, uint32_t val)
+// Read into PSRAM: the SWD loop stores to internal RAM, each chunk is then copied
+// out in one burst through the cache
+static uint8_t swd_read_memory_staged(STAGE_STATE *st, uint32_t address, uint8_t *data, uint32_t size)
 {
-    int i = 0, timeout = 100;
+    uint32_t ofs = 0;
+    uint32_t n;
 
-    if (!swd_write_word(DCRDR, val)) {
-        return 0;
-    }
+    n = CONFIG_ESP_SWD_PSRAM_STAGE_SIZE - (address & 0x3);
 
-    if (!swd_write_word(DCRSR, n | REGWnR)) {
-        return 0;
-    }
+    while (ofs < size) {
+        if (n > size - ofs) {
+            n = size - ofs;
+        }
 
-    // wait for S_REGRDY
-    for (i = 0; i < timeout; i++) {
-        if (!swd_read_word(DHCSR, &val)) {
+        if (!swd_read_memory_direct(address + ofs, st->buf[0], n)) {
             return 0;
         }
 
-        if (val & S_REGRDY) {
-            return 1;
-        }
+        memcpy(data + ofs, st->buf[0], n);
+        ofs += n;
+        n = CONFIG_ESP_SWD_PSRAM_STAGE_SIZE;
     }
 
-    ESP_LOGE(DAP_TAG, "Core timeout");
-    return 0;
+    return 1;
 }
+#endif
 
-uint8_t IRAM_ATTR swd_wait_until_halted(void)
+uint8_t IRAM_ATTR swd_read_memory(uint32_t address, uint8_t *data, uint32_t size)
 {
-    // Wait for target to stop
-    uint32_t val, i, timeout = MAX_TIMEOUT;
+    SWD_CTX_GUARD();
 
-    for (i = 0; i < timeout; i++) {
-        vTaskDelay(1);
-        if (!swd_read_word(DBG_HCSR, &val)) {
-            return 0;
-        }
+#if CONFIG_ESP_SWD_PSRAM_STAGING
+    swd_ctx_t *ctx = swd_ctx_current();
 
-        if (val & S_HALT) {
-            return 1;
-        }
+    if (size > SWD_STAGE_MIN && esp_ptr_external_ram(data) && swd_stage_init(&ctx->stage)) {
+        return swd_read_memory_staged(&ctx->stage, address, data, size);
     }
+#endif
 
-    return 0;
+    return swd_read_memory_direct(address, data, size);
 }
 
-uint8_t IRAM_ATTR swd_flash_syscall_exec(const program_syscall_t *sys_call, uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, flash_algo_return_t return_type, uint32_t *ret_out)
+uint8_t IRAM_ATTR swd_write_memory(uint32_t address, uint8_t *data, uint32_t size)
 {
-    DEBUG_STATE state = {{0}, 0};
-    // Call flash algorithm function on target and wait for result.
-    state.r[0]     = arg1;                   // R0: Argument 1
-    state.r[1]     = arg2;                   // R1: Argument 2
-    state.r[2]     = arg3;                   // R2: Argument 3
-    state.r[3]     = arg4;                   // R3: Argument 4
-    state.r[9]     = sys_call->static_base;    // SB: Static Base
-    state.r[13]    = sys_call->stack_pointer;  // SP: Stack Pointer
-    state.r[14]    = sys_call->breakpoint;     // LR: Exit Point
-    state.r[15]    = entry;                        // PC: Entry Point
-    state.xpsr     = 0x01000000;          // xPSR: T = 1, ISR = 0
+    SWD_CTX_GUARD();
 
-    if (!swd_write_debug_state(&state)) {
-        ESP_LOGE(DAP_TAG, "Failed to set state");
-        return 0;
-    }
+#if CONFIG_ESP_SWD_PSRAM_STAGING
+    swd_ctx_t *ctx = swd_ctx_current();
 
-    if (!swd_wait_until_halted()) {
-        ESP_LOGE(DAP_TAG, "Failed to halt");
-        return 0;
+    if (size > SWD_STAGE_MIN && esp_ptr_external_ram(data) && swd_stage_init(&ctx->stage)) {
+        return swd_write_memory_staged(&ctx->stage, address, data, size);
     }
+#endif
 
-    if (!swd_read_core_register(0, &state.r[0])) {
-        ESP_LOGE(DAP_TAG, "Failed to read register");
-        return 0;
-    }
+    return swd_write_memory_direct(address, data, size);
+}
 
-    //remove the C_MASKINTS
-    if (!swd_write_word(DBG_HCSR, DBGKEY | C_DEBUGEN | C_HALT)) {
-        ESP_LOGE(DAP_TAG, "Failed to halt again");
-        return 0;
-    }
+// Core debug register access through the banked data registers: with TAR at
+// DBG_Addr, BD0-BD3 are DHCSR, DCRSR, DCRDR and DEMCR, so each register costs a
+// single AP transfer instead of a CSW/TAR/DRW/RDBUFF sequence.
+static uint8_t IRAM_ATTR swd_dbg_select(void)
+{
+    AP_STATE *ap = swd_get_ap_state(0);
 
-    if (return_type == FLASHALGO_RETURN_POINTER) {
-        // Flash verify functions return pointer to byte following the buffer if successful.
-        if (state.r[0] != (arg1 + arg2)) {
+    if (ap == NULL || ap->csw != (CSW_VALUE | CSW_SIZE32) || !ap->tar_valid || ap->tar != DBG_Addr) {
+        if (!swd_write_ap(AP_CSW, CSW_VALUE | CSW_SIZE32)) {
             return 0;
         }
-    } else if (return_type == FLASHALGO_RETURN_VALUE) {
-        if (ret_out != NULL) {
-            *ret_out = state.r[0];
-        }
-    } else {
-//         ESP_LOGW(DAP_TAG, "R0 = %d", state.r[0]);
-//
-//        uint32_t r1 = 0;
-//        swd_read_core_register(1, &r1);
-//
-//        uint32_t r2 = 0;
-//        swd_read_core_register(2, &r2);
-//
-//        uint32_t r15 = 0;
-//        swd_read_core_register(15, &r15);
-//        ESP_LOGW(DAP_TAG, "R1 = 0x%x, R2 = 0x%x, R15 (PC) = 0x%x", r1, r2, r15);
-
-        if (state.r[0] != 0) {
-            uint32_t r1 = 0;
-            swd_read_core_register(1, &r1);
-
-            uint32_t r2 = 0;
-            swd_read_core_register(2, &r2);
-
-            uint32_t r15 = 0;
-            swd_read_core_register(15, &r15);
-            ESP_LOGW(DAP_TAG, "R1 = 0x%lx, R2 = 0x%lx, R15 (PC) = 0x%lx", r1, r2, r15);
 
+        if (!swd_write_tar(DBG_Addr)) {
             return 0;
         }
     }
 
-    return 1;
+    return swd_write_dp(DP_SELECT, swd_get_apsel(0) | AP_BD0);
 }
 
-// SWD Reset
-static uint8_t IRAM_ATTR swd_reset(void)
+// ofs is one of the DBG_*_OFS offsets, swd_dbg_select() must have been called
+static uint8_t IRAM_ATTR swd_dbg_write(uint32_t ofs, uint32_t val)
 {
-    uint8_t tmp_in[8];
-    uint8_t i = 0;
+    swd_ctx_t *ctx = swd_ctx_current();
 
-    for (i = 0; i < 8; i++) {
-        tmp_in[i] = 0xff;
+    return swd_transfer(ctx, SWD_REG_AP | SWD_REG_W | SWD_REG_ADR(ofs), &val) == DAP_TRANSFER_OK;
+}
+
+static uint8_t IRAM_ATTR swd_dbg_read(uint32_t ofs, uint32_t *val)
+{
+    swd_ctx_t *ctx = swd_ctx_current();
+
+    if (swd_transfer(ctx, SWD_REG_AP | SWD_REG_R | SWD_REG_ADR(ofs), NULL) != DAP_TRANSFER_OK) {
+        return 0;
     }
 
-    SWJ_Sequence(51, tmp_in);
-    return 1;
+    return swd_transfer(ctx, SWD_REG_DP | SWD_REG_R | SWD_REG_ADR(DP_RDBUFF), val) == DAP_TRANSFER_OK;
 }
 
-// SWD Switch
-static uint8_t IRAM_ATTR swd_switch(uint16_t val)
+// Read two debug registers back to back, the second AP read returns the first value
+static uint8_t IRAM_ATTR swd_dbg_read2(uint32_t ofs_a, uint32_t *a, uint32_t ofs_b, uint32_t *b)
 {
-    uint8_t tmp_in[2];
-    tmp_in[0] = val & 0xff;
-    tmp_in[1] = (val >> 8) & 0xff;
-    SWJ_Sequence(16, tmp_in);
-    return 1;
+    swd_ctx_t *ctx = swd_ctx_current();
+
+    if (swd_transfer(ctx, SWD_REG_AP | SWD_REG_R | SWD_REG_ADR(ofs_a), NULL) != DAP_TRANSFER_OK) {
+        return 0;
+    }
+
+    if (swd_transfer(ctx, SWD_REG_AP | SWD_REG_R | SWD_REG_ADR(ofs_b), a) != DAP_TRANSFER_OK) {
+        return 0;
+    }
+
+    return swd_transfer(ctx, SWD_REG_DP | SWD_REG_R | SWD_REG_ADR(DP_RDBUFF), b) == DAP_TRANSFER_OK;
 }
 
+static uint8_t IRAM_ATTR swd_write_dhcsr(uint32_t val)
+{
+    // Registers change once the core runs or steps
+    if (!(val & C_HALT) || (val & C_STEP)) {
+        swd_reg_cache_invalidate(swd_ctx_current());
+    }
+
+    return swd_dbg_select() && swd_dbg_write(DBG_HCSR_OFS, val);
+}
 
-// SWD Read ID
-uint8_t IRAM_ATTR swd_read_idcode(uint32_t *id)
+static uint8_t IRAM_ATTR swd_read_dhcsr(uint32_t *val)
 {
-    uint8_t tmp_in[1];
-    uint8_t tmp_out[4];
-    tmp_in[0] = 0x00;
-    SWJ_Sequence(8, tmp_in);
+    REG_CACHE *cache = &swd_ctx_current()->reg_cache;
 
-    if (swd_read_dp(0, (uint32_t *)tmp_out) != 0x01) {
+    if (!swd_dbg_select() || !swd_dbg_read(DBG_HCSR_OFS, val)) {
         return 0;
     }
 
-    *id = (tmp_out[3] << 24) | (tmp_out[2] << 16) | (tmp_out[1] << 8) | tmp_out[0];
+    swd_reg_cache_check_reset(swd_ctx_current(), *val);
+    if (*val & S_HALT) {
+        cache->halted = 1;
+    } else {
+        swd_reg_cache_invalidate(swd_ctx_current());
+    }
+
     return 1;
 }
 
+// Execute system call.
+static uint8_t swd_write_core_regs(const uint8_t *sel, const uint32_t *val, uint32_t count);
 
-uint8_t IRAM_ATTR JTAG2SWD()
+// Only registers that differ from the previous call are written while the core is still
+// halted at the breakpoint of the previous syscall. SB and SP are callee-saved under AAPCS,
+// R0-R3 and LR aren't and PC always changes. The call does clobber the NZCV flags in xPSR;
+// skipping it is safe only because no routine reads the flags at entry, and EPSR.T and IPSR
+// keep the values of the first full write (Thumb, thread mode) across the call.
+static uint8_t IRAM_ATTR swd_write_debug_state(DEBUG_STATE *state)
 {
-    uint32_t tmp = 0;
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint8_t sel[9];
+    uint32_t val[9];
+    uint32_t n = 0, status;
+    uint8_t delta = ctx->last_state_valid;
 
-    if (!swd_reset()) {
+    ctx->last_state_valid = 0;
+
+    if (!swd_write_dp(DP_SELECT, 0)) {
         return 0;
     }
 
-    if (!swd_switch(0xE79E)) {
+    // R0, R1, R2, R3
+    for (uint32_t i = 0; i < 4; i++) {
+        sel[n] = i;
+        val[n++] = state->r[i];
+    }
+
+    // R9, R13
+    if (!delta || state->r[9] != ctx->last_state.r[9]) {
+        sel[n] = 9;
+        val[n++] = state->r[9];
+    }
+
+    if (!delta || state->r[13] != ctx->last_state.r[13]) {
+        sel[n] = 13;
+        val[n++] = state->r[13];
+    }
+
+    // R14, R15
+    sel[n] = 14;
+    val[n++] = state->r[14];
+    sel[n] = 15;
+    val[n++] = state->r[15];
+
+    // xPSR
+    if (!delta || state->xpsr != ctx->last_state.xpsr) {
+        sel[n] = 16;
+        val[n++] = state->xpsr;
+    }
+
+    if (!swd_write_core_regs(sel, val, n)) {
+        ESP_LOGE(DAP_TAG, "Failed to set core registers");
         return 0;
     }
 
-    if (!swd_reset()) {
+    ctx->last_state = *state;
+
+    if (!swd_write_dhcsr(DBGKEY | C_DEBUGEN | C_MASKINTS | C_HALT)) {
+        ESP_LOGE(DAP_TAG, "Failed to set halt");
         return 0;
     }
 
-    if (!swd_read_idcode(&tmp)) {
-        ESP_LOGE(DAP_TAG, "Set transit fail");
+    if (!swd_write_dhcsr(DBGKEY | C_DEBUGEN | C_MASKINTS)) {
+        ESP_LOGE(DAP_TAG, "Failed to set unhalt");
+        return 0;
+    }
+
+    // check status
+    if (!swd_read_dp(DP_CTRL_STAT, &status)) {
+        ESP_LOGE(DAP_TAG, "Failed to check status");
+        return 0;
+    }
+
+    if (status & (STICKYERR | WDATAERR)) {
+        ESP_LOGE(DAP_TAG, "Status has error");
         return 0;
     }
 
     return 1;
 }
 
+// Cache slot of a DCRSR selector: R0-R15, xPSR, MSP, PSP, special, FPSCR and S0-S31.
+// Other selectors (secure/non-secure banked stack pointers) are not cached.
+static int32_t IRAM_ATTR swd_reg_cache_slot(uint8_t sel)
+{
+    if (sel <= 20) {
+        return sel;
+    } else if (sel == 0x21) {
+        return 21;
+    } else if (sel >= 0x40 && sel <= 0x5F) {
+        return 32 + (sel - 0x40);
+    }
 
+    return -1;
+}
 
-uint8_t swd_init_debug(void)
+// Read count core registers with DCRSR selectors sel[], selecting the debug bank once
+static uint8_t IRAM_ATTR swd_read_core_regs(const uint8_t *sel, uint32_t *val, uint32_t count)
 {
-    uint32_t tmp = 0;
-    int i = 0;
-    int timeout = 100;
-    // init dap state with fake values
-    dap_state.select = 0xffffffff;
-    dap_state.csw = 0xffffffff;
+    REG_CACHE *cache = &swd_ctx_current()->reg_cache;
+    int i = 0, timeout = 100;
+    uint8_t selected = 0;
+    uint32_t dhcsr;
+    int32_t slot;
+
+    for (uint32_t k = 0; k < count; k++) {
+        slot = swd_reg_cache_slot(sel[k]);
+        if (cache->halted && slot >= 0 && (cache->valid & (1ULL << slot))) {
+            val[k] = cache->val[slot];
+            cache->hits++;
+            continue;
+        }
 
-#if CONFIG_ESP_SWD_BOOT_PIN != -1
-    gpio_config_t boot_pin_cfg = {};
-    boot_pin_cfg.intr_type = GPIO_INTR_DISABLE;
-    boot_pin_cfg.mode = GPIO_MODE_OUTPUT;
-    boot_pin_cfg.pull_down_en = GPIO_PULLDOWN_ENABLE;
-    boot_pin_cfg.pull_up_en = GPIO_PULLUP_DISABLE;
-    boot_pin_cfg.pin_bit_mask = (1 << CONFIG_ESP_SWD_BOOT_PIN);
-    gpio_config(&boot_pin_cfg);
-
-    ESP_LOGI(DAP_TAG, "Asserting BOOT0 pin");
-    gpio_set_level(CONFIG_ESP_SWD_BOOT_PIN, 1);
-    vTaskDelay(pdMS_TO_TICKS(20));
-#endif
+        cache->misses++;
+        if (!selected) {
+            if (!swd_dbg_select()) {
+                return 0;
+            }
+            selected = 1;
+        }
 
-    int8_t retries = 4;
-    int8_t do_abort = 0;
-    do {
-        if (do_abort) {
-            //do an abort on stale target, then reset the device
-            swd_write_dp(DP_ABORT, DAPABORT);
-            PIN_nRESET_OUT(0);
-            vTaskDelay(pdMS_TO_TICKS(20));
-            PIN_nRESET_OUT(1);
-            vTaskDelay(pdMS_TO_TICKS(20));
-            do_abort = 0;
+        if (!swd_dbg_write(DBG_CRSR_OFS, sel[k])) {
+            return 0;
         }
-        swd_init();
 
-        if (!JTAG2SWD()) {
-            ESP_LOGE(DAP_TAG, "JTAG2SWD fail");
-            do_abort = 1;
-            continue;
+        // wait for S_REGRDY, DCRDR is read right behind DHCSR and only used once it's set,
+        // so a ready register costs one pass
+        for (i = 0; i < timeout; i++) {
+            if (!swd_dbg_read2(DBG_HCSR_OFS, &dhcsr, DBG_CRDR_OFS, &val[k])) {
+                return 0;
+            }
+            swd_reg_cache_check_reset(swd_ctx_current(), dhcsr);
+
+            if (dhcsr & S_REGRDY) {
+                break;
+            }
         }
 
-        if (!swd_clear_errors()) {
-            ESP_LOGE(DAP_TAG, "Clear error fail");
-            do_abort = 1;
-            continue;
+        if (i == timeout) {
+            ESP_LOGE(DAP_TAG, "Timeout");
+            return 0;
         }
 
-        if (!swd_write_dp(DP_SELECT, 0)) {
-            ESP_LOGE(DAP_TAG, "SELECT DP fail");
-            do_abort = 1;
-            continue;
+        // Only cached once the core was seen halted, S_HALT is in the DHCSR just read
+        if (dhcsr & S_HALT) {
+            cache->halted = 1;
+            if (slot >= 0) {
+                cache->val[slot] = val[k];
+                cache->valid |= 1ULL << slot;
+            }
+        }
+    }
 
+    return 1;
+}
+
+static uint8_t IRAM_ATTR swd_write_core_regs(const uint8_t *sel, const uint32_t *val, uint32_t count)
+{
+    REG_CACHE *cache = &swd_ctx_current()->reg_cache;
+    int i = 0, timeout = 100;
+    uint32_t dhcsr;
+    int32_t slot;
+
+    if (!swd_dbg_select()) {
+        return 0;
+    }
+
+    for (uint32_t k = 0; k < count; k++) {
+        if (!swd_dbg_write(DBG_CRDR_OFS, val[k])) {
+            return 0;
         }
 
-        // Power up
-        if (!swd_write_dp(DP_CTRL_STAT, CSYSPWRUPREQ | CDBGPWRUPREQ)) {
-            ESP_LOGE(DAP_TAG, "Power up fail");
-            do_abort = 1;
-            continue;
+        if (!swd_dbg_write(DBG_CRSR_OFS, sel[k] | REGWnR)) {
+            return 0;
         }
 
+        // wait for S_REGRDY
         for (i = 0; i < timeout; i++) {
-            if (!swd_read_dp(DP_CTRL_STAT, &tmp)) {
-                ESP_LOGE(DAP_TAG, "DP_CTRL_STAT fail");
-                do_abort = 1;
-                break;
+            if (!swd_dbg_read(DBG_HCSR_OFS, &dhcsr)) {
+                return 0;
             }
-            if ((tmp & (CDBGPWRUPACK | CSYSPWRUPACK)) == (CDBGPWRUPACK | CSYSPWRUPACK)) {
-                // Break from loop if powerup is complete
+            swd_reg_cache_check_reset(swd_ctx_current(), dhcsr);
+
+            if (dhcsr & S_REGRDY) {
                 break;
             }
         }
-        if ((i == timeout) || (do_abort == 1)) {
-            // Unable to powerup DP
-            ESP_LOGE(DAP_TAG, "Unable to powerup DP");
-            do_abort = 1;
-            continue;
-        }
 
-        if (!swd_write_dp(DP_CTRL_STAT, CSYSPWRUPREQ | CDBGPWRUPREQ | TRNNORMAL | MASKLANE)) {
-            ESP_LOGE(DAP_TAG, "Set transit fail");
-            do_abort = 1;
-            continue;
+        if (i == timeout) {
+            ESP_LOGE(DAP_TAG, "Core timeout");
+            return 0;
         }
 
-        if (!swd_write_dp(DP_SELECT, 0)) {
-            ESP_LOGE(DAP_TAG, "Unselect DP fail");
-            do_abort = 1;
-            continue;
+        // Write-through. SP aliases MSP or PSP depending on CONTROL.SPSEL.
+        if (sel[k] == 13 || sel[k] == 17 || sel[k] == 18 || sel[k] == 20) {
+            cache->valid &= ~((1ULL << 13) | (1ULL << 17) | (1ULL << 18));
         }
 
-        return 1;
-
-    } while (--retries > 0);
+        slot = swd_reg_cache_slot(sel[k]);
+        if (slot >= 0 && (dhcsr & S_HALT)) {
+            cache->halted = 1;
+            cache->val[slot] = val[k];
+            cache->valid |= 1ULL << slot;
+        }
+    }
 
-    return 0;
+    return 1;
 }
 
-uint8_t IRAM_ATTR swd_halt_target()
+uint8_t IRAM_ATTR swd_read_core_register(uint32_t n, uint32_t *val)
 {
-    if (!swd_write_word(DBG_HCSR, DBGKEY | C_DEBUGEN | C_HALT)) {
-        return 0;
-    }
-
-    return 1;
+    SWD_CTX_GUARD();
+    uint8_t sel = n;
+    return swd_read_core_regs(&sel, val, 1);
 }
 
-void swd_trigger_nrst()
+uint8_t IRAM_ATTR swd_write_core_register(uint32_t n, uint32_t val)
 {
-    gpio_set_level(CONFIG_ESP_SWD_BOOT_PIN, 0);
-    vTaskDelay(pdMS_TO_TICKS(20));
-    PIN_nRESET_OUT(0);
-    vTaskDelay(pdMS_TO_TICKS(350));
-    PIN_nRESET_OUT(1);
-    vTaskDelay(pdMS_TO_TICKS(100));
+    SWD_CTX_GUARD();
+    uint8_t sel = n;
+    swd_ctx_current()->last_state_valid = 0;
+    return swd_write_core_regs(&sel, &val, 1);
 }
 
-uint8_t swd_flash_syscall_exec_async(const program_syscall_t *sys_call, uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4)
+// R0-R15, xPSR, MSP, PSP and CONTROL/FAULTMASK/BASEPRI/PRIMASK in swd_core_context_t order
+static const uint8_t core_context_sel[] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 20,
+};
+
+#define CORE_CONTEXT_REGS   (sizeof(core_context_sel))
+#define CORE_REG_FPSCR      0x21
+#define CORE_REG_S0         0x40
+
+// The FP registers are only accessible with the FPU implemented and enabled in CPACR
+static uint8_t swd_fpu_enabled(uint8_t *enabled)
 {
-    DEBUG_STATE state = {{0}, 0};
-    // Call flash algorithm function on target and wait for result.
-    state.r[0]     = arg1;                   // R0: Argument 1
-    state.r[1]     = arg2;                   // R1: Argument 2
-    state.r[2]     = arg3;                   // R2: Argument 3
-    state.r[3]     = arg4;                   // R3: Argument 4
-    state.r[9]     = sys_call->static_base;    // SB: Static Base
-    state.r[13]    = sys_call->stack_pointer;  // SP: Stack Pointer
-    state.r[14]    = sys_call->breakpoint;     // LR: Exit Point
-    state.r[15]    = entry;                        // PC: Entry Point
-    state.xpsr     = 0x01000000;          // xPSR: T = 1, ISR = 0
+    uint32_t mvfr0, cpacr;
 
-    if (!swd_write_debug_state(&state)) {
-        ESP_LOGE(DAP_TAG, "Failed to set state");
+    if (!swd_read_word(NVIC_MVFR0, &mvfr0) || !swd_read_word(NVIC_CPACR, &cpacr)) {
         return 0;
     }
 
+    *enabled = ((mvfr0 & MVFR0_SP) != 0) && ((cpacr & CPACR_CP10_CP11) != 0);
     return 1;
 }
 
-uint8_t swd_flash_syscall_wait_result(flash_algo_return_t return_type, uint32_t *ret_out)
+static void swd_fp_selectors(uint8_t *sel)
 {
-    DEBUG_STATE state = {{0}, 0};
-    if (!swd_wait_until_halted()) {
-        ESP_LOGE(DAP_TAG, "Failed to halt");
-        return 0;
+    for (uint32_t i = 0; i < 32; i++) {
+        sel[i] = CORE_REG_S0 + i;
     }
+}
 
-    if (!swd_read_core_register(0, &state.r[0])) {
-        ESP_LOGE(DAP_TAG, "Failed to read register");
+// Snapshot of the halted core, FPU registers are included when the FPU is enabled
+uint8_t swd_read_core_context(swd_core_context_t *context)
+{
+    SWD_CTX_GUARD();
+    uint32_t regs[CORE_CONTEXT_REGS];
+    uint32_t fp[32];
+    uint8_t fp_sel[32];
+    uint8_t fpscr_sel = CORE_REG_FPSCR;
+    uint32_t dhcsr, fpscr = 0;
+    uint8_t fpu;
+
+    if (!swd_read_dhcsr(&dhcsr) || !(dhcsr & S_HALT)) {
         return 0;
     }
 
-    //remove the C_MASKINTS
-    if (!swd_write_word(DBG_HCSR, DBGKEY | C_DEBUGEN | C_HALT)) {
-        ESP_LOGE(DAP_TAG, "Failed to halt again");
+    if (!swd_read_core_regs(core_context_sel, regs, CORE_CONTEXT_REGS)) {
         return 0;
     }
 
-    if (return_type == FLASHALGO_RETURN_POINTER) {
-        // Flash verify functions return pointer to byte following the buffer if successful.
-        ESP_LOGE(DAP_TAG, "Async exec doesn't support POINTER return type");
+    if (!swd_fpu_enabled(&fpu)) {
         return 0;
-    } else if (return_type == FLASHALGO_RETURN_VALUE) {
-        if (ret_out != NULL) {
-            *ret_out = state.r[0];
+    }
+
+    if (fpu) {
+        swd_fp_selectors(fp_sel);
+        if (!swd_read_core_regs(fp_sel, fp, 32) || !swd_read_core_regs(&fpscr_sel, &fpscr, 1)) {
+            return 0;
         }
-    } else {
-        if (state.r[0] != 0) {
-            uint32_t r1 = 0;
-            swd_read_core_register(1, &r1);
+        memcpy(context->s, fp, sizeof(fp));
+    }
 
-            uint32_t r2 = 0;
-            swd_read_core_register(2, &r2);
+    memcpy(context->r, regs, sizeof(context->r));
+    context->xpsr = regs[16];
+    context->msp = regs[17];
+    context->psp = regs[18];
+    context->special = regs[19];
+    context->fpscr = fpscr;
+    context->fpu = fpu;
+    return 1;
+}
 
-            uint32_t r15 = 0;
-            swd_read_core_register(15, &r15);
-            ESP_LOGW(DAP_TAG, "R1 = 0x%lx, R2 = 0x%lx, R15 (PC) = 0x%lx", r1, r2, r15);
+// Restore a snapshot taken by swd_read_core_context(). SP is restored through MSP/PSP.
+uint8_t swd_write_core_context(const swd_core_context_t *context)
+{
+    SWD_CTX_GUARD();
+    uint32_t regs[CORE_CONTEXT_REGS];
+    uint32_t fp[32];
+    uint8_t fp_sel[32];
+    uint8_t fpscr_sel = CORE_REG_FPSCR;
+    uint32_t fpscr = context->fpscr;
+    uint32_t dhcsr;
+
+    swd_ctx_current()->last_state_valid = 0;
+    if (!swd_read_dhcsr(&dhcsr) || !(dhcsr & S_HALT)) {
+        return 0;
+    }
+
+    memcpy(regs, context->r, sizeof(context->r));
+    regs[16] = context->xpsr;
+    regs[17] = context->msp;
+    regs[18] = context->psp;
+    regs[19] = context->special;
+
+    // CONTROL first so SPSEL matches, then MSP/PSP, the rest without R13
+    if (!swd_write_core_regs(&core_context_sel[19], &regs[19], 1)
+            || !swd_write_core_regs(&core_context_sel[17], &regs[17], 2)
+            || !swd_write_core_regs(core_context_sel, regs, 13)
+            || !swd_write_core_regs(&core_context_sel[14], &regs[14], 3)) {
+        return 0;
+    }
 
+    if (context->fpu) {
+        memcpy(fp, context->s, sizeof(fp));
+        swd_fp_selectors(fp_sel);
+        if (!swd_write_core_regs(fp_sel, fp, 32) || !swd_write_core_regs(&fpscr_sel, &fpscr, 1)) {
             return 0;
         }
     }
@@ -1050,3 +1615,1147 @@ uint8_t swd_flash_syscall_wait_result(flash_algo_return_t return_type, uint32_t
     return 1;
 }
 
+uint8_t IRAM_ATTR swd_wait_until_halted(void)
+{
+    SWD_CTX_GUARD();
+
+    // Wait for target to stop
+    int64_t start = esp_timer_get_time();
+    int64_t elapsed = 0;
+    uint32_t timeout = swd_ctx_current()->halt_timeout_us;
+    uint32_t val;
+
+    while (1) {
+        if (!swd_read_dhcsr(&val)) {
+            return 0;
+        }
+
+        if (val & S_HALT) {
+            return 1;
+        }
+
+        elapsed = esp_timer_get_time() - start;
+        if (timeout != 0 && elapsed >= timeout) {
+            ESP_LOGE(DAP_TAG, "Halt timeout after %lld us", elapsed);
+            return 0;
+        }
+
+        // Short algorithm calls finish within the spin phase, long ones end up sleeping
+        if (elapsed < CONFIG_ESP_SWD_HALT_SPIN_US) {
+            continue;
+        } else if (elapsed < CONFIG_ESP_SWD_HALT_DELAY_US) {
+            esp_rom_delay_us(CONFIG_ESP_SWD_HALT_DELAY_STEP_US);
+            taskYIELD();
+        } else {
+            vTaskDelay(1);
+        }
+    }
+}
+
+uint8_t IRAM_ATTR swd_flash_syscall_exec(const program_syscall_t *sys_call, uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, flash_algo_return_t return_type, uint32_t *ret_out)
+{
+    SWD_CTX_GUARD();
+
+    // Call flash algorithm function on target and wait for result.
+    if (!swd_flash_syscall_exec_async(sys_call, entry, arg1, arg2, arg3, arg4)) {
+        return 0;
+    }
+
+    return swd_flash_syscall_wait_result(return_type, ret_out);
+}
+
+// SWD Reset
+static uint8_t IRAM_ATTR swd_reset(void)
+{
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint8_t tmp_in[8];
+    uint8_t i = 0;
+
+    for (i = 0; i < 8; i++) {
+        tmp_in[i] = 0xff;
+    }
+
+    SWJ_Sequence_Port(ctx->port, 51, tmp_in);
+    return 1;
+}
+
+// SWD Switch
+static uint8_t IRAM_ATTR swd_switch(uint16_t val)
+{
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint8_t tmp_in[2];
+    tmp_in[0] = val & 0xff;
+    tmp_in[1] = (val >> 8) & 0xff;
+    SWJ_Sequence_Port(ctx->port, 16, tmp_in);
+    return 1;
+}
+
+
+// SWD Read ID
+uint8_t IRAM_ATTR swd_read_idcode(uint32_t *id)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint8_t tmp_in[1];
+    uint8_t tmp_out[4];
+    tmp_in[0] = 0x00;
+    SWJ_Sequence_Port(ctx->port, 8, tmp_in);
+
+    if (swd_read_dp(0, (uint32_t *)tmp_out) != 0x01) {
+        return 0;
+    }
+
+    *id = (tmp_out[3] << 24) | (tmp_out[2] << 16) | (tmp_out[1] << 8) | tmp_out[0];
+    return 1;
+}
+
+
+// SWD to dormant state: line reset followed by the 16-bit select sequence
+static uint8_t IRAM_ATTR swd_to_dormant(void)
+{
+    if (!swd_reset()) {
+        return 0;
+    }
+
+    return swd_switch(0xE3BC);
+}
+
+// Dormant to SWD: selection alert sequence and SWD activation code (ADIv5.2)
+static uint8_t IRAM_ATTR swd_dormant_wakeup(void)
+{
+    swd_ctx_t *ctx = swd_ctx_current();
+    static const uint8_t alert_seq[16] = {
+        0x92, 0xf3, 0x09, 0x62, 0x95, 0x2d, 0x85, 0x86,
+        0xe9, 0xaf, 0xdd, 0xe3, 0xa2, 0x0e, 0xbc, 0x19,
+    };
+    uint8_t tmp_in[1];
+
+    // At least 8 cycles with SWDIO high
+    tmp_in[0] = 0xff;
+    SWJ_Sequence_Port(ctx->port, 8, tmp_in);
+
+    SWJ_Sequence_Port(ctx->port, 128, alert_seq);
+
+    // 4 cycles low, then the SWD activation code
+    tmp_in[0] = 0x00;
+    SWJ_Sequence_Port(ctx->port, 4, tmp_in);
+    tmp_in[0] = 0x1a;
+    SWJ_Sequence_Port(ctx->port, 8, tmp_in);
+
+    return 1;
+}
+
+// Line reset and TARGETSEL write, the selected target answers the following IDCODE read
+static uint8_t IRAM_ATTR swd_write_targetsel(uint32_t targetsel)
+{
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint8_t tmp_in[5];
+    uint8_t tmp_out[1];
+    uint32_t parity = 0;
+
+    if (!swd_reset()) {
+        return 0;
+    }
+
+    // At least 2 idle cycles
+    tmp_in[0] = 0x00;
+    SWJ_Sequence_Port(ctx->port, 8, tmp_in);
+
+    // Start, DP, W, A[3:2] = 0x0C, parity, stop, park
+    tmp_in[0] = 0x99;
+    SWJ_Sequence_Port(ctx->port, 8, tmp_in);
+
+    // Turnaround, ACK and turnaround: no target drives the line for TARGETSEL
+    GPIO.enable_w1tc = ctx->port->swdio;
+    PIN_INPUT_ENABLE(GPIO_PIN_MUX_REG[ctx->swdio_pin]);
+    SWD_Sequence_Port(ctx->port, SWD_SEQUENCE_DIN | 5, NULL, tmp_out);
+    GPIO.enable_w1ts = ctx->port->swdio;
+    PIN_INPUT_DISABLE(GPIO_PIN_MUX_REG[ctx->swdio_pin]);
+
+    for (uint32_t i = 0; i < 32; i++) {
+        parity += (targetsel >> i) & 1;
+    }
+
+    int2array(tmp_in, targetsel, 4);
+    tmp_in[4] = parity & 1;
+    SWJ_Sequence_Port(ctx->port, 33, tmp_in);
+
+    // Selection only completes with the IDCODE read
+    return swd_read_idcode(&parity);
+}
+
+uint8_t IRAM_ATTR JTAG2SWD()
+{
+    SWD_CTX_GUARD();
+    uint32_t tmp = 0;
+
+    if (!swd_reset()) {
+        return 0;
+    }
+
+    if (!swd_switch(0xE79E)) {
+        return 0;
+    }
+
+    if (!swd_reset()) {
+        return 0;
+    }
+
+    if (!swd_read_idcode(&tmp)) {
+        ESP_LOGE(DAP_TAG, "Set transit fail");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+
+// Microseconds since *t, moves *t to now for the next phase
+static uint32_t swd_elapsed_us(int64_t *t)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t us = now - *t;
+
+    *t = now;
+    return us;
+}
+
+// Clear errors, power up the debug and system domains and scan the APs of the
+// DP currently talking on the wire
+static uint8_t swd_power_up_dp(void)
+{
+    swd_connect_timing_t *timing = &swd_ctx_current()->timing;
+    uint32_t tmp = 0;
+    int64_t t = esp_timer_get_time();
+    int64_t deadline = t + CONFIG_ESP_SWD_POWERUP_TIMEOUT_US;
+
+    if (!swd_clear_errors()) {
+        ESP_LOGE(DAP_TAG, "Clear error fail");
+        return 0;
+    }
+
+    if (!swd_write_dp(DP_SELECT, 0)) {
+        ESP_LOGE(DAP_TAG, "SELECT DP fail");
+        return 0;
+    }
+
+    // Power up
+    if (!swd_write_dp(DP_CTRL_STAT, CSYSPWRUPREQ | CDBGPWRUPREQ)) {
+        ESP_LOGE(DAP_TAG, "Power up fail");
+        return 0;
+    }
+
+    while (true) {
+        if (!swd_read_dp(DP_CTRL_STAT, &tmp)) {
+            ESP_LOGE(DAP_TAG, "DP_CTRL_STAT fail");
+            return 0;
+        }
+        if ((tmp & (CDBGPWRUPACK | CSYSPWRUPACK)) == (CDBGPWRUPACK | CSYSPWRUPACK)) {
+            // Break from loop if powerup is complete
+            break;
+        }
+        if (esp_timer_get_time() >= deadline) {
+            // Unable to powerup DP
+            ESP_LOGE(DAP_TAG, "Unable to powerup DP");
+            return 0;
+        }
+    }
+
+    if (!swd_write_dp(DP_CTRL_STAT, CSYSPWRUPREQ | CDBGPWRUPREQ | TRNNORMAL | MASKLANE)) {
+        ESP_LOGE(DAP_TAG, "Set transit fail");
+        return 0;
+    }
+
+    if (!swd_write_dp(DP_SELECT, 0)) {
+        ESP_LOGE(DAP_TAG, "Unselect DP fail");
+        return 0;
+    }
+
+    timing->power_up_us += swd_elapsed_us(&t);
+
+    if (!swd_ap_enumerate()) {
+        ESP_LOGW(DAP_TAG, "AP scan failed, only the default AP is usable");
+    }
+
+    timing->ap_scan_us += swd_elapsed_us(&t);
+
+#if CONFIG_ESP_SWD_ROMTABLE_AT_CONNECT
+    if (!swd_romtable_discover(NULL)) {
+        ESP_LOGW(DAP_TAG, "ROM table discovery failed, using default SCS address");
+    }
+
+    timing->romtable_us += swd_elapsed_us(&t);
+#endif
+
+    return 1;
+}
+
+// Connect with nRST held so firmware never gets to reconfigure the SWD pins or
+// sleep, then catch the reset vector and release it. Targets without an nRST
+// line get the AIRCR reset selected by swd_set_soft_reset() instead.
+// Connect with nRST asserted and catch the reset vector. *armed is set once
+// VC_CORERESET was added to DEMCR, *demcr holds the value found before.
+static uint8_t swd_catch_reset_vector(swd_ctx_t *ctx, uint32_t *demcr, uint8_t *armed)
+{
+    uint32_t dhcsr, aircr;
+    int64_t t = esp_timer_get_time();
+    int64_t deadline;
+
+    swd_nreset_out(ctx, 0);
+
+    if (!JTAG2SWD()) {
+        ESP_LOGE(DAP_TAG, "JTAG2SWD under reset fail");
+        return 0;
+    }
+
+    ctx->timing.line_us += swd_elapsed_us(&t);
+
+    if (!swd_power_up_dp()) {
+        return 0;
+    }
+
+    // DHCSR and DEMCR survive a system reset
+    if (!swd_dbg_select() || !swd_dbg_read(DBG_EMCR_OFS, demcr)) {
+        ESP_LOGE(DAP_TAG, "Reset vector catch fail");
+        return 0;
+    }
+
+    *armed = 1;
+    if (!swd_dbg_write(DBG_EMCR_OFS, *demcr | VC_CORERESET) || !swd_write_dhcsr(DBGKEY | C_DEBUGEN)) {
+        ESP_LOGE(DAP_TAG, "Reset vector catch fail");
+        return 0;
+    }
+
+    if (ctx->nrst_pin >= 0) {
+        swd_nreset_out(ctx, 1);
+    } else {
+        if (!swd_read_word(NVIC_AIRCR, &aircr)) {
+            return 0;
+        }
+        // The reset cuts the write response short, so only the halt check below counts
+        swd_write_word(NVIC_AIRCR, VECTKEY | (aircr & SCB_AIRCR_PRIGROUP_Msk) | ctx->soft_reset);
+    }
+
+    // Some parts reset the AP along with the core, so CSW/TAR are written again
+    t = esp_timer_get_time();
+    deadline = t + CONFIG_ESP_SWD_RESET_HALT_TIMEOUT_US;
+    do {
+        ctx->dap_state.select = 0xffffffff;
+        swd_reset_ap_state(ctx);
+
+        if (swd_read_dhcsr(&dhcsr) && (dhcsr & S_HALT)) {
+            ctx->timing.halt_us += swd_elapsed_us(&t);
+            if (swd_dbg_select() && swd_dbg_write(DBG_EMCR_OFS, *demcr & ~VC_CORERESET)) {
+                *armed = 0;
+                return 1;
+            }
+            return 0;
+        }
+        swd_clear_errors();
+    } while (esp_timer_get_time() < deadline);
+
+    ctx->timing.halt_us += swd_elapsed_us(&t);
+    ESP_LOGE(DAP_TAG, "No halt at the reset vector");
+    return 0;
+}
+
+// A failed attempt must not leave the target held in reset or with the vector catch armed
+static uint8_t swd_connect_under_reset(swd_ctx_t *ctx)
+{
+    uint32_t demcr = 0;
+    uint8_t armed = 0;
+
+    if (swd_catch_reset_vector(ctx, &demcr, &armed)) {
+        return 1;
+    }
+
+    swd_nreset_out(ctx, 1);
+    if (armed) {
+        swd_clear_errors();
+        if (!swd_dbg_select() || !swd_dbg_write(DBG_EMCR_OFS, demcr)) {
+            ESP_LOGW(DAP_TAG, "DEMCR not restored");
+        }
+    }
+
+    return 0;
+}
+
+// Keep the link of the previous session if the DP is still powered up and has no
+// sticky errors. One CTRL/STAT read replaces the line reset, JTAG-to-SWD switch and
+// power-up handshake, and the cached SELECT/CSW/TAR stay valid.
+static uint8_t swd_resume(swd_ctx_t *ctx)
+{
+    uint32_t stat;
+
+    if (!ctx->session_valid || ctx->reset_connect != CONNECT_NORMAL || ctx->multidrop_count != 0) {
+        return 0;
+    }
+
+    ctx->session_valid = 0;
+
+    // SELECT always has DPBANKSEL 0 after swd_power_up_dp(), so this is CTRL/STAT
+    if (!swd_read_dp(DP_CTRL_STAT, &stat)) {
+        return 0;
+    }
+
+    if ((stat & (CDBGPWRUPACK | CSYSPWRUPACK)) != (CDBGPWRUPACK | CSYSPWRUPACK) ||
+            (stat & (STICKYORUN | STICKYCMP | STICKYERR | WDATAERR))) {
+        return 0;
+    }
+
+    ctx->session_valid = 1;
+    return 1;
+}
+
+uint8_t swd_init_debug(void)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+    int64_t start = esp_timer_get_time();
+    int64_t t = start;
+    uint8_t ret = 0;
+
+    // The core may have been run or reset since, only the link state is kept
+    if (swd_resume(ctx)) {
+        swd_reg_cache_invalidate(ctx);
+        ctx->last_state_valid = 0;
+        memset(&ctx->timing, 0, sizeof(ctx->timing));
+        ctx->timing.resumed = 1;
+        ctx->timing.total_us = esp_timer_get_time() - start;
+        return 1;
+    }
+
+    // init dap state with fake values
+    ctx->dap_state.select = 0xffffffff;
+    swd_reset_ap_state(ctx);
+    swd_reg_cache_invalidate(ctx);
+    ctx->last_state_valid = 0;
+    ctx->multidrop_count = 0;
+    memset(&ctx->timing, 0, sizeof(ctx->timing));
+
+#if CONFIG_ESP_SWD_BOOT_PIN != -1
+    if (ctx == &default_ctx) {
+        gpio_config_t boot_pin_cfg = {};
+        boot_pin_cfg.intr_type = GPIO_INTR_DISABLE;
+        boot_pin_cfg.mode = GPIO_MODE_OUTPUT;
+        boot_pin_cfg.pull_down_en = GPIO_PULLDOWN_ENABLE;
+        boot_pin_cfg.pull_up_en = GPIO_PULLUP_DISABLE;
+        boot_pin_cfg.pin_bit_mask = (1 << CONFIG_ESP_SWD_BOOT_PIN);
+        gpio_config(&boot_pin_cfg);
+
+        ESP_LOGI(DAP_TAG, "Asserting BOOT0 pin");
+        gpio_set_level(CONFIG_ESP_SWD_BOOT_PIN, 1);
+        esp_rom_delay_us(CONFIG_ESP_SWD_BOOT_SETTLE_US);
+        ctx->timing.boot_us += swd_elapsed_us(&t);
+    }
+#endif
+
+    int8_t retries = 4;
+    int8_t do_abort = 0;
+    do {
+        ctx->timing.attempts++;
+
+        if (do_abort) {
+            //do an abort on stale target, then reset the device
+            t = esp_timer_get_time();
+            swd_write_dp(DP_ABORT, DAPABORT);
+            swd_nreset_out(ctx, 0);
+            esp_rom_delay_us(CONFIG_ESP_SWD_RESET_PULSE_US);
+            swd_nreset_out(ctx, 1);
+            esp_rom_delay_us(CONFIG_ESP_SWD_RESET_RECOVER_US);
+            do_abort = 0;
+            ctx->timing.reset_us += swd_elapsed_us(&t);
+        }
+        swd_init();
+
+        if (ctx->reset_connect == CONNECT_UNDER_RESET) {
+            if (!swd_connect_under_reset(ctx)) {
+                do_abort = 1;
+                continue;
+            }
+
+            ret = 1;
+            break;
+        }
+
+        t = esp_timer_get_time();
+        if (!JTAG2SWD()) {
+            ESP_LOGE(DAP_TAG, "JTAG2SWD fail");
+            ctx->timing.line_us += swd_elapsed_us(&t);
+            do_abort = 1;
+            continue;
+        }
+        ctx->timing.line_us += swd_elapsed_us(&t);
+
+        if (!swd_power_up_dp()) {
+            do_abort = 1;
+            continue;
+        }
+
+        ret = 1;
+        break;
+
+    } while (--retries > 0);
+
+    ctx->session_valid = ret;
+    ctx->timing.total_us = esp_timer_get_time() - start;
+    return ret;
+}
+
+// Phase breakdown of the last swd_init_debug() on the calling task's context
+void swd_connect_timing(swd_connect_timing_t *timing)
+{
+    SWD_CTX_GUARD();
+
+    *timing = swd_ctx_current()->timing;
+}
+
+uint8_t IRAM_ATTR swd_halt_target()
+{
+    SWD_CTX_GUARD();
+
+    if (!swd_write_dhcsr(DBGKEY | C_DEBUGEN | C_HALT)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+void swd_trigger_nrst()
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+
+    if (ctx == &default_ctx) {
+        gpio_set_level(CONFIG_ESP_SWD_BOOT_PIN, 0);
+        vTaskDelay(pdMS_TO_TICKS(20));
+    }
+    swd_nreset_out(ctx, 0);
+    vTaskDelay(pdMS_TO_TICKS(350));
+    swd_nreset_out(ctx, 1);
+    vTaskDelay(pdMS_TO_TICKS(100));
+}
+
+uint8_t swd_flash_syscall_exec_async(const program_syscall_t *sys_call, uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+    DEBUG_STATE state = {{0}, 0};
+    swd_reg_cache_invalidate(ctx);
+    // Call flash algorithm function on target
+    state.r[0]     = arg1;                   // R0: Argument 1
+    state.r[1]     = arg2;                   // R1: Argument 2
+    state.r[2]     = arg3;                   // R2: Argument 3
+    state.r[3]     = arg4;                   // R3: Argument 4
+    state.r[9]     = sys_call->static_base;    // SB: Static Base
+    state.r[13]    = sys_call->stack_pointer;  // SP: Stack Pointer
+    state.r[14]    = sys_call->breakpoint;     // LR: Exit Point
+    state.r[15]    = entry;                        // PC: Entry Point
+    state.xpsr     = 0x01000000;          // xPSR: T = 1, ISR = 0
+
+    // Verify functions return a pointer to the byte following the buffer if successful
+    ctx->syscall_expected = arg1 + arg2;
+
+    if (!swd_write_debug_state(&state)) {
+        ESP_LOGE(DAP_TAG, "Failed to set state");
+        return 0;
+    }
+
+    return 1;
+}
+
+uint8_t swd_flash_syscall_wait_result(flash_algo_return_t return_type, uint32_t *ret_out)
+{
+    SWD_CTX_GUARD();
+
+    if (!swd_wait_until_halted()) {
+        ESP_LOGE(DAP_TAG, "Failed to halt");
+        return 0;
+    }
+
+    return swd_flash_syscall_result(return_type, ret_out);
+}
+
+// Collect the result of a syscall started by swd_flash_syscall_exec_async() once the core halted
+uint8_t swd_flash_syscall_result(flash_algo_return_t return_type, uint32_t *ret_out)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint32_t r0;
+
+    if (!swd_read_core_register(0, &r0)) {
+        ESP_LOGE(DAP_TAG, "Failed to read register");
+        return 0;
+    }
+
+    //remove the C_MASKINTS
+    if (!swd_write_dhcsr(DBGKEY | C_DEBUGEN | C_HALT)) {
+        ESP_LOGE(DAP_TAG, "Failed to halt again");
+        return 0;
+    }
+
+    if (return_type == FLASHALGO_RETURN_POINTER) {
+        if (ret_out != NULL) {
+            *ret_out = r0;
+        }
+        if (r0 != ctx->syscall_expected) {
+            return 0;
+        }
+    } else if (return_type == FLASHALGO_RETURN_VALUE) {
+        if (ret_out != NULL) {
+            *ret_out = r0;
+        }
+    } else {
+        if (r0 != 0) {
+            uint32_t r1 = 0;
+            swd_read_core_register(1, &r1);
+
+            uint32_t r2 = 0;
+            swd_read_core_register(2, &r2);
+
+            uint32_t r15 = 0;
+            swd_read_core_register(15, &r15);
+            ESP_LOGW(DAP_TAG, "R1 = 0x%lx, R2 = 0x%lx, R15 (PC) = 0x%lx", r1, r2, r15);
+
+            return 0;
+        }
+    }
+
+    // Back at the breakpoint, the next call only needs the registers that change
+    ctx->last_state_valid = 1;
+    return 1;
+}
+
+// Non-blocking S_HALT check
+uint8_t swd_is_halted(uint8_t *halted)
+{
+    SWD_CTX_GUARD();
+    uint32_t val;
+
+    if (!swd_read_dhcsr(&val)) {
+        return 0;
+    }
+
+    *halted = (val & S_HALT) ? 1 : 0;
+    return 1;
+}
+
+// Set DEMCR.TRCENA, which powers the DWT and ITM
+uint8_t swd_trace_enable(void)
+{
+    SWD_CTX_GUARD();
+    uint32_t demcr;
+
+    if (!swd_dbg_select() || !swd_dbg_read(DBG_EMCR_OFS, &demcr)) {
+        return 0;
+    }
+
+    if (demcr & TRCENA) {
+        return 1;
+    }
+
+    return swd_dbg_write(DBG_EMCR_OFS, demcr | TRCENA);
+}
+
+// Wait until esp_timer reaches t, sleeping whole ticks and spinning less than one
+static void IRAM_ATTR swd_wait_until(int64_t t)
+{
+    int64_t left;
+
+    while ((left = t - esp_timer_get_time()) >= portTICK_PERIOD_MS * 1000) {
+        vTaskDelay(left / (portTICK_PERIOD_MS * 1000));
+    }
+
+    while (esp_timer_get_time() < t) {
+    }
+}
+
+// Posted reads of addr through its banked data register, with the context locked
+// for the whole run. Only periods below one tick get here, so the waits just spin.
+static uint8_t IRAM_ATTR swd_read_word_run(uint32_t addr, uint32_t *val, uint32_t count, uint32_t period_us)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+    AP_STATE *ap = swd_get_ap_state(0);
+    uint32_t tar = addr & ~0xFUL;
+    uint32_t req = SWD_REG_AP | SWD_REG_R | SWD_REG_ADR(addr);
+    int64_t next;
+
+    if (count == 0 || (addr & 0x3)) {
+        return 0;
+    }
+
+    if (ap == NULL || ap->csw != (CSW_VALUE | CSW_SIZE32) || !ap->tar_valid || ap->tar != tar) {
+        if (!swd_write_ap(AP_CSW, CSW_VALUE | CSW_SIZE32)) {
+            return 0;
+        }
+
+        if (!swd_write_tar(tar)) {
+            return 0;
+        }
+    }
+
+    if (!swd_write_dp(DP_SELECT, swd_get_apsel(0) | AP_BD0)) {
+        return 0;
+    }
+
+    // Posted reads: each transfer returns the value sampled by the previous one
+    next = esp_timer_get_time();
+    if (swd_transfer(ctx, req, NULL) != DAP_TRANSFER_OK) {
+        return 0;
+    }
+
+    for (uint32_t i = 1; i < count; i++) {
+        if (period_us != 0) {
+            next += period_us;
+            swd_wait_until(next);
+        }
+
+        if (swd_transfer(ctx, req, &val[i - 1]) != DAP_TRANSFER_OK) {
+            return 0;
+        }
+    }
+
+    return swd_transfer(ctx, SWD_REG_DP | SWD_REG_R | SWD_REG_ADR(DP_RDBUFF), &val[count - 1]) == DAP_TRANSFER_OK;
+}
+
+// Read the word at addr count times. TAR stays put, so every read after the first
+// is a single AP transfer. A non-zero period_us spaces the reads on esp_timer
+// instead of running back to back. From one tick on the task sleeps between reads
+// and every read is locked on its own, so other tasks on the context get in between.
+uint8_t IRAM_ATTR swd_read_word_repeat(uint32_t addr, uint32_t *val, uint32_t count, uint32_t period_us)
+{
+    int64_t next;
+
+    if (period_us < portTICK_PERIOD_MS * 1000) {
+        return swd_read_word_run(addr, val, count, period_us);
+    }
+
+    next = esp_timer_get_time();
+    for (uint32_t i = 0; i < count; i++) {
+        if (i > 0) {
+            next += period_us;
+            swd_wait_until(next);
+        }
+
+        if (!swd_read_word_run(addr, &val[i], 1, 0)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Scan the AP IDRs of every cached APSEL. ADIv5 doesn't require APs to be numbered
+// contiguously, so empty or faulting slots are recorded and the scan goes on. Fails
+// only when APSEL 0 faults or no AP answers at all.
+uint8_t swd_ap_enumerate(void)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint8_t prev_sel = ctx->dap_state.ap_sel;
+    uint32_t idr = 0;
+    uint8_t ret = 1;
+
+    ctx->dap_state.ap_count = 0;
+    ctx->dap_state.ap_present = 0;
+
+    for (uint32_t i = 0; i < CONFIG_ESP_SWD_MAX_AP; i++) {
+        ctx->dap_state.ap_sel = i;
+        if (!swd_read_ap(AP_IDR, &idr)) {
+            swd_clear_errors();
+            idr = 0;
+            if (i == 0) {
+                ret = 0;
+            }
+        }
+
+        ctx->dap_state.ap[i].idr = idr;
+        if (idr == 0) {
+            continue;
+        }
+
+        ESP_LOGD(DAP_TAG, "AP%lu IDR 0x%08lx", i, idr);
+        ctx->dap_state.ap_present |= 1UL << i;
+        ctx->dap_state.ap_count++;
+    }
+
+    ctx->dap_state.ap_sel = prev_sel;
+    return ret && ctx->dap_state.ap_count > 0;
+}
+
+// Number of APs found, their APSELs aren't necessarily 0..count-1, see swd_ap_present()
+uint8_t swd_ap_count(void)
+{
+    SWD_CTX_GUARD();
+
+    return swd_ctx_current()->dap_state.ap_count;
+}
+
+// Bit n is set when APSEL n answered with a non-zero IDR
+uint32_t swd_ap_present(void)
+{
+    SWD_CTX_GUARD();
+
+    return swd_ctx_current()->dap_state.ap_present;
+}
+
+uint8_t swd_ap_get_idr(uint8_t ap, uint32_t *idr)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+
+    if (ap >= CONFIG_ESP_SWD_MAX_AP || !(ctx->dap_state.ap_present & (1UL << ap))) {
+        return 0;
+    }
+
+    *idr = ctx->dap_state.ap[ap].idr;
+    return 1;
+}
+
+uint8_t swd_ap_get_selected(void)
+{
+    SWD_CTX_GUARD();
+
+    return swd_ctx_current()->dap_state.ap_sel;
+}
+
+// Select the AP used by the swd_*_word/byte/memory calls
+uint8_t swd_ap_select(uint8_t ap)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+
+    if (ap >= CONFIG_ESP_SWD_MAX_AP) {
+        return 0;
+    }
+
+    ctx->dap_state.ap_sel = ap;
+    return 1;
+}
+
+// Auto-increment page size of an AP, 1KB is the minimum guaranteed by ADIv5
+uint8_t swd_ap_set_autoinc_size(uint8_t ap, uint32_t size)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+
+    if (ap >= CONFIG_ESP_SWD_MAX_AP || size < 4 || (size & (size - 1)) != 0) {
+        return 0;
+    }
+
+    ctx->dap_state.ap[ap].autoinc_size = size;
+    ctx->dap_state.ap[ap].tar_valid = 0;
+    return 1;
+}
+
+uint8_t swd_read_memory_ap(uint8_t ap, uint32_t address, uint8_t *data, uint32_t size)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint8_t prev_sel = ctx->dap_state.ap_sel;
+    uint8_t ret;
+
+    if (!swd_ap_select(ap)) {
+        return 0;
+    }
+
+    ret = swd_read_memory(address, data, size);
+    ctx->dap_state.ap_sel = prev_sel;
+    return ret;
+}
+
+uint8_t swd_write_memory_ap(uint8_t ap, uint32_t address, uint8_t *data, uint32_t size)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint8_t prev_sel = ctx->dap_state.ap_sel;
+    uint8_t ret;
+
+    if (!swd_ap_select(ap)) {
+        return 0;
+    }
+
+    ret = swd_write_memory(address, data, size);
+    ctx->dap_state.ap_sel = prev_sel;
+    return ret;
+}
+
+uint8_t swd_read_word_ap(uint8_t ap, uint32_t addr, uint32_t *val)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint8_t prev_sel = ctx->dap_state.ap_sel;
+    uint8_t ret;
+
+    if (!swd_ap_select(ap)) {
+        return 0;
+    }
+
+    ret = swd_read_word(addr, val);
+    ctx->dap_state.ap_sel = prev_sel;
+    return ret;
+}
+
+uint8_t swd_write_word_ap(uint8_t ap, uint32_t addr, uint32_t val)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+    uint8_t prev_sel = ctx->dap_state.ap_sel;
+    uint8_t ret;
+
+    if (!swd_ap_select(ap)) {
+        return 0;
+    }
+
+    ret = swd_write_word(addr, val);
+    ctx->dap_state.ap_sel = prev_sel;
+    return ret;
+}
+
+// Base of the System Control Space used for the NVIC and core debug registers
+void swd_set_scs_base(uint32_t base)
+{
+    SWD_CTX_GUARD();
+
+    swd_ctx_current()->scs_addr = base;
+}
+
+uint32_t swd_get_scs_base(void)
+{
+    SWD_CTX_GUARD();
+
+    return swd_ctx_current()->scs_addr;
+}
+
+// Wake up a multi-drop bus and bring up the DP of every target on it.
+// targetsel holds the TARGETSEL value (TINSTANCE | TPARTNO | TDESIGNER | 1) of each target.
+uint8_t swd_multidrop_init(const uint32_t *targetsel, uint8_t count)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+
+    if (count == 0 || count > CONFIG_ESP_SWD_MAX_TARGETS) {
+        return 0;
+    }
+
+    ctx->multidrop_count = 0;
+    ctx->session_valid = 0;
+    swd_init();
+
+    if (!swd_to_dormant() || !swd_dormant_wakeup()) {
+        return 0;
+    }
+
+    for (uint8_t i = 0; i < count; i++) {
+        ctx->dap_state.select = 0xffffffff;
+        ctx->dap_state.ap_sel = 0;
+        swd_reset_ap_state(ctx);
+
+        if (!swd_write_targetsel(targetsel[i])) {
+            ESP_LOGE(DAP_TAG, "Target 0x%08lx not responding", targetsel[i]);
+            return 0;
+        }
+
+        if (!swd_power_up_dp()) {
+            ESP_LOGE(DAP_TAG, "Target 0x%08lx power up fail", targetsel[i]);
+            return 0;
+        }
+
+        ctx->multidrop_targets[i].targetsel = targetsel[i];
+        ctx->multidrop_targets[i].state = ctx->dap_state;
+        ctx->multidrop_targets[i].scs_addr = ctx->scs_addr;
+        ctx->multidrop_targets[i].rom = ctx->rom;
+    }
+
+    ctx->multidrop_count = count;
+    ctx->multidrop_current = count - 1;
+    return 1;
+}
+
+// Switch to another target on the bus, keeping the cached DP/AP, SCS and ROM table state of each one
+uint8_t swd_multidrop_select(uint8_t index)
+{
+    SWD_CTX_GUARD();
+    swd_ctx_t *ctx = swd_ctx_current();
+
+    if (index >= ctx->multidrop_count) {
+        return 0;
+    }
+
+    if (index == ctx->multidrop_current) {
+        return 1;
+    }
+
+    ctx->multidrop_targets[ctx->multidrop_current].state = ctx->dap_state;
+    ctx->multidrop_targets[ctx->multidrop_current].scs_addr = ctx->scs_addr;
+    ctx->multidrop_targets[ctx->multidrop_current].rom = ctx->rom;
+
+    if (!swd_write_targetsel(ctx->multidrop_targets[index].targetsel)) {
+        ESP_LOGE(DAP_TAG, "TARGETSEL 0x%08lx fail", ctx->multidrop_targets[index].targetsel);
+        return 0;
+    }
+
+    ctx->multidrop_current = index;
+    ctx->dap_state = ctx->multidrop_targets[index].state;
+    ctx->scs_addr = ctx->multidrop_targets[index].scs_addr;
+    ctx->rom = ctx->multidrop_targets[index].rom;
+    swd_reg_cache_invalidate(ctx);
+    ctx->last_state_valid = 0;
+    // The line reset leaves SELECT unknown, AP registers keep their values
+    ctx->dap_state.select = 0xffffffff;
+    return 1;
+}
+
+uint8_t swd_multidrop_count(void)
+{
+    SWD_CTX_GUARD();
+
+    return swd_ctx_current()->multidrop_count;
+}
+
+// Create a context for a target on its own pins. All pins must be GPIO0-31.
+swd_ctx_t *swd_ctx_create(const swd_ctx_config_t *cfg)
+{
+    swd_ctx_t *ctx;
+
+    if (cfg->swclk_pin >= 32 || cfg->swdio_pin >= 32 || cfg->nrst_pin >= 32 || cfg->swclk_pin == cfg->swdio_pin) {
+        ESP_LOGE(DAP_TAG, "Invalid context pins");
+        return NULL;
+    }
+
+    ctx = calloc(1, sizeof(swd_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ctx->swclk_pin = cfg->swclk_pin;
+    ctx->swdio_pin = cfg->swdio_pin;
+    ctx->nrst_pin = cfg->nrst_pin;
+    ctx->clock_hz = cfg->clock_hz;
+    ctx->reset_connect = CONNECT_NORMAL;
+    ctx->soft_reset = SYSRESETREQ;
+    ctx->halt_timeout_us = CONFIG_ESP_SWD_HALT_TIMEOUT_US;
+    ctx->scs_addr = SCS_DEFAULT_Addr;
+    ctx->dap_state.select = 0xffffffff;
+    swd_reset_ap_state(ctx);
+    ctx->lock = xSemaphoreCreateRecursiveMutexStatic(&ctx->lock_buf);
+
+    DAP_Setup_Data(&ctx->own_data);
+    if (ctx->clock_hz != 0) {
+        DAP_Set_Clock(&ctx->own_data, ctx->clock_hz);
+    }
+
+    ctx->own_port.swclk = 1UL << cfg->swclk_pin;
+    ctx->own_port.swdio = 1UL << cfg->swdio_pin;
+    ctx->own_port.nreset = (cfg->nrst_pin >= 0) ? (1UL << cfg->nrst_pin) : 0;
+    ctx->own_port.swdio_pin = cfg->swdio_pin;
+    ctx->own_port.data = &ctx->own_data;
+    ctx->port = &ctx->own_port;
+
+    return ctx;
+}
+
+// Fails while an async transfer, monitored call, RTT session or sampler still uses ctx.
+// Other tasks that bound ctx themselves must have switched away from it.
+uint8_t swd_ctx_destroy(swd_ctx_t *ctx)
+{
+    uint32_t users;
+
+    if (ctx == NULL || ctx == &default_ctx) {
+        return 0;
+    }
+
+    // Wait for a call in progress on another task to finish
+    swd_ctx_lock(ctx);
+    portENTER_CRITICAL(&ctx_mux);
+    users = ctx->users;
+    portEXIT_CRITICAL(&ctx_mux);
+    swd_ctx_unlock(ctx);
+
+    if (users != 0) {
+        ESP_LOGE(DAP_TAG, "Context still used by %lu services", users);
+        return 0;
+    }
+
+    if (bound_ctx == ctx) {
+        bound_ctx = NULL;
+    }
+
+#if CONFIG_ESP_SWD_PSRAM_STAGING
+    swd_stage_free(&ctx->stage);
+#endif
+    vSemaphoreDelete(ctx->lock);
+    free(ctx);
+    return 1;
+}
+
+// Context using the DAP_config.h pins and DAP_Data, used by tasks that never bound one
+swd_ctx_t *swd_ctx_default(void)
+{
+    return &default_ctx;
+}
+
+// Make every swd_* call of the calling task use ctx, NULL goes back to the default
+// context. Tasks sharing a context take turns per call, see swd_ctx_lock(). Returns the previous one.
+swd_ctx_t *swd_ctx_bind(swd_ctx_t *ctx)
+{
+    swd_ctx_t *prev = swd_ctx_current();
+    bound_ctx = (ctx == &default_ctx) ? NULL : ctx;
+    return prev;
+}
+
+uint8_t swd_ctx_set_clock(swd_ctx_t *ctx, uint32_t clock_hz)
+{
+    if (clock_hz == 0) {
+        return 0;
+    }
+
+    swd_ctx_lock(ctx);
+    ctx->clock_hz = clock_hz;
+    DAP_Set_Clock(ctx->port->data, clock_hz);
+    swd_ctx_unlock(ctx);
+    return 1;
+}
+
+// Make the transfers of a context fail until the flag is cleared again, safe from any task
+void swd_ctx_set_abort(swd_ctx_t *ctx, uint8_t abort)
+{
+    ctx->abort = abort;
+}
+
+// Drop all cached core registers, for when the target may have changed them behind our back
+void swd_reg_cache_flush(void)
+{
+    SWD_CTX_GUARD();
+
+    swd_reg_cache_invalidate(swd_ctx_current());
+    swd_ctx_current()->last_state_valid = 0;
+}
+
+void swd_reg_cache_stats(uint32_t *hits, uint32_t *misses)
+{
+    SWD_CTX_GUARD();
+    REG_CACHE *cache = &swd_ctx_current()->reg_cache;
+
+    if (hits != NULL) {
+        *hits = cache->hits;
+    }
+    if (misses != NULL) {
+        *misses = cache->misses;
+    }
+}
+
+void swd_reg_cache_reset_stats(void)
+{
+    SWD_CTX_GUARD();
+
+    swd_ctx_current()->reg_cache.hits = 0;
+    swd_ctx_current()->reg_cache.misses = 0;
+}
+
+swd_rom_state_t *swd_ctx_rom_state(void)
+{
+    return &swd_ctx_current()->rom;
+}
@@ -29,11 +29,47 @@
 extern "C" {
 #endif
 
+// Halt polling: back-to-back DHCSR reads for SPIN_US, then reads DELAY_STEP_US apart
+// until DELAY_US, then one read per tick. TIMEOUT_US of 0 waits forever.
+#ifndef CONFIG_ESP_SWD_HALT_SPIN_US
+#define CONFIG_ESP_SWD_HALT_SPIN_US 200
+#endif
+
+#ifndef CONFIG_ESP_SWD_HALT_DELAY_US
+#define CONFIG_ESP_SWD_HALT_DELAY_US 5000
+#endif
+
+#ifndef CONFIG_ESP_SWD_HALT_DELAY_STEP_US
+#define CONFIG_ESP_SWD_HALT_DELAY_STEP_US 50
+#endif
+
+#ifndef CONFIG_ESP_SWD_HALT_TIMEOUT_US
+#define CONFIG_ESP_SWD_HALT_TIMEOUT_US 30000000
+#endif
+
+#ifndef CONFIG_ESP_SWD_RESET_HALT_TIMEOUT_US
+#define CONFIG_ESP_SWD_RESET_HALT_TIMEOUT_US 100000
+#endif
+
 typedef enum {
     CONNECT_NORMAL,
     CONNECT_UNDER_RESET,
 } SWD_CONNECT_TYPE;
 
+// Time spent in each phase of swd_init_debug(), summed over all attempts
+typedef struct {
+    uint32_t total_us;
+    uint32_t boot_us;       // BOOT pin settle
+    uint32_t reset_us;      // Abort and reset pulse before a retry
+    uint32_t line_us;       // Line reset, JTAG-to-SWD switch and IDCODE read
+    uint32_t power_up_us;   // Error clear and CDBGPWRUPACK/CSYSPWRUPACK handshake
+    uint32_t ap_scan_us;
+    uint32_t romtable_us;
+    uint32_t halt_us;       // Connect under reset: wait for the halt at the reset vector
+    uint8_t attempts;
+    uint8_t resumed;        // Previous session reused, nothing else ran
+} swd_connect_timing_t;
+
 typedef enum {
     FLASHALGO_RETURN_BOOL,
     FLASHALGO_RETURN_POINTER,
@@ -46,9 +82,32 @@ typedef struct __attribute__((__packed__)) {
     uint32_t stack_pointer;
 } program_syscall_t;
 
+// Core registers of a halted target, see swd_read_core_context()
+typedef struct __attribute__((__packed__)) {
+    uint32_t r[16];         // R0-R12, SP, LR, PC
+    uint32_t xpsr;
+    uint32_t msp;
+    uint32_t psp;
+    uint32_t special;       // CONTROL << 24 | FAULTMASK << 16 | BASEPRI << 8 | PRIMASK
+    uint32_t fpscr;
+    uint32_t s[32];         // S0-S31
+    uint8_t fpu;            // fpscr and s[] are valid
+} swd_core_context_t;
+
+// Pins, clock and cached DP/AP state of one target
+typedef struct swd_ctx swd_ctx_t;
+
+typedef struct {
+    uint8_t swclk_pin;
+    uint8_t swdio_pin;
+    int8_t nrst_pin;        // -1 if not connected
+    uint32_t clock_hz;      // 0 for the default SWJ clock
+} swd_ctx_config_t;
+
 uint8_t swd_init(void);
 uint8_t swd_off(void);
 uint8_t swd_init_debug(void);
+void swd_connect_timing(swd_connect_timing_t *timing);
 uint8_t swd_clear_errors(void);
 uint8_t swd_read_dp(uint8_t adr, uint32_t *val);
 uint8_t swd_write_dp(uint8_t adr, uint32_t val);
@@ -62,18 +121,56 @@ uint8_t swd_read_memory(uint32_t address, uint8_t *data, uint32_t size);
 uint8_t swd_write_memory(uint32_t address, uint8_t *data, uint32_t size);
 uint8_t swd_read_core_register(uint32_t n, uint32_t *val);
 uint8_t swd_write_core_register(uint32_t n, uint32_t val);
+uint8_t swd_read_core_context(swd_core_context_t *context);
+uint8_t swd_write_core_context(const swd_core_context_t *context);
+void swd_reg_cache_flush(void);
+void swd_reg_cache_stats(uint32_t *hits, uint32_t *misses);
+void swd_reg_cache_reset_stats(void);
 uint8_t swd_flash_syscall_exec(const program_syscall_t *sys_call, uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, flash_algo_return_t return_type, uint32_t *ret_out);
 uint8_t swd_flash_syscall_exec_async(const program_syscall_t *sys_call, uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4);
 uint8_t swd_flash_syscall_wait_result(flash_algo_return_t return_type, uint32_t *ret_out);
+uint8_t swd_flash_syscall_result(flash_algo_return_t return_type, uint32_t *ret_out);
+uint8_t swd_is_halted(uint8_t *halted);
+uint8_t swd_trace_enable(void);
+uint8_t swd_read_word_repeat(uint32_t addr, uint32_t *val, uint32_t count, uint32_t period_us);
 uint8_t swd_transfer_retry(uint32_t req, uint32_t *data);
 uint8_t swd_halt_target();
 uint8_t swd_wait_until_halted(void);
 void int2array(uint8_t *res, uint32_t data, uint8_t len);
 void swd_set_reset_connect(SWD_CONNECT_TYPE type);
 void swd_set_soft_reset(uint32_t soft_reset_type);
+void swd_set_halt_timeout(uint32_t timeout_us);
+uint32_t swd_get_halt_timeout(void);
 uint8_t swd_read_idcode(uint32_t *id);
 void swd_trigger_nrst();
 uint8_t JTAG2SWD(void);
+uint8_t swd_ap_enumerate(void);
+uint8_t swd_ap_count(void);
+uint32_t swd_ap_present(void);
+uint8_t swd_ap_get_idr(uint8_t ap, uint32_t *idr);
+uint8_t swd_ap_select(uint8_t ap);
+uint8_t swd_ap_get_selected(void);
+uint8_t swd_ap_set_autoinc_size(uint8_t ap, uint32_t size);
+uint8_t swd_read_memory_ap(uint8_t ap, uint32_t address, uint8_t *data, uint32_t size);
+uint8_t swd_write_memory_ap(uint8_t ap, uint32_t address, uint8_t *data, uint32_t size);
+uint8_t swd_read_word_ap(uint8_t ap, uint32_t addr, uint32_t *val);
+uint8_t swd_write_word_ap(uint8_t ap, uint32_t addr, uint32_t val);
+void swd_set_scs_base(uint32_t base);
+uint32_t swd_get_scs_base(void);
+uint8_t swd_multidrop_init(const uint32_t *targetsel, uint8_t count);
+uint8_t swd_multidrop_select(uint8_t index);
+uint8_t swd_multidrop_count(void);
+swd_ctx_t *swd_ctx_create(const swd_ctx_config_t *cfg);
+uint8_t swd_ctx_destroy(swd_ctx_t *ctx);
+swd_ctx_t *swd_ctx_default(void);
+swd_ctx_t *swd_ctx_bind(swd_ctx_t *ctx);
+swd_ctx_t *swd_ctx_current(void);
+uint8_t swd_ctx_set_clock(swd_ctx_t *ctx, uint32_t clock_hz);
+void swd_ctx_set_abort(swd_ctx_t *ctx, uint8_t abort);
+void swd_ctx_lock(swd_ctx_t *ctx);
+void swd_ctx_unlock(swd_ctx_t *ctx);
+void swd_ctx_acquire(swd_ctx_t *ctx);
+void swd_ctx_release(swd_ctx_t *ctx);
 
 #ifdef __cplusplus
 }
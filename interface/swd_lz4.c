@@ -0,0 +1,657 @@
+/**
+ * @file    swd_lz4.c
+ * @brief   Implementation of swd_lz4.h
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <esp_heap_caps.h>
+
+#include "swd_lz4.h"
+#include "swd_host.h"
+
+#include <esp_log.h>
+#define LZ4_TAG "swd_lz4"
+
+#ifndef CONFIG_ESP_SWD_LZ4_MAX_BLOCK
+#define CONFIG_ESP_SWD_LZ4_MAX_BLOCK 4096
+#endif
+
+#ifndef CONFIG_ESP_SWD_LZ4_TASK_STACK
+#define CONFIG_ESP_SWD_LZ4_TASK_STACK 2048
+#endif
+
+#ifndef CONFIG_ESP_SWD_LZ4_TASK_PRIO
+#define CONFIG_ESP_SWD_LZ4_TASK_PRIO 9
+#endif
+
+#ifndef CONFIG_ESP_SWD_LZ4_TASK_CORE
+#define CONFIG_ESP_SWD_LZ4_TASK_CORE -1
+#endif
+
+#define LZ4_MAGIC           0x184D2204
+#define LZ4_BLOCK_STORED    (1UL << 31)
+
+// Frame descriptor FLG byte
+#define LZ4_FLG_VERSION     0xC0
+#define LZ4_FLG_VERSION_01  0x40
+#define LZ4_FLG_INDEPENDENT 0x20
+#define LZ4_FLG_BLOCK_CRC   0x10
+#define LZ4_FLG_SIZE        0x08
+#define LZ4_FLG_CONTENT_CRC 0x04
+#define LZ4_FLG_RESERVED    0x02
+#define LZ4_FLG_DICT_ID     0x01
+// BD byte, bits 6:4 select a 64 KiB to 4 MiB block maximum
+#define LZ4_BD_RESERVED     0x8F
+#define LZ4_BD_MAX(bd)      (1UL << (8 + 2 * (((bd) >> 4) & 7)))
+#define LZ4_BD_MIN_CODE     4
+
+#define XXH_P1              2654435761U
+#define XXH_P2              2246822519U
+#define XXH_P3              3266489917U
+#define XXH_P4              668265263U
+#define XXH_P5              374761393U
+
+#define LZ4_BUFFERS         2
+#define LZ4_FAILED          -1
+#define LZ4_EXIT            -2
+
+// Streaming xxHash32 with seed 0, used for all frame checksums
+typedef struct {
+    uint32_t v[4];
+    uint32_t total;
+    uint8_t buf[16];
+    uint32_t buf_len;
+} lz4_xxh32_t;
+
+struct swd_lz4_stream {
+    swd_lz4_read_cb_t read;
+    void *arg;
+    uint32_t block_size;        // Decode buffer size, the frame's block maximum capped by Kconfig
+    uint32_t image_size;
+    bool has_size;
+    bool block_crc;
+    bool content_crc;
+    lz4_xxh32_t hash;
+    uint32_t decoded;           // Bytes produced by the decoder task
+    uint32_t consumed;          // Bytes handed out by swd_lz4_fetch()
+    uint8_t *in;
+    uint8_t *out[LZ4_BUFFERS];
+    uint32_t out_len[LZ4_BUFFERS];
+    int8_t cur;                 // Buffer being consumed, -1 for none
+    uint32_t cur_pos;
+    QueueHandle_t free_q;
+    QueueHandle_t full_q;
+    volatile bool stop;
+    bool end;                   // End mark read and checked, set before LZ4_EXIT is sent
+    bool running;
+    bool failed;
+};
+
+static inline uint32_t xxh_rotl(uint32_t x, uint32_t r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+static inline uint32_t xxh_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint32_t xxh_round(uint32_t acc, uint32_t in)
+{
+    return xxh_rotl(acc + in * XXH_P2, 13) * XXH_P1;
+}
+
+static void xxh32_init(lz4_xxh32_t *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->v[0] = XXH_P1 + XXH_P2;
+    h->v[1] = XXH_P2;
+    h->v[3] = -XXH_P1;
+}
+
+static void xxh32_stripe(lz4_xxh32_t *h, const uint8_t *p)
+{
+    for (uint32_t i = 0; i < 4; i++) {
+        h->v[i] = xxh_round(h->v[i], xxh_le32(p + 4 * i));
+    }
+}
+
+static void xxh32_update(lz4_xxh32_t *h, const uint8_t *p, uint32_t len)
+{
+    uint32_t n;
+
+    h->total += len;
+
+    if (h->buf_len > 0) {
+        n = sizeof(h->buf) - h->buf_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(h->buf + h->buf_len, p, n);
+        h->buf_len += n;
+        p += n;
+        len -= n;
+        if (h->buf_len < sizeof(h->buf)) {
+            return;
+        }
+        xxh32_stripe(h, h->buf);
+        h->buf_len = 0;
+    }
+
+    for (; len >= sizeof(h->buf); p += sizeof(h->buf), len -= sizeof(h->buf)) {
+        xxh32_stripe(h, p);
+    }
+
+    memcpy(h->buf, p, len);
+    h->buf_len = len;
+}
+
+static uint32_t xxh32_digest(const lz4_xxh32_t *h)
+{
+    const uint8_t *p = h->buf;
+    uint32_t len = h->buf_len;
+    uint32_t acc;
+
+    if (h->total >= sizeof(h->buf)) {
+        acc = xxh_rotl(h->v[0], 1) + xxh_rotl(h->v[1], 7) + xxh_rotl(h->v[2], 12) + xxh_rotl(h->v[3], 18);
+    } else {
+        acc = XXH_P5;
+    }
+    acc += h->total;
+
+    for (; len >= 4; p += 4, len -= 4) {
+        acc = xxh_rotl(acc + xxh_le32(p) * XXH_P3, 17) * XXH_P4;
+    }
+    for (; len > 0; p++, len--) {
+        acc = xxh_rotl(acc + *p * XXH_P5, 11) * XXH_P1;
+    }
+
+    acc ^= acc >> 15;
+    acc *= XXH_P2;
+    acc ^= acc >> 13;
+    acc *= XXH_P3;
+    acc ^= acc >> 16;
+    return acc;
+}
+
+static uint32_t xxh32(const uint8_t *p, uint32_t len)
+{
+    lz4_xxh32_t h;
+
+    xxh32_init(&h);
+    xxh32_update(&h, p, len);
+    return xxh32_digest(&h);
+}
+
+static uint8_t lz4_get_len(const uint8_t **ip, const uint8_t *iend, uint32_t *len)
+{
+    uint8_t b;
+
+    do {
+        if (*ip >= iend) {
+            return 0;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+
+    return 1;
+}
+
+// Decode one raw LZ4 block, returns the decoded length or -1 on malformed input
+static int32_t lz4_decode_block(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_cap)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + src_len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_cap;
+    uint32_t lit, match, offset;
+    uint8_t token;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        lit = token >> 4;
+        if (lit == 15 && !lz4_get_len(&ip, iend, &lit)) {
+            return -1;
+        }
+
+        if (lit > (uint32_t)(iend - ip) || lit > (uint32_t)(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        // The last sequence only has literals
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        match = token & 0xF;
+        if (match == 15 && !lz4_get_len(&ip, iend, &match)) {
+            return -1;
+        }
+        match += 4;
+
+        if (offset == 0 || offset > (uint32_t)(op - dst) || match > (uint32_t)(oend - op)) {
+            return -1;
+        }
+
+        // Byte copy, the match may overlap the output
+        const uint8_t *m = op - offset;
+        while (match--) {
+            *op++ = *m++;
+        }
+    }
+
+    return op - dst;
+}
+
+static uint8_t lz4_read_u32(swd_lz4_stream_t *s, uint32_t *val)
+{
+    uint8_t b[4];
+
+    if (!s->read(b, sizeof(b), s->arg)) {
+        return 0;
+    }
+
+    *val = xxh_le32(b);
+    return 1;
+}
+
+// End mark, then the optional content checksum
+static uint8_t lz4_decode_end(swd_lz4_stream_t *s)
+{
+    uint32_t crc;
+
+    if (s->has_size && s->decoded != s->image_size) {
+        ESP_LOGE(LZ4_TAG, "Image ends after %lu of %lu bytes", s->decoded, s->image_size);
+        return 0;
+    }
+
+    if (s->content_crc) {
+        if (!lz4_read_u32(s, &crc)) {
+            return 0;
+        }
+        if (crc != xxh32_digest(&s->hash)) {
+            ESP_LOGE(LZ4_TAG, "Content checksum mismatch");
+            return 0;
+        }
+    }
+
+    s->end = true;
+    return 1;
+}
+
+static uint8_t lz4_decode_next(swd_lz4_stream_t *s, int8_t idx)
+{
+    uint32_t hdr, len, crc;
+    uint8_t *raw;
+    int32_t n;
+
+    if (!lz4_read_u32(s, &hdr)) {
+        return 0;
+    }
+
+    if (hdr == 0) {
+        return lz4_decode_end(s);
+    }
+
+    len = hdr & ~LZ4_BLOCK_STORED;
+    if (len > s->block_size) {
+        ESP_LOGE(LZ4_TAG, "Block of %lu bytes at 0x%lx exceeds the %lu byte buffer", len, s->decoded, s->block_size);
+        return 0;
+    }
+
+    // Stored blocks go straight into the output buffer
+    raw = (hdr & LZ4_BLOCK_STORED) ? s->out[idx] : s->in;
+    if (!s->read(raw, len, s->arg)) {
+        return 0;
+    }
+
+    if (s->block_crc) {
+        if (!lz4_read_u32(s, &crc)) {
+            return 0;
+        }
+        if (crc != xxh32(raw, len)) {
+            ESP_LOGE(LZ4_TAG, "Block checksum mismatch at 0x%lx", s->decoded);
+            return 0;
+        }
+    }
+
+    n = (hdr & LZ4_BLOCK_STORED) ? (int32_t)len : lz4_decode_block(s->in, len, s->out[idx], s->block_size);
+    if (n < 0 || (s->has_size && (uint32_t)n > s->image_size - s->decoded)) {
+        ESP_LOGE(LZ4_TAG, "Corrupt block at 0x%lx", s->decoded);
+        return 0;
+    }
+
+    if (s->content_crc) {
+        xxh32_update(&s->hash, s->out[idx], n);
+    }
+
+    s->out_len[idx] = n;
+    s->decoded += n;
+    return 1;
+}
+
+static void lz4_decoder_task(void *arg)
+{
+    swd_lz4_stream_t *s = arg;
+    int8_t idx, msg;
+
+    while (!s->end) {
+        xQueueReceive(s->free_q, &idx, portMAX_DELAY);
+        if (s->stop) {
+            break;
+        }
+
+        if (!lz4_decode_next(s, idx)) {
+            msg = LZ4_FAILED;
+            xQueueSend(s->full_q, &msg, portMAX_DELAY);
+            break;
+        }
+
+        if (!s->end) {
+            xQueueSend(s->full_q, &idx, portMAX_DELAY);
+        }
+    }
+
+    msg = LZ4_EXIT;
+    xQueueSend(s->full_q, &msg, portMAX_DELAY);
+    vTaskDelete(NULL);
+}
+
+// Internal RAM when it has room, the 64 KiB blocks of lz4 -B4 often only fit in PSRAM
+static void *lz4_alloc(uint32_t size)
+{
+    void *p = heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+
+    return p != NULL ? p : heap_caps_malloc(size, MALLOC_CAP_8BIT);
+}
+
+static void lz4_free(swd_lz4_stream_t *s)
+{
+    if (s->free_q != NULL) {
+        vQueueDelete(s->free_q);
+    }
+    if (s->full_q != NULL) {
+        vQueueDelete(s->full_q);
+    }
+    for (uint32_t i = 0; i < LZ4_BUFFERS; i++) {
+        heap_caps_free(s->out[i]);
+    }
+    heap_caps_free(s->in);
+    heap_caps_free(s);
+}
+
+// Magic and frame descriptor, the header checksum covers the descriptor only
+static uint8_t lz4_read_header(swd_lz4_stream_t *s)
+{
+    uint8_t desc[2 + 8 + 1];
+    uint32_t magic, len = 2;
+    uint8_t flg, bd;
+
+    if (!lz4_read_u32(s, &magic) || !s->read(desc, 2, s->arg)) {
+        return 0;
+    }
+
+    flg = desc[0];
+    bd = desc[1];
+    if (magic != LZ4_MAGIC || (flg & LZ4_FLG_VERSION) != LZ4_FLG_VERSION_01 || (flg & LZ4_FLG_RESERVED)
+            || (bd & LZ4_BD_RESERVED) || ((bd >> 4) & 7) < LZ4_BD_MIN_CODE) {
+        ESP_LOGE(LZ4_TAG, "Not an LZ4 frame");
+        return 0;
+    }
+
+    if (!(flg & LZ4_FLG_INDEPENDENT) || (flg & LZ4_FLG_DICT_ID)) {
+        ESP_LOGE(LZ4_TAG, "Linked blocks and dictionaries are not supported, pack with lz4 -BI");
+        return 0;
+    }
+
+    if (flg & LZ4_FLG_SIZE) {
+        if (!s->read(desc + len, 8, s->arg)) {
+            return 0;
+        }
+        if (xxh_le32(desc + len + 4) != 0) {
+            ESP_LOGE(LZ4_TAG, "Image larger than 4 GiB");
+            return 0;
+        }
+        s->image_size = xxh_le32(desc + len);
+        s->has_size = true;
+        len += 8;
+    }
+
+    if (!s->read(desc + len, 1, s->arg)) {
+        return 0;
+    }
+    if (desc[len] != ((xxh32(desc, len) >> 8) & 0xFF)) {
+        ESP_LOGE(LZ4_TAG, "Frame header checksum mismatch");
+        return 0;
+    }
+
+    s->block_crc = flg & LZ4_FLG_BLOCK_CRC;
+    s->content_crc = flg & LZ4_FLG_CONTENT_CRC;
+    xxh32_init(&s->hash);
+
+    // lz4 -B<bytes> cuts smaller blocks than the 64 KiB it declares, larger ones fail on arrival
+    s->block_size = LZ4_BD_MAX(bd);
+    if (s->block_size > CONFIG_ESP_SWD_LZ4_MAX_BLOCK) {
+        s->block_size = CONFIG_ESP_SWD_LZ4_MAX_BLOCK;
+    }
+
+    return 1;
+}
+
+// Read the frame header and start decoding the first blocks
+swd_lz4_stream_t *swd_lz4_open(swd_lz4_read_cb_t read, void *arg)
+{
+    swd_lz4_stream_t *s;
+    int8_t idx;
+
+    s = heap_caps_calloc(1, sizeof(*s), MALLOC_CAP_INTERNAL);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->read = read;
+    s->arg = arg;
+    s->cur = -1;
+
+    if (!lz4_read_header(s)) {
+        lz4_free(s);
+        return NULL;
+    }
+
+    s->in = lz4_alloc(s->block_size);
+    for (uint32_t i = 0; i < LZ4_BUFFERS; i++) {
+        s->out[i] = lz4_alloc(s->block_size);
+    }
+    s->free_q = xQueueCreate(LZ4_BUFFERS, sizeof(int8_t));
+    s->full_q = xQueueCreate(LZ4_BUFFERS + 1, sizeof(int8_t));
+
+    if (s->in == NULL || s->out[0] == NULL || s->out[1] == NULL || s->free_q == NULL || s->full_q == NULL) {
+        ESP_LOGE(LZ4_TAG, "No memory for %lu byte blocks", s->block_size);
+        lz4_free(s);
+        return NULL;
+    }
+
+    for (idx = 0; idx < LZ4_BUFFERS; idx++) {
+        xQueueSend(s->free_q, &idx, 0);
+    }
+
+    BaseType_t core = CONFIG_ESP_SWD_LZ4_TASK_CORE < 0 ? tskNO_AFFINITY : CONFIG_ESP_SWD_LZ4_TASK_CORE;
+    if (xTaskCreatePinnedToCore(lz4_decoder_task, "swd_lz4", CONFIG_ESP_SWD_LZ4_TASK_STACK, s,
+                                CONFIG_ESP_SWD_LZ4_TASK_PRIO, NULL, core) != pdPASS) {
+        ESP_LOGE(LZ4_TAG, "Failed to create decoder");
+        lz4_free(s);
+        return NULL;
+    }
+
+    s->running = true;
+    return s;
+}
+
+// Content size from the frame header, 0 if the frame was packed without --content-size
+uint32_t swd_lz4_image_size(const swd_lz4_stream_t *stream)
+{
+    return stream->image_size;
+}
+
+// swd_flash_fetch_cb_t over an open stream, the image is handed out strictly in order
+uint32_t swd_lz4_fetch(uint32_t addr, uint8_t *dst, uint32_t len, void *arg)
+{
+    swd_lz4_stream_t *s = arg;
+    uint32_t done = 0, n;
+    int8_t msg;
+
+    while (done < len && s->running && !s->failed) {
+        if (s->cur < 0) {
+            if (s->has_size && s->consumed >= s->image_size) {
+                break;
+            }
+
+            xQueueReceive(s->full_q, &msg, portMAX_DELAY);
+            if (msg == LZ4_EXIT) {
+                s->running = false;
+                break;
+            }
+            if (msg == LZ4_FAILED) {
+                s->failed = true;
+                break;
+            }
+            s->cur = msg;
+            s->cur_pos = 0;
+        }
+
+        n = s->out_len[s->cur] - s->cur_pos;
+        if (n > len - done) {
+            n = len - done;
+        }
+        memcpy(dst + done, s->out[s->cur] + s->cur_pos, n);
+        s->cur_pos += n;
+        s->consumed += n;
+        done += n;
+
+        // Hand the buffer back so the decoder can refill it
+        if (s->cur_pos == s->out_len[s->cur]) {
+            xQueueSend(s->free_q, &s->cur, portMAX_DELAY);
+            s->cur = -1;
+        }
+    }
+
+    return done;
+}
+
+// Wait for the decoder to reach the end mark, the content checksum is only known there
+static uint8_t lz4_finish(swd_lz4_stream_t *s)
+{
+    int8_t msg;
+
+    while (s->running && !s->failed) {
+        xQueueReceive(s->full_q, &msg, portMAX_DELAY);
+        if (msg == LZ4_EXIT) {
+            s->running = false;
+        } else if (msg == LZ4_FAILED) {
+            s->failed = true;
+        } else {
+            // Only empty blocks can follow the last byte
+            xQueueSend(s->free_q, &msg, portMAX_DELAY);
+        }
+    }
+
+    return s->end && !s->failed;
+}
+
+void swd_lz4_close(swd_lz4_stream_t *stream)
+{
+    int8_t msg, idx = 0;
+
+    if (stream == NULL) {
+        return;
+    }
+
+    // Wake the decoder if it waits for a buffer and wait until it's gone
+    stream->stop = true;
+    xQueueSend(stream->free_q, &idx, 0);
+    while (stream->running) {
+        xQueueReceive(stream->full_q, &msg, portMAX_DELAY);
+        if (msg == LZ4_EXIT) {
+            stream->running = false;
+        } else if (msg >= 0) {
+            xQueueSend(stream->free_q, &msg, 0);
+        }
+    }
+
+    lz4_free(stream);
+}
+
+// Expand a compressed image into target memory at address, up to the frame's end mark
+uint8_t swd_lz4_write_memory(uint32_t address, swd_lz4_read_cb_t read, void *arg)
+{
+    swd_lz4_stream_t *s = swd_lz4_open(read, arg);
+    uint8_t ret = 1;
+    int8_t msg;
+
+    if (s == NULL) {
+        return 0;
+    }
+
+    // Blocks are written straight from the decoder buffers
+    while (ret) {
+        xQueueReceive(s->full_q, &msg, portMAX_DELAY);
+        if (msg == LZ4_EXIT) {
+            s->running = false;
+            break;
+        }
+        if (msg == LZ4_FAILED) {
+            ret = 0;
+            break;
+        }
+
+        if (!swd_write_memory(address + s->consumed, s->out[msg], s->out_len[msg])) {
+            ESP_LOGE(LZ4_TAG, "Write failed at 0x%08lx", address + s->consumed);
+            ret = 0;
+        } else {
+            s->consumed += s->out_len[msg];
+        }
+        xQueueSend(s->free_q, &msg, portMAX_DELAY);
+    }
+
+    swd_lz4_close(s);
+    return ret;
+}
+
+// Program a compressed image through the swd_flash.h pipeline
+uint8_t swd_lz4_flash_program(const swd_flash_config_t *cfg, uint32_t addr, swd_lz4_read_cb_t read, void *arg)
+{
+    swd_lz4_stream_t *s = swd_lz4_open(read, arg);
+    uint8_t ret;
+
+    if (s == NULL) {
+        return 0;
+    }
+
+    // The pipeline needs the page count up front
+    if (!s->has_size) {
+        ESP_LOGE(LZ4_TAG, "Frame has no content size, pack with lz4 --content-size");
+        swd_lz4_close(s);
+        return 0;
+    }
+
+    ret = swd_flash_program_stream(cfg, addr, s->image_size, swd_lz4_fetch, s) && lz4_finish(s);
+    swd_lz4_close(s);
+    return ret;
+}
@@ -0,0 +1,41 @@
+/**
+ * @file    swd_lz4.h
+ * @brief   Streaming LZ4 image decompression for memory writes and flash programming
+ *
+ * The compressed image is read through a callback (ESP32 flash, a socket, ...)
+ * and expanded block by block into two internal RAM buffers by a decoder task,
+ * so block N+1 is decompressed while block N goes out over SWD. The decoder can
+ * be pinned to the other core with ESP_SWD_LZ4_TASK_CORE.
+ *
+ * The image is a standard LZ4 frame with independent blocks, as written by
+ *   lz4 -B4 --content-size image.bin image.lz4
+ * Header, block and content checksums are checked when present, linked blocks
+ * (lz4 -BD) and dictionaries are rejected. swd_lz4_flash_program() needs the
+ * content size to size the job, swd_lz4_write_memory() runs to the end mark.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "swd_flash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct swd_lz4_stream swd_lz4_stream_t;
+
+// Read exactly len bytes of the compressed image, returns 1 on success
+typedef uint8_t (*swd_lz4_read_cb_t)(uint8_t *dst, uint32_t len, void *arg);
+
+swd_lz4_stream_t *swd_lz4_open(swd_lz4_read_cb_t read, void *arg);
+// Content size from the frame header, 0 if it has none
+uint32_t swd_lz4_image_size(const swd_lz4_stream_t *stream);
+uint32_t swd_lz4_fetch(uint32_t addr, uint8_t *dst, uint32_t len, void *arg);
+void swd_lz4_close(swd_lz4_stream_t *stream);
+uint8_t swd_lz4_write_memory(uint32_t address, swd_lz4_read_cb_t read, void *arg);
+uint8_t swd_lz4_flash_program(const swd_flash_config_t *cfg, uint32_t addr, swd_lz4_read_cb_t read, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,277 @@
+/**
+ * @file    swd_monitor.c
+ * @brief   Implementation of swd_monitor.h
+ */
+
+#include <stdbool.h>
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+
+#include "swd_monitor.h"
+
+#include <esp_log.h>
+#define MON_TAG "swd_monitor"
+
+#ifndef CONFIG_ESP_SWD_MONITOR_MAX_OPS
+#define CONFIG_ESP_SWD_MONITOR_MAX_OPS 8
+#endif
+
+#ifndef CONFIG_ESP_SWD_MONITOR_TASK_STACK
+#define CONFIG_ESP_SWD_MONITOR_TASK_STACK 3072
+#endif
+
+#ifndef CONFIG_ESP_SWD_MONITOR_TASK_PRIO
+#define CONFIG_ESP_SWD_MONITOR_TASK_PRIO 10
+#endif
+
+// One notification bit per slot
+#if CONFIG_ESP_SWD_MONITOR_MAX_OPS > 32
+#error "CONFIG_ESP_SWD_MONITOR_MAX_OPS must not exceed 32"
+#endif
+
+#if SWD_MONITOR_NOTIFY_INDEX >= configTASK_NOTIFICATION_ARRAY_ENTRIES
+#error "CONFIG_ESP_SWD_MONITOR_NOTIFY_INDEX needs a larger CONFIG_FREERTOS_TASK_NOTIFICATION_ARRAY_ENTRIES"
+#endif
+
+struct swd_monitor_op {
+    swd_ctx_t *ctx;
+    flash_algo_return_t return_type;
+    swd_monitor_cb_t cb;
+    void *cb_arg;
+    TaskHandle_t notify;    // Submitting task, notified when there is no callback
+    int64_t start;
+    uint32_t timeout;       // swd_get_halt_timeout() of the submitting context
+    uint32_t result;
+    volatile swd_monitor_state_t state;
+    bool watched;           // Polled by the monitor task
+    bool in_use;
+    uint8_t slot;
+};
+
+static swd_monitor_op_t op_pool[CONFIG_ESP_SWD_MONITOR_MAX_OPS];
+static portMUX_TYPE pool_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t monitor_task = NULL;
+static esp_timer_handle_t poll_timer = NULL;
+
+static void swd_monitor_finish(swd_monitor_op_t *op, swd_monitor_state_t state)
+{
+    portENTER_CRITICAL(&pool_lock);
+    op->watched = false;
+    op->state = state;
+    portEXIT_CRITICAL(&pool_lock);
+
+    if (op->cb != NULL) {
+        op->cb(op, state, op->result, op->cb_arg);
+    } else {
+        xTaskNotifyIndexed(op->notify, SWD_MONITOR_NOTIFY_INDEX, 1UL << op->slot, eSetBits);
+    }
+}
+
+static bool swd_monitor_check_halted(swd_monitor_op_t *op, int64_t now)
+{
+    uint8_t halted;
+
+    if (!swd_is_halted(&halted)) {
+        ESP_LOGE(MON_TAG, "DHCSR read failed");
+        swd_monitor_finish(op, SWD_MONITOR_FAILED);
+        return false;
+    }
+
+    if (!halted) {
+        if (op->timeout != 0 && now - op->start >= op->timeout) {
+            ESP_LOGE(MON_TAG, "Syscall timeout after %lld us", now - op->start);
+            swd_halt_target();
+            swd_monitor_finish(op, SWD_MONITOR_FAILED);
+            return false;
+        }
+        return true;
+    }
+
+    if (swd_flash_syscall_result(op->return_type, &op->result)) {
+        swd_monitor_finish(op, SWD_MONITOR_DONE);
+    } else {
+        swd_monitor_finish(op, SWD_MONITOR_FAILED);
+    }
+    return false;
+}
+
+// Returns true while the algorithm is still running
+static bool swd_monitor_check(swd_monitor_op_t *op, int64_t now)
+{
+    bool running;
+
+    // The DHCSR read and the result read of a halted call belong together
+    swd_ctx_bind(op->ctx);
+    swd_ctx_lock(op->ctx);
+    running = swd_monitor_check_halted(op, now);
+    swd_ctx_unlock(op->ctx);
+    return running;
+}
+
+static void swd_monitor_worker(void *arg)
+{
+    int64_t now, newest;
+    uint32_t running;
+    bool watched;
+
+    while (true) {
+        running = 0;
+        newest = 0;
+        now = esp_timer_get_time();
+
+        for (uint32_t i = 0; i < CONFIG_ESP_SWD_MONITOR_MAX_OPS; i++) {
+            swd_monitor_op_t *op = &op_pool[i];
+
+            portENTER_CRITICAL(&pool_lock);
+            watched = op->watched;
+            portEXIT_CRITICAL(&pool_lock);
+
+            if (watched && swd_monitor_check(op, now)) {
+                running++;
+                if (op->start > newest) {
+                    newest = op->start;
+                }
+            }
+        }
+
+        // Same back-off as swd_wait_until_halted(), driven by the most recent call, but the
+        // task always blocks: sub-tick polls are woken by the timer instead of spinning
+        if (running == 0) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        } else if (now - newest < CONFIG_ESP_SWD_HALT_DELAY_US) {
+            esp_timer_stop(poll_timer);
+            esp_timer_start_once(poll_timer, CONFIG_ESP_SWD_HALT_DELAY_STEP_US);
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        } else {
+            ulTaskNotifyTake(pdTRUE, 1);
+        }
+    }
+}
+
+static void swd_monitor_timer_cb(void *arg)
+{
+    xTaskNotifyGive(monitor_task);
+}
+
+uint8_t swd_monitor_init(void)
+{
+    esp_timer_create_args_t args = {
+        .callback = swd_monitor_timer_cb,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "swd_monitor",
+    };
+
+    if (monitor_task != NULL) {
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < CONFIG_ESP_SWD_MONITOR_MAX_OPS; i++) {
+        op_pool[i].slot = i;
+        op_pool[i].in_use = false;
+        op_pool[i].watched = false;
+    }
+
+    if (poll_timer == NULL && esp_timer_create(&args, &poll_timer) != ESP_OK) {
+        ESP_LOGE(MON_TAG, "Failed to create poll timer");
+        return 0;
+    }
+
+    if (xTaskCreate(swd_monitor_worker, "swd_monitor", CONFIG_ESP_SWD_MONITOR_TASK_STACK, NULL,
+                    CONFIG_ESP_SWD_MONITOR_TASK_PRIO, &monitor_task) != pdPASS) {
+        ESP_LOGE(MON_TAG, "Failed to create monitor task");
+        monitor_task = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+// Start a flash algorithm call on the calling task's context and hand it to the monitor
+swd_monitor_op_t *swd_monitor_exec(const program_syscall_t *sys_call, uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4,
+                                   flash_algo_return_t return_type, swd_monitor_cb_t cb, void *cb_arg)
+{
+    swd_monitor_op_t *op = NULL;
+
+    if (monitor_task == NULL && !swd_monitor_init()) {
+        return NULL;
+    }
+
+    portENTER_CRITICAL(&pool_lock);
+    for (uint32_t i = 0; i < CONFIG_ESP_SWD_MONITOR_MAX_OPS; i++) {
+        if (!op_pool[i].in_use) {
+            op = &op_pool[i];
+            op->in_use = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&pool_lock);
+
+    if (op == NULL) {
+        ESP_LOGE(MON_TAG, "No free operation slot");
+        return NULL;
+    }
+
+    op->ctx = swd_ctx_current();
+    swd_ctx_acquire(op->ctx);
+    op->return_type = return_type;
+    op->cb = cb;
+    op->cb_arg = cb_arg;
+    op->notify = xTaskGetCurrentTaskHandle();
+    op->timeout = swd_get_halt_timeout();
+    op->result = 0;
+    op->state = SWD_MONITOR_RUNNING;
+
+    if (!swd_flash_syscall_exec_async(sys_call, entry, arg1, arg2, arg3, arg4)) {
+        swd_ctx_release(op->ctx);
+        portENTER_CRITICAL(&pool_lock);
+        op->in_use = false;
+        portEXIT_CRITICAL(&pool_lock);
+        return NULL;
+    }
+
+    op->start = esp_timer_get_time();
+
+    portENTER_CRITICAL(&pool_lock);
+    op->watched = true;
+    portEXIT_CRITICAL(&pool_lock);
+
+    xTaskNotifyGive(monitor_task);
+    return op;
+}
+
+swd_monitor_state_t swd_monitor_poll(const swd_monitor_op_t *op)
+{
+    return op->state;
+}
+
+// R0 of a finished call, the verify address for FLASHALGO_RETURN_POINTER
+uint32_t swd_monitor_result(const swd_monitor_op_t *op)
+{
+    return op->result;
+}
+
+// Notification bit set on the submitting task when the call has no callback
+uint32_t swd_monitor_bit(const swd_monitor_op_t *op)
+{
+    return 1UL << op->slot;
+}
+
+// The call must have finished before the handle is released
+void swd_monitor_release(swd_monitor_op_t *op)
+{
+    if (op == NULL) {
+        return;
+    }
+
+    if (op->state == SWD_MONITOR_RUNNING) {
+        ESP_LOGE(MON_TAG, "Can't release a running call");
+        return;
+    }
+
+    swd_ctx_release(op->ctx);
+    portENTER_CRITICAL(&pool_lock);
+    op->in_use = false;
+    portEXIT_CRITICAL(&pool_lock);
+}
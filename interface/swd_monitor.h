@@ -0,0 +1,57 @@
+/**
+ * @file    swd_monitor.h
+ * @brief   Halt monitor completing flash algorithm calls on several targets
+ *
+ * swd_monitor_exec() starts a flash algorithm function on the target of the
+ * calling task's context and returns at once. A single monitor task polls the
+ * DHCSR of every outstanding call on one schedule and, once a core halted,
+ * collects the result with swd_flash_syscall_result(). Completion is reported
+ * through the callback (called from the monitor task) or, without one, as a
+ * task notification to the submitting task with the bit of swd_monitor_bit()
+ * set on index SWD_MONITOR_NOTIFY_INDEX, so one task can wait for several
+ * targets with xTaskNotifyWaitIndexed(). The index defaults to 0, which works
+ * with the default single notification entry; a separate index keeps the bits
+ * apart from other notifications of the submitting task.
+ *
+ * The context of an outstanding call belongs to the monitor task until the call
+ * finished; the submitting task must not issue other swd_* calls on it.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include "swd_host.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef CONFIG_ESP_SWD_MONITOR_NOTIFY_INDEX
+#define CONFIG_ESP_SWD_MONITOR_NOTIFY_INDEX 0
+#endif
+
+#define SWD_MONITOR_NOTIFY_INDEX CONFIG_ESP_SWD_MONITOR_NOTIFY_INDEX
+
+typedef enum {
+    SWD_MONITOR_RUNNING,    // Algorithm running on the target
+    SWD_MONITOR_DONE,       // Halted at the breakpoint and the result was accepted
+    SWD_MONITOR_FAILED,     // Result rejected, SWD error or deadline passed
+} swd_monitor_state_t;
+
+typedef struct swd_monitor_op swd_monitor_op_t;
+
+// Called from the monitor task, result is R0 of the algorithm
+typedef void (*swd_monitor_cb_t)(swd_monitor_op_t *op, swd_monitor_state_t state, uint32_t result, void *arg);
+
+uint8_t swd_monitor_init(void);
+swd_monitor_op_t *swd_monitor_exec(const program_syscall_t *sys_call, uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4,
+                                   flash_algo_return_t return_type, swd_monitor_cb_t cb, void *cb_arg);
+swd_monitor_state_t swd_monitor_poll(const swd_monitor_op_t *op);
+uint32_t swd_monitor_result(const swd_monitor_op_t *op);
+uint32_t swd_monitor_bit(const swd_monitor_op_t *op);
+void swd_monitor_release(swd_monitor_op_t *op);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,103 @@
+/**
+ * @file    swd_partition.c
+ * @brief   Implementation of swd_partition.h
+ */
+
+#include "swd_partition.h"
+#include "swd_host.h"
+
+#include <esp_log.h>
+#define PART_TAG "swd_part"
+
+// Block size of memory writes, one auto-increment page
+#define PART_BLOCK_SIZE     1024
+#define PART_READ_BUF_SIZE  256
+
+typedef struct {
+    const esp_partition_t *part;
+    uint32_t offset;
+} part_src_t;
+
+static uint32_t part_fetch(uint32_t addr, uint8_t *dst, uint32_t len, void *arg)
+{
+    part_src_t *src = arg;
+
+    if (esp_partition_read(src->part, src->offset, dst, len) != ESP_OK) {
+        return 0;
+    }
+
+    src->offset += len;
+    return len;
+}
+
+static uint8_t part_write_mapped(const uint8_t *data, uint32_t size, uint32_t address)
+{
+    uint32_t n;
+
+    for (uint32_t ofs = 0; ofs < size; ofs += n) {
+        n = (size - ofs > PART_BLOCK_SIZE) ? PART_BLOCK_SIZE : size - ofs;
+        swd_flash_prefetch(data + ofs, n);
+        if (!swd_write_memory(address + ofs, (uint8_t *)data + ofs, n)) {
+            ESP_LOGE(PART_TAG, "Write failed at 0x%08lx", address + ofs);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static uint8_t part_write_read(const esp_partition_t *part, uint32_t offset, uint32_t size, uint32_t address)
+{
+    uint8_t buf[PART_READ_BUF_SIZE];
+    uint32_t n;
+
+    for (uint32_t ofs = 0; ofs < size; ofs += n) {
+        n = (size - ofs > sizeof(buf)) ? sizeof(buf) : size - ofs;
+        if (esp_partition_read(part, offset + ofs, buf, n) != ESP_OK || !swd_write_memory(address + ofs, buf, n)) {
+            ESP_LOGE(PART_TAG, "Copy failed at 0x%08lx", address + ofs);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Copy size bytes at offset of a partition to target memory at address
+uint8_t swd_partition_write_memory(const esp_partition_t *part, uint32_t offset, uint32_t size, uint32_t address)
+{
+    esp_partition_mmap_handle_t handle;
+    const void *data;
+    uint8_t ret;
+
+    if (esp_partition_mmap(part, offset, size, ESP_PARTITION_MMAP_DATA, &data, &handle) != ESP_OK) {
+        ESP_LOGW(PART_TAG, "mmap failed, reading through a buffer");
+        return part_write_read(part, offset, size, address);
+    }
+
+    ret = part_write_mapped(data, size, address);
+    esp_partition_munmap(handle);
+    return ret;
+}
+
+// Program size bytes at offset of a partition into target flash at addr
+uint8_t swd_partition_flash_program(const swd_flash_config_t *cfg, const esp_partition_t *part, uint32_t offset, uint32_t size, uint32_t addr)
+{
+    esp_partition_mmap_handle_t handle;
+    const void *data;
+    uint8_t ret;
+
+    if (esp_partition_mmap(part, offset, size, ESP_PARTITION_MMAP_DATA, &data, &handle) != ESP_OK) {
+        part_src_t src = {
+            .part = part,
+            .offset = offset,
+        };
+
+        ESP_LOGW(PART_TAG, "mmap failed, reading through a buffer");
+        return swd_flash_program_stream(cfg, addr, size, part_fetch, &src);
+    }
+
+    // swd_flash_program() uploads pages straight from the mapping
+    ret = swd_flash_program(cfg, addr, data, size);
+    esp_partition_munmap(handle);
+    return ret;
+}
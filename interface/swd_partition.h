@@ -0,0 +1,27 @@
+/**
+ * @file    swd_partition.h
+ * @brief   Programming targets straight from ESP flash partitions
+ *
+ * The image range is mapped with esp_partition_mmap() and the mapped pointer is
+ * handed to the block writers, so no heap buffer or copy sits between flash and
+ * SWD. Each block is prefetched into the cache before it's transferred. If the
+ * range can't be mapped (MMU pages exhausted) it's read through a small stack
+ * buffer instead.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <esp_partition.h>
+#include "swd_flash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint8_t swd_partition_write_memory(const esp_partition_t *part, uint32_t offset, uint32_t size, uint32_t address);
+uint8_t swd_partition_flash_program(const swd_flash_config_t *cfg, const esp_partition_t *part, uint32_t offset, uint32_t size, uint32_t addr);
+
+#ifdef __cplusplus
+}
+#endif
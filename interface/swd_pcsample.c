@@ -0,0 +1,231 @@
+/**
+ * @file    swd_pcsample.c
+ * @brief   Implementation of swd_pcsample.h
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+
+#include "swd_pcsample.h"
+#include "swd_host.h"
+#include "swd_romtable.h"
+#include "debug_cm.h"
+
+#include <esp_log.h>
+#define PCS_TAG "swd_pcsample"
+
+#ifndef CONFIG_ESP_SWD_PCSAMPLE_YIELD_MS
+#define CONFIG_ESP_SWD_PCSAMPLE_YIELD_MS 20
+#endif
+
+#define DWT_PCSR_OFS        0x1C
+#define PCSR_HALTED         0xFFFFFFFF
+
+// Samples read per swd_read_word_repeat() call, kept on the stack
+#define PCS_BATCH           64
+
+// Back to back reads that must not all be zero for PCSR to count as implemented
+#define PCS_PROBE           8
+
+struct swd_pcsample {
+    uint32_t base;
+    uint32_t size;
+    uint8_t shift;          // log2 of the bin size
+    uint32_t bin_count;
+    swd_pcsample_stats_t stats;
+    uint32_t bins[];
+};
+
+static uint32_t pcs_pcsr_addr(void)
+{
+    swd_rom_state_t *rom = swd_ctx_rom_state();
+
+    if (rom->valid && rom->comp.dwt != 0) {
+        return rom->comp.dwt + DWT_PCSR_OFS;
+    }
+
+    return DWT_PCSR;
+}
+
+// An unimplemented PCSR reads as zero, while a running core is never seen at 0 every time
+static uint8_t pcs_pcsr_present(uint32_t addr)
+{
+    uint32_t pc[PCS_PROBE];
+
+    if (!swd_read_word_repeat(addr, pc, PCS_PROBE, 0)) {
+        ESP_LOGE(PCS_TAG, "PCSR read failed");
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < PCS_PROBE; i++) {
+        if (pc[i] != 0) {
+            return 1;
+        }
+    }
+
+    ESP_LOGE(PCS_TAG, "DWT_PCSR reads as zero, PC sampling not implemented");
+    return 0;
+}
+
+// Wait until esp_timer reaches t, sleeping whole ticks and spinning less than one
+static void pcs_wait_until(int64_t t)
+{
+    int64_t left;
+
+    while ((left = t - esp_timer_get_time()) >= portTICK_PERIOD_MS * 1000) {
+        vTaskDelay(left / (portTICK_PERIOD_MS * 1000));
+    }
+
+    while (esp_timer_get_time() < t) {
+    }
+}
+
+// Histogram over [base, base + size) with at most bins counters, the bin size is
+// rounded up to a power of two of at least one halfword
+swd_pcsample_t *swd_pcsample_create(uint32_t base, uint32_t size, uint32_t bins)
+{
+    swd_pcsample_t *ps;
+    uint8_t shift = 1;
+
+    if (size == 0 || bins == 0) {
+        return NULL;
+    }
+
+    while (shift < 31 && ((size - 1) >> shift) >= bins) {
+        shift++;
+    }
+    bins = ((size - 1) >> shift) + 1;
+
+    ps = calloc(1, sizeof(*ps) + bins * sizeof(uint32_t));
+    if (ps == NULL) {
+        ESP_LOGE(PCS_TAG, "Out of memory");
+        return NULL;
+    }
+
+    ps->base = base;
+    ps->size = size;
+    ps->shift = shift;
+    ps->bin_count = bins;
+    return ps;
+}
+
+// Sample for duration_ms on the calling task's context, rate_hz 0 samples as fast as the link allows.
+// Counts add up over several runs until swd_pcsample_reset().
+uint8_t swd_pcsample_run(swd_pcsample_t *ps, uint32_t rate_hz, uint32_t duration_ms)
+{
+    uint32_t pc[PCS_BATCH];
+    uint32_t addr = pcs_pcsr_addr();
+    uint32_t period_us = (rate_hz != 0) ? 1000000 / rate_hz : 0;
+    uint32_t samples = 0;
+    uint32_t n;
+    int64_t left;
+    // Periods below one tick never sleep in swd_read_word_repeat()
+    bool spins = period_us < portTICK_PERIOD_MS * 1000;
+    int64_t start, end, now, next, awake;
+
+    if (!swd_trace_enable()) {
+        ESP_LOGE(PCS_TAG, "Failed to set DEMCR.TRCENA");
+        return 0;
+    }
+
+    if (!pcs_pcsr_present(addr)) {
+        return 0;
+    }
+
+    start = next = awake = esp_timer_get_time();
+    end = start + (int64_t)duration_ms * 1000;
+
+    do {
+        // At low rates a whole batch would run far past duration_ms
+        n = PCS_BATCH;
+        if (period_us != 0) {
+            left = (end - esp_timer_get_time() + period_us - 1) / period_us;
+            if (left < n) {
+                n = (left > 0) ? left : 1;
+            }
+        }
+
+        if (!swd_read_word_repeat(addr, pc, n, period_us)) {
+            ESP_LOGE(PCS_TAG, "PCSR read failed");
+            return 0;
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t ofs = pc[i] - ps->base;
+
+            if (pc[i] == PCSR_HALTED) {
+                ps->stats.halted++;
+            } else if (ofs < ps->size) {
+                ps->bins[ofs >> ps->shift]++;
+            } else {
+                ps->stats.out_of_range++;
+            }
+        }
+        samples += n;
+        next += (int64_t)n * period_us;
+
+        // Let IDLE and lower priority tasks run now and then, the schedule restarts after the gap
+        if (spins && esp_timer_get_time() - awake >= CONFIG_ESP_SWD_PCSAMPLE_YIELD_MS * 1000) {
+            vTaskDelay(1);
+            awake = esp_timer_get_time();
+            if (next < awake) {
+                next = awake;
+            }
+        }
+
+        // Keep the spacing across batches as well
+        if (period_us != 0) {
+            pcs_wait_until(next);
+        }
+
+        now = esp_timer_get_time();
+    } while (now < end);
+
+    ps->stats.samples += samples;
+    ps->stats.elapsed_us += now - start;
+    ps->stats.rate_hz = (ps->stats.elapsed_us != 0) ?
+                        (uint32_t)((uint64_t)ps->stats.samples * 1000000 / ps->stats.elapsed_us) : 0;
+
+    return 1;
+}
+
+uint32_t swd_pcsample_bin_size(const swd_pcsample_t *ps)
+{
+    return 1UL << ps->shift;
+}
+
+// Report the non-empty bins in address order, returns their number
+uint32_t swd_pcsample_export(const swd_pcsample_t *ps, swd_pcsample_cb_t cb, void *arg)
+{
+    uint32_t used = 0;
+
+    for (uint32_t i = 0; i < ps->bin_count; i++) {
+        if (ps->bins[i] != 0) {
+            cb(ps->base + (i << ps->shift), ps->bins[i], arg);
+            used++;
+        }
+    }
+
+    return used;
+}
+
+void swd_pcsample_get_stats(const swd_pcsample_t *ps, swd_pcsample_stats_t *stats)
+{
+    *stats = ps->stats;
+}
+
+void swd_pcsample_reset(swd_pcsample_t *ps)
+{
+    memset(&ps->stats, 0, sizeof(ps->stats));
+    memset(ps->bins, 0, ps->bin_count * sizeof(uint32_t));
+}
+
+void swd_pcsample_destroy(swd_pcsample_t *ps)
+{
+    free(ps);
+}
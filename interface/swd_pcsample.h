@@ -0,0 +1,52 @@
+/**
+ * @file    swd_pcsample.h
+ * @brief   Statistical PC profiler based on DWT_PCSR
+ *
+ * DWT_PCSR is read at a fixed rate while the target keeps running, through
+ * swd_read_word_repeat() so every sample is a single AP transfer. Samples are
+ * counted into a histogram of equal sized bins over one address range,
+ * allocated once by swd_pcsample_create(). PCSR reads 0xFFFFFFFF while the core
+ * is halted; those samples are counted separately.
+ *
+ * At periods of one FreeRTOS tick or more the sampling task sleeps between
+ * samples without holding the context, each sample then being a separate read.
+ * Faster rates busy-wait, so the run blocks for a tick every
+ * ESP_SWD_PCSAMPLE_YIELD_MS and the idle task keeps feeding the task watchdog.
+ *
+ * PCSR is optional on ARMv6-M and ARMv8-M Baseline parts and reads as zero
+ * where it is missing; swd_pcsample_run() checks for that and fails instead of
+ * binning zeros.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct swd_pcsample swd_pcsample_t;
+
+typedef struct {
+    uint32_t samples;
+    uint32_t out_of_range;  // PC outside the histogram range
+    uint32_t halted;        // Core halted or in debug state
+    uint32_t elapsed_us;
+    uint32_t rate_hz;       // Achieved sample rate
+} swd_pcsample_stats_t;
+
+// Called for every non-empty bin, pc is the start address of the bin
+typedef void (*swd_pcsample_cb_t)(uint32_t pc, uint32_t count, void *arg);
+
+swd_pcsample_t *swd_pcsample_create(uint32_t base, uint32_t size, uint32_t bins);
+uint8_t swd_pcsample_run(swd_pcsample_t *ps, uint32_t rate_hz, uint32_t duration_ms);
+uint32_t swd_pcsample_bin_size(const swd_pcsample_t *ps);
+uint32_t swd_pcsample_export(const swd_pcsample_t *ps, swd_pcsample_cb_t cb, void *arg);
+void swd_pcsample_get_stats(const swd_pcsample_t *ps, swd_pcsample_stats_t *stats);
+void swd_pcsample_reset(swd_pcsample_t *ps);
+void swd_pcsample_destroy(swd_pcsample_t *ps);
+
+#ifdef __cplusplus
+}
+#endif
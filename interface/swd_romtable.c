@@ -0,0 +1,410 @@
+/**
+ * @file    swd_romtable.c
+ * @brief   Implementation of swd_romtable.h
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <nvs.h>
+
+#include "swd_romtable.h"
+#include "swd_host.h"
+#include "debug_cm.h"
+
+#include <esp_log.h>
+#define ROM_TAG "swd_rom"
+
+#define ROM_NVS_NAMESPACE   "swd_rom"
+#define ROM_CACHE_VERSION   2
+
+// Component and peripheral ID registers, read as one block from 0xFD0
+#define ROM_ID_BLOCK_OFS    0xFD0
+#define ROM_PIDR0_OFS       0xFE0
+#define ROM_DEVARCH_OFS     0xFBC
+
+#define CIDR_PREAMBLE_MASK  0xFFFF0FFF
+#define CIDR_PREAMBLE       0xB105000D
+#define CIDR_CLASS(cidr)    (((cidr) >> 12) & 0xF)
+#define CLASS_ROM_TABLE     0x1
+#define CLASS_CORESIGHT     0x9
+#define CLASS_GENERIC_IP    0xE
+
+#define DEVARCH_PRESENT     (1UL << 20)
+#define DEVARCH_ARCHITECT(x) (((x) >> 21) & 0x7FF)
+#define DEVARCH_ARCHID(x)   ((x) & 0xFFF)
+#define DEVARCH_ARCHITECT_ARM 0x23B     // JEP106 continuation in bits [10:7]
+#define DEVARCH_ROM_TABLE   0xAF7       // ADIv6/ARMv8-M class 0x9 ROM table
+
+// Class 0x9 ROM table: DEVID.FORMAT selects 32 or 64-bit entries
+#define ROM9_DEVID_OFS      0xFC8
+#define ROM9_FORMAT_64      0x1
+#define ROM9_PRESENT_MASK   0x3
+#define ROM9_PRESENT        0x3
+
+#define ROM_MAX_ENTRIES     960
+#define ROM_MAX_DEPTH       4
+
+typedef struct {
+    uint32_t version;
+    uint32_t idcode;
+    uint32_t ap_idr;
+    uint32_t rom_pidr0;
+    swd_rom_components_t comp;
+} rom_cache_t;
+
+static void rom_cache_key(uint32_t idcode, uint32_t ap_idr, char *key)
+{
+    // NVS keys are limited to 15 characters, the full IDs are verified from the blob
+    uint32_t hash = idcode ^ ((ap_idr << 13) | (ap_idr >> 19));
+    snprintf(key, 16, "rt%08lx", (unsigned long)hash);
+}
+
+static uint8_t rom_cache_load(uint32_t idcode, uint32_t ap_idr, rom_cache_t *cache)
+{
+    nvs_handle_t nvs;
+    char key[16];
+    size_t len = sizeof(*cache);
+
+    rom_cache_key(idcode, ap_idr, key);
+    if (nvs_open(ROM_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return 0;
+    }
+
+    esp_err_t ret = nvs_get_blob(nvs, key, cache, &len);
+    nvs_close(nvs);
+
+    return (ret == ESP_OK && len == sizeof(*cache) && cache->version == ROM_CACHE_VERSION
+            && cache->idcode == idcode && cache->ap_idr == ap_idr);
+}
+
+static void rom_cache_store(const rom_cache_t *cache)
+{
+    nvs_handle_t nvs;
+    char key[16];
+
+    rom_cache_key(cache->idcode, cache->ap_idr, key);
+    if (nvs_open(ROM_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGW(ROM_TAG, "NVS unavailable, ROM table not cached");
+        return;
+    }
+
+    if (nvs_set_blob(nvs, key, cache, sizeof(*cache)) == ESP_OK) {
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+}
+
+// Read PIDR4, PIDR0-3 and CIDR0-3 of a 4KB block in one auto-increment read
+static uint8_t rom_read_ids(uint32_t addr, uint32_t *cidr, uint32_t *pidr)
+{
+    uint32_t regs[12];
+
+    if (!swd_read_memory(addr + ROM_ID_BLOCK_OFS, (uint8_t *)regs, sizeof(regs))) {
+        return 0;
+    }
+
+    // 0xFD0: PIDR4, 0xFE0-0xFEC: PIDR0-3, 0xFF0-0xFFC: CIDR0-3
+    *cidr = (regs[8] & 0xff) | ((regs[9] & 0xff) << 8) | ((regs[10] & 0xff) << 16) | ((regs[11] & 0xff) << 24);
+    pidr[0] = regs[4] & 0xff;
+    pidr[1] = regs[5] & 0xff;
+    pidr[2] = regs[6] & 0xff;
+    pidr[3] = regs[7] & 0xff;
+    pidr[4] = regs[0] & 0xff;
+    return 1;
+}
+
+static void rom_add_vendor(swd_rom_components_t *out, uint32_t base, uint16_t designer, uint16_t part)
+{
+    if (out->vendor_count >= CONFIG_ESP_SWD_ROM_MAX_VENDOR) {
+        return;
+    }
+
+    out->vendor[out->vendor_count].base = base;
+    out->vendor[out->vendor_count].designer = designer;
+    out->vendor[out->vendor_count].part = part;
+    out->vendor_count++;
+}
+
+static void rom_set_once(uint32_t *slot, uint32_t base)
+{
+    if (*slot == 0) {
+        *slot = base;
+    }
+}
+
+static uint8_t rom_walk_table(uint32_t rom_base, uint8_t depth, swd_rom_components_t *out);
+static uint8_t rom_walk_table9(uint32_t rom_base, uint8_t depth, swd_rom_components_t *out);
+
+// Identify the component whose last 4KB block is at addr, descending into ROM tables
+static uint8_t rom_visit(uint32_t addr, uint8_t depth, swd_rom_components_t *out)
+{
+    uint32_t cidr, devarch = 0;
+    uint32_t pidr[5];
+
+    if (!rom_read_ids(addr, &cidr, pidr)) {
+        return 0;
+    }
+
+    if ((cidr & CIDR_PREAMBLE_MASK) != CIDR_PREAMBLE) {
+        ESP_LOGD(ROM_TAG, "Bad CIDR 0x%08lx at 0x%08lx", cidr, addr);
+        return 1;
+    }
+
+    // ID registers live in the last 4KB block of larger components
+    uint32_t size = (pidr[4] >> 4) & 0xF;
+    uint32_t base = addr - (((1UL << size) - 1) * 0x1000);
+    uint16_t part = pidr[0] | ((pidr[1] & 0xF) << 8);
+    uint16_t designer = ((pidr[1] >> 4) & 0xF) | ((pidr[2] & 0x7) << 4) | ((pidr[4] & 0xF) << 8);
+    uint32_t cls = CIDR_CLASS(cidr);
+
+    ESP_LOGD(ROM_TAG, "Component at 0x%08lx class 0x%lx designer 0x%03x part 0x%03x", base, cls, designer, part);
+
+    if (cls == CLASS_ROM_TABLE) {
+        return rom_walk_table(base, depth, out);
+    }
+
+    // ARMv8-M components, including class 0x9 ROM tables of any designer, are identified by DEVARCH
+    if (cls == CLASS_CORESIGHT) {
+        if (!swd_read_word(base + ROM_DEVARCH_OFS, &devarch)) {
+            return 0;
+        }
+
+        if (!(devarch & DEVARCH_PRESENT) || DEVARCH_ARCHITECT(devarch) != DEVARCH_ARCHITECT_ARM) {
+            devarch = 0;
+        } else if (DEVARCH_ARCHID(devarch) == DEVARCH_ROM_TABLE) {
+            return rom_walk_table9(base, depth, out);
+        }
+    }
+
+    if (designer != ROM_DESIGNER_ARM) {
+        rom_add_vendor(out, base, designer, part);
+        return 1;
+    }
+
+    if (cls == CLASS_GENERIC_IP) {
+        // ARMv6-M/ARMv7-M components are identified by part number
+        switch (part) {
+            case 0x000:
+            case 0x008:
+            case 0x00C:
+                rom_set_once(&out->scs, base);
+                break;
+            case 0x001:
+                rom_set_once(&out->itm, base);
+                break;
+            case 0x002:
+            case 0x00A:
+                rom_set_once(&out->dwt, base);
+                break;
+            case 0x003:
+            case 0x00B:
+            case 0x00E:
+                rom_set_once(&out->fpb, base);
+                break;
+            default:
+                break;
+        }
+    } else if (cls == CLASS_CORESIGHT && devarch != 0) {
+        switch (DEVARCH_ARCHID(devarch)) {
+            case 0xA04:
+                rom_set_once(&out->scs, base);
+                break;
+            case 0xA01:
+                rom_set_once(&out->itm, base);
+                break;
+            case 0xA02:
+                rom_set_once(&out->dwt, base);
+                break;
+            case 0xA03:
+                rom_set_once(&out->fpb, base);
+                break;
+            default:
+                break;
+        }
+    }
+
+    return 1;
+}
+
+// Class 0x1 ROM table, a zero entry ends it
+static uint8_t rom_walk_table(uint32_t rom_base, uint8_t depth, swd_rom_components_t *out)
+{
+    uint32_t entry;
+
+    if (depth >= ROM_MAX_DEPTH) {
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < ROM_MAX_ENTRIES; i++) {
+        if (!swd_read_word(rom_base + i * 4, &entry)) {
+            return 0;
+        }
+
+        if (entry == 0) {
+            break;
+        }
+
+        // Not present, or the legacy 8-bit entry format
+        if ((entry & 0x3) != 0x3) {
+            continue;
+        }
+
+        if (!rom_visit(rom_base + (uint32_t)((int32_t)(entry & 0xFFFFF000)), depth + 1, out)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Class 0x9 (CoreSight) ROM table: PRESENT is 0b11 for a valid entry, an all-zero
+// entry ends the table. 64-bit entries are only followed below 4GB.
+static uint8_t rom_walk_table9(uint32_t rom_base, uint8_t depth, swd_rom_components_t *out)
+{
+    uint32_t devid, entry[2];
+    uint32_t stride, count;
+
+    if (depth >= ROM_MAX_DEPTH) {
+        return 1;
+    }
+
+    if (!swd_read_word(rom_base + ROM9_DEVID_OFS, &devid)) {
+        return 0;
+    }
+
+    stride = ((devid & 0xF) == ROM9_FORMAT_64) ? 8 : 4;
+    count = ROM_MAX_ENTRIES * 4 / stride;
+    entry[1] = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!swd_read_memory(rom_base + i * stride, (uint8_t *)entry, stride)) {
+            return 0;
+        }
+
+        if (entry[0] == 0 && entry[1] == 0) {
+            break;
+        }
+
+        if ((entry[0] & ROM9_PRESENT_MASK) != ROM9_PRESENT) {
+            continue;
+        }
+
+        if (stride == 8 && entry[1] != 0 && entry[1] != 0xFFFFFFFF) {
+            ESP_LOGD(ROM_TAG, "Skipping 64-bit entry 0x%08lx%08lx", entry[1], entry[0]);
+            continue;
+        }
+
+        if (!rom_visit(rom_base + (entry[0] & 0xFFFFF000), depth + 1, out)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+uint8_t swd_romtable_walk(uint32_t rom_base, swd_rom_components_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->rom_base = rom_base;
+    // The top level may be either table class
+    return rom_visit(rom_base, 0, out);
+}
+
+// Find the debug components of the selected AP, from the NVS cache when possible
+uint8_t swd_romtable_discover(swd_rom_components_t *out)
+{
+    rom_cache_t cache;
+    uint32_t idcode, ap_idr, base, pidr0;
+    swd_rom_state_t *rom = swd_ctx_rom_state();
+
+    rom->valid = 0;
+
+    if (!swd_read_dp(DP_IDCODE, &idcode) || !swd_ap_get_idr(swd_ap_get_selected(), &ap_idr)) {
+        return 0;
+    }
+
+    if (rom_cache_load(idcode, ap_idr, &cache)) {
+        if (swd_read_word(cache.comp.rom_base + ROM_PIDR0_OFS, &pidr0) && pidr0 == cache.rom_pidr0) {
+            ESP_LOGD(ROM_TAG, "Using cached ROM table at 0x%08lx", cache.comp.rom_base);
+            rom->comp = cache.comp;
+            goto found;
+        }
+        ESP_LOGI(ROM_TAG, "Cached ROM table is stale, walking again");
+    }
+
+    if (!swd_read_ap(AP_ROM, &base)) {
+        return 0;
+    }
+
+    // BASE of 0xFFFFFFFF or without the present bit means no debug entries
+    if (base == 0xFFFFFFFF || !(base & 0x1)) {
+        ESP_LOGW(ROM_TAG, "AP has no ROM table, BASE 0x%08lx", base);
+        return 0;
+    }
+
+    if (!swd_romtable_walk(base & 0xFFFFF000, &rom->comp)) {
+        ESP_LOGE(ROM_TAG, "ROM table walk failed");
+        swd_clear_errors();
+        return 0;
+    }
+
+    if (!swd_read_word(rom->comp.rom_base + ROM_PIDR0_OFS, &pidr0)) {
+        return 0;
+    }
+
+    memset(&cache, 0, sizeof(cache));
+    cache.version = ROM_CACHE_VERSION;
+    cache.idcode = idcode;
+    cache.ap_idr = ap_idr;
+    cache.rom_pidr0 = pidr0;
+    cache.comp = rom->comp;
+    rom_cache_store(&cache);
+
+found:
+    rom->valid = 1;
+    if (rom->comp.scs != 0) {
+        swd_set_scs_base(rom->comp.scs);
+    }
+
+    if (out != NULL) {
+        *out = rom->comp;
+    }
+
+    return 1;
+}
+
+// Components found by the last swd_romtable_discover()
+uint8_t swd_romtable_get(swd_rom_components_t *out)
+{
+    swd_rom_state_t *rom = swd_ctx_rom_state();
+
+    if (!rom->valid) {
+        return 0;
+    }
+
+    *out = rom->comp;
+    return 1;
+}
+
+// Drop the cached entry of the connected part, forcing a full walk on the next discover
+uint8_t swd_romtable_forget(void)
+{
+    nvs_handle_t nvs;
+    char key[16];
+    uint32_t idcode, ap_idr;
+
+    if (!swd_read_dp(DP_IDCODE, &idcode) || !swd_ap_get_idr(swd_ap_get_selected(), &ap_idr)) {
+        return 0;
+    }
+
+    rom_cache_key(idcode, ap_idr, key);
+    if (nvs_open(ROM_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return 0;
+    }
+
+    nvs_erase_key(nvs, key);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+    swd_ctx_rom_state()->valid = 0;
+    return 1;
+}
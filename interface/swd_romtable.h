@@ -0,0 +1,57 @@
+/**
+ * @file    swd_romtable.h
+ * @brief   CoreSight ROM table walker with a persistent component cache
+ *
+ * The walk result is stored in NVS keyed by DP IDCODE and AP IDR. On a repeat
+ * connect to a known part the cached entry is validated with a single PIDR0 read
+ * of the ROM table instead of walking it again. NVS must be initialised by the
+ * application (nvs_flash_init()), otherwise every connect falls back to a walk.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef CONFIG_ESP_SWD_ROM_MAX_VENDOR
+#define CONFIG_ESP_SWD_ROM_MAX_VENDOR 4
+#endif
+
+// JEP106 code of ARM Ltd: continuation 4, identity 0x3B
+#define ROM_DESIGNER_ARM   0x43B
+
+typedef struct {
+    uint32_t base;
+    uint16_t designer;      // JEP106 continuation << 8 | identity code
+    uint16_t part;
+} swd_rom_vendor_t;
+
+typedef struct {
+    uint32_t rom_base;      // ROM table the components were found in
+    uint32_t scs;           // System Control Space, 0 if not found
+    uint32_t dwt;           // Data Watchpoint and Trace
+    uint32_t fpb;           // Flash Patch and Breakpoint
+    uint32_t itm;           // Instrumentation Trace Macrocell
+    uint8_t vendor_count;
+    swd_rom_vendor_t vendor[CONFIG_ESP_SWD_ROM_MAX_VENDOR];
+} swd_rom_components_t;
+
+// Last discover result, kept per context by swd_host.c
+typedef struct {
+    swd_rom_components_t comp;
+    uint8_t valid;
+} swd_rom_state_t;
+
+swd_rom_state_t *swd_ctx_rom_state(void);
+
+uint8_t swd_romtable_discover(swd_rom_components_t *out);
+uint8_t swd_romtable_walk(uint32_t rom_base, swd_rom_components_t *out);
+uint8_t swd_romtable_get(swd_rom_components_t *out);
+uint8_t swd_romtable_forget(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,592 @@
+/**
+ * @file    swd_rtt.c
+ * @brief   Implementation of swd_rtt.h
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <freertos/stream_buffer.h>
+#include <nvs.h>
+
+#include "swd_rtt.h"
+#include "swd_host.h"
+
+#include <esp_log.h>
+#define RTT_TAG "swd_rtt"
+
+#ifndef CONFIG_ESP_SWD_RTT_MAX_CHANNELS
+#define CONFIG_ESP_SWD_RTT_MAX_CHANNELS 4
+#endif
+
+#ifndef CONFIG_ESP_SWD_RTT_STREAM_SIZE
+#define CONFIG_ESP_SWD_RTT_STREAM_SIZE 1024
+#endif
+
+#ifndef CONFIG_ESP_SWD_RTT_CHUNK
+#define CONFIG_ESP_SWD_RTT_CHUNK 512
+#endif
+
+#ifndef CONFIG_ESP_SWD_RTT_POLL_MIN_US
+#define CONFIG_ESP_SWD_RTT_POLL_MIN_US 1000
+#endif
+
+#ifndef CONFIG_ESP_SWD_RTT_POLL_MAX_US
+#define CONFIG_ESP_SWD_RTT_POLL_MAX_US 50000
+#endif
+
+#ifndef CONFIG_ESP_SWD_RTT_TASK_STACK
+#define CONFIG_ESP_SWD_RTT_TASK_STACK 3072
+#endif
+
+#ifndef CONFIG_ESP_SWD_RTT_TASK_PRIO
+#define CONFIG_ESP_SWD_RTT_TASK_PRIO 5
+#endif
+
+#define RTT_NVS_NAMESPACE   "swd_rtt"
+
+// SEGGER_RTT_CB: char acID[16], int MaxNumUpBuffers, int MaxNumDownBuffers,
+// then the up and down SEGGER_RTT_BUFFER descriptors
+#define RTT_ID_SIZE         16
+#define RTT_HDR_SIZE        24
+#define RTT_MAX_BUFFERS     64          // Sanity limit for the buffer counts in the header
+
+// SEGGER_RTT_BUFFER: sName, pBuffer, SizeOfBuffer, WrOff, RdOff, Flags
+#define RTT_DESC_SIZE       24
+#define RTT_DESC_WORDS      (RTT_DESC_SIZE / 4)
+#define RTT_BUFFER_OFS      4
+#define RTT_WROFF_OFS       12
+#define RTT_RDOFF_OFS       16
+
+// The scan reads overlapping chunks so an ID crossing a chunk boundary is still found
+#define RTT_SCAN_OVERLAP    (RTT_ID_SIZE - 4)
+
+typedef struct {
+    uint32_t desc;          // Descriptor address in target RAM
+    uint32_t buf;
+    uint32_t size;
+    StreamBufferHandle_t stream;
+} RTT_CHANNEL;
+
+struct swd_rtt {
+    swd_ctx_t *ctx;
+    uint32_t cb_addr;
+    uint8_t up_count;
+    uint8_t down_count;
+    RTT_CHANNEL up[CONFIG_ESP_SWD_RTT_MAX_CHANNELS];
+    RTT_CHANNEL down[CONFIG_ESP_SWD_RTT_MAX_CHANNELS];
+    uint8_t *bounce;
+    swd_rtt_stats_t stats;
+    TaskHandle_t task;
+    SemaphoreHandle_t stopped;
+    volatile bool stop;
+    bool failing;
+};
+
+static const char rtt_id[RTT_ID_SIZE] = "SEGGER RTT";
+
+static void rtt_cache_key(uint32_t build_tag, char *key)
+{
+    snprintf(key, 16, "cb%08lx", (unsigned long)build_tag);
+}
+
+static uint8_t rtt_cache_load(uint32_t build_tag, uint32_t *addr)
+{
+    nvs_handle_t nvs;
+    char key[16];
+
+    rtt_cache_key(build_tag, key);
+    if (nvs_open(RTT_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return 0;
+    }
+
+    esp_err_t ret = nvs_get_u32(nvs, key, addr);
+    nvs_close(nvs);
+
+    return ret == ESP_OK;
+}
+
+static void rtt_cache_store(uint32_t build_tag, uint32_t addr)
+{
+    nvs_handle_t nvs;
+    char key[16];
+
+    rtt_cache_key(build_tag, key);
+    if (nvs_open(RTT_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGW(RTT_TAG, "NVS unavailable, control block address not cached");
+        return;
+    }
+
+    if (nvs_set_u32(nvs, key, addr) == ESP_OK) {
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+}
+
+// Check the ID and buffer counts of a control block candidate
+static uint8_t rtt_verify(uint32_t addr, uint32_t *max_up, uint32_t *max_down)
+{
+    uint32_t hdr[RTT_HDR_SIZE / 4];
+
+    if (!swd_read_memory(addr, (uint8_t *)hdr, sizeof(hdr))) {
+        return 0;
+    }
+
+    if (memcmp(hdr, rtt_id, RTT_ID_SIZE) != 0 || hdr[4] > RTT_MAX_BUFFERS || hdr[5] > RTT_MAX_BUFFERS) {
+        return 0;
+    }
+
+    *max_up = hdr[4];
+    *max_down = hdr[5];
+    return 1;
+}
+
+// Look for the ID at every word aligned address of [start, start + size)
+static uint8_t rtt_scan(uint32_t start, uint32_t size, uint8_t *buf, uint32_t *addr)
+{
+    uint32_t pos = start & ~0x3UL;
+    uint32_t end = start + size;
+    uint32_t n;
+
+    while (pos + RTT_ID_SIZE <= end) {
+        n = end - pos;
+        if (n > CONFIG_ESP_SWD_RTT_CHUNK) {
+            n = CONFIG_ESP_SWD_RTT_CHUNK;
+        }
+
+        if (!swd_read_memory(pos, buf, n)) {
+            return 0;
+        }
+
+        for (uint32_t ofs = 0; ofs + RTT_ID_SIZE <= n; ofs += 4) {
+            if (memcmp(buf + ofs, rtt_id, RTT_ID_SIZE) == 0) {
+                *addr = pos + ofs;
+                return 1;
+            }
+        }
+
+        if (pos + n >= end) {
+            break;
+        }
+        pos += n - RTT_SCAN_OVERLAP;
+    }
+
+    return 0;
+}
+
+// Re-read pBuffer and SizeOfBuffer, the target may configure a buffer after the block was found
+static uint8_t rtt_refresh(RTT_CHANNEL *ch)
+{
+    uint32_t val[2];
+
+    if (!swd_read_memory(ch->desc + RTT_BUFFER_OFS, (uint8_t *)val, sizeof(val))) {
+        return 0;
+    }
+
+    ch->buf = val[0];
+    ch->size = (val[0] != 0) ? val[1] : 0;
+    return 1;
+}
+
+// Move the bytes between RdOff and WrOff of an up-buffer into its stream buffer
+static uint8_t rtt_read_up(swd_rtt_t *rtt, RTT_CHANNEL *ch, uint32_t wr, uint32_t rd, uint32_t *moved)
+{
+    uint32_t start = rd;
+    uint32_t space, n;
+
+    if (ch->size == 0 || wr >= ch->size || rd >= ch->size) {
+        if (!rtt_refresh(ch)) {
+            return 0;
+        }
+        if (ch->size == 0 || wr >= ch->size || rd >= ch->size) {
+            return 1;
+        }
+    }
+
+    while (rd != wr) {
+        space = xStreamBufferSpacesAvailable(ch->stream);
+        if (space == 0) {
+            rtt->stats.stalls++;
+            break;
+        }
+
+        n = ((wr > rd) ? wr : ch->size) - rd;
+        if (n > space) {
+            n = space;
+        }
+        if (n > CONFIG_ESP_SWD_RTT_CHUNK) {
+            n = CONFIG_ESP_SWD_RTT_CHUNK;
+        }
+
+        if (!swd_read_memory(ch->buf + rd, rtt->bounce, n)) {
+            return 0;
+        }
+
+        xStreamBufferSend(ch->stream, rtt->bounce, n, 0);
+        rd += n;
+        if (rd == ch->size) {
+            rd = 0;
+        }
+        *moved += n;
+        rtt->stats.bytes_up += n;
+    }
+
+    if (rd != start && !swd_write_word(ch->desc + RTT_RDOFF_OFS, rd)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+// Copy queued swd_rtt_write() data into a down-buffer, as much as it has room for
+static uint8_t rtt_write_down(swd_rtt_t *rtt, RTT_CHANNEL *ch, uint32_t *moved)
+{
+    uint32_t off[2];
+    uint32_t wr, rd, start, n;
+
+    if (xStreamBufferBytesAvailable(ch->stream) == 0) {
+        return 1;
+    }
+
+    if (ch->size == 0 && !rtt_refresh(ch)) {
+        return 0;
+    }
+
+    if (!swd_read_memory(ch->desc + RTT_WROFF_OFS, (uint8_t *)off, sizeof(off))) {
+        return 0;
+    }
+
+    wr = start = off[0];
+    rd = off[1];
+    if (ch->size == 0 || wr >= ch->size || rd >= ch->size) {
+        return rtt_refresh(ch);
+    }
+
+    while (true) {
+        // One byte stays free so that WrOff == RdOff means empty
+        if (rd > wr) {
+            n = rd - wr - 1;
+        } else {
+            n = ch->size - wr - (rd == 0 ? 1 : 0);
+        }
+        if (n > CONFIG_ESP_SWD_RTT_CHUNK) {
+            n = CONFIG_ESP_SWD_RTT_CHUNK;
+        }
+
+        n = (n > 0) ? xStreamBufferReceive(ch->stream, rtt->bounce, n, 0) : 0;
+        if (n == 0) {
+            break;
+        }
+
+        if (!swd_write_memory(ch->buf + wr, rtt->bounce, n)) {
+            return 0;
+        }
+
+        wr += n;
+        if (wr == ch->size) {
+            wr = 0;
+        }
+        *moved += n;
+        rtt->stats.bytes_down += n;
+    }
+
+    if (wr != start && !swd_write_word(ch->desc + RTT_WROFF_OFS, wr)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+static uint8_t rtt_transfer(swd_rtt_t *rtt, uint32_t *moved)
+{
+    uint32_t off[CONFIG_ESP_SWD_RTT_MAX_CHANNELS * RTT_DESC_WORDS];
+
+    *moved = 0;
+    rtt->stats.polls++;
+
+    if (rtt->up_count > 0) {
+        // WrOff of the first up-buffer to RdOff of the last one in a single block
+        uint32_t len = (rtt->up_count - 1) * RTT_DESC_SIZE + 8;
+
+        if (!swd_read_memory(rtt->up[0].desc + RTT_WROFF_OFS, (uint8_t *)off, len)) {
+            return 0;
+        }
+
+        for (uint32_t i = 0; i < rtt->up_count; i++) {
+            if (!rtt_read_up(rtt, &rtt->up[i], off[i * RTT_DESC_WORDS], off[i * RTT_DESC_WORDS + 1], moved)) {
+                return 0;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < rtt->down_count; i++) {
+        if (!rtt_write_down(rtt, &rtt->down[i], moved)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Other tasks sharing the context wait for the whole pass, not just single transfers
+static uint8_t rtt_poll(swd_rtt_t *rtt, uint32_t *moved)
+{
+    uint8_t ret;
+
+    swd_ctx_lock(rtt->ctx);
+    ret = rtt_transfer(rtt, moved);
+    swd_ctx_unlock(rtt->ctx);
+    return ret;
+}
+
+static void rtt_worker(void *arg)
+{
+    swd_rtt_t *rtt = arg;
+    uint32_t interval = CONFIG_ESP_SWD_RTT_POLL_MIN_US;
+    uint32_t moved;
+    TickType_t ticks;
+
+    swd_ctx_bind(rtt->ctx);
+
+    while (!rtt->stop) {
+        if (!rtt_poll(rtt, &moved)) {
+            if (!rtt->failing) {
+                ESP_LOGW(RTT_TAG, "Poll failed, backing off");
+                rtt->failing = true;
+            }
+            interval = CONFIG_ESP_SWD_RTT_POLL_MAX_US;
+        } else {
+            rtt->failing = false;
+
+            // Faster while data flows, slower while the target is quiet
+            if (moved > 0) {
+                interval /= 2;
+                if (interval < CONFIG_ESP_SWD_RTT_POLL_MIN_US) {
+                    interval = CONFIG_ESP_SWD_RTT_POLL_MIN_US;
+                }
+            } else if (interval < CONFIG_ESP_SWD_RTT_POLL_MAX_US) {
+                interval *= 2;
+                if (interval > CONFIG_ESP_SWD_RTT_POLL_MAX_US) {
+                    interval = CONFIG_ESP_SWD_RTT_POLL_MAX_US;
+                }
+            }
+        }
+        rtt->stats.interval_us = interval;
+
+        // Always blocks for at least one tick, swd_rtt_write() and swd_rtt_stop() cut the wait short
+        ticks = pdMS_TO_TICKS(interval / 1000);
+        if (ticks == 0) {
+            ticks = 1;
+        }
+        ulTaskNotifyTake(pdTRUE, ticks);
+    }
+
+    xSemaphoreGive(rtt->stopped);
+    vTaskDelete(NULL);
+}
+
+// Find the control block in target RAM, build_tag 0 disables the NVS address cache
+swd_rtt_t *swd_rtt_open(uint32_t ram_start, uint32_t ram_size, uint32_t build_tag)
+{
+    swd_rtt_t *rtt;
+    uint32_t addr = 0;
+    uint32_t max_up, max_down;
+    bool found = false;
+
+    rtt = calloc(1, sizeof(*rtt));
+    if (rtt == NULL) {
+        ESP_LOGE(RTT_TAG, "Out of memory");
+        return NULL;
+    }
+
+    rtt->bounce = malloc(CONFIG_ESP_SWD_RTT_CHUNK);
+    rtt->stopped = xSemaphoreCreateBinary();
+    if (rtt->bounce == NULL || rtt->stopped == NULL) {
+        ESP_LOGE(RTT_TAG, "Out of memory");
+        swd_rtt_close(rtt);
+        return NULL;
+    }
+
+    if (build_tag != 0 && rtt_cache_load(build_tag, &addr)) {
+        found = rtt_verify(addr, &max_up, &max_down);
+    }
+
+    if (!found) {
+        found = rtt_scan(ram_start, ram_size, rtt->bounce, &addr) && rtt_verify(addr, &max_up, &max_down);
+        if (found && build_tag != 0) {
+            rtt_cache_store(build_tag, addr);
+        }
+    }
+
+    if (!found) {
+        ESP_LOGE(RTT_TAG, "No control block in 0x%08lx-0x%08lx", ram_start, ram_start + ram_size);
+        swd_rtt_close(rtt);
+        return NULL;
+    }
+
+    rtt->ctx = swd_ctx_current();
+    swd_ctx_acquire(rtt->ctx);
+    rtt->cb_addr = addr;
+    rtt->up_count = (max_up < CONFIG_ESP_SWD_RTT_MAX_CHANNELS) ? max_up : CONFIG_ESP_SWD_RTT_MAX_CHANNELS;
+    rtt->down_count = (max_down < CONFIG_ESP_SWD_RTT_MAX_CHANNELS) ? max_down : CONFIG_ESP_SWD_RTT_MAX_CHANNELS;
+
+    for (uint32_t i = 0; i < rtt->up_count; i++) {
+        rtt->up[i].desc = addr + RTT_HDR_SIZE + i * RTT_DESC_SIZE;
+        rtt->up[i].stream = xStreamBufferCreate(CONFIG_ESP_SWD_RTT_STREAM_SIZE, 1);
+        if (rtt->up[i].stream == NULL || !rtt_refresh(&rtt->up[i])) {
+            swd_rtt_close(rtt);
+            return NULL;
+        }
+    }
+
+    for (uint32_t i = 0; i < rtt->down_count; i++) {
+        rtt->down[i].desc = addr + RTT_HDR_SIZE + (max_up + i) * RTT_DESC_SIZE;
+        rtt->down[i].stream = xStreamBufferCreate(CONFIG_ESP_SWD_RTT_STREAM_SIZE, 1);
+        if (rtt->down[i].stream == NULL || !rtt_refresh(&rtt->down[i])) {
+            swd_rtt_close(rtt);
+            return NULL;
+        }
+    }
+
+    rtt->stats.interval_us = CONFIG_ESP_SWD_RTT_POLL_MIN_US;
+    return rtt;
+}
+
+uint32_t swd_rtt_address(const swd_rtt_t *rtt)
+{
+    return rtt->cb_addr;
+}
+
+uint8_t swd_rtt_up_count(const swd_rtt_t *rtt)
+{
+    return rtt->up_count;
+}
+
+uint8_t swd_rtt_down_count(const swd_rtt_t *rtt)
+{
+    return rtt->down_count;
+}
+
+// One transfer pass on the calling task's context, for callers running their own loop
+uint8_t swd_rtt_poll(swd_rtt_t *rtt)
+{
+    uint32_t moved;
+
+    if (rtt->task != NULL) {
+        ESP_LOGE(RTT_TAG, "Poll task is running");
+        return 0;
+    }
+
+    return rtt_poll(rtt, &moved);
+}
+
+// Poll from a dedicated task, which owns the context of swd_rtt_open() until swd_rtt_stop()
+uint8_t swd_rtt_start(swd_rtt_t *rtt)
+{
+    if (rtt->task != NULL) {
+        return 1;
+    }
+
+    rtt->stop = false;
+    if (xTaskCreate(rtt_worker, "swd_rtt", CONFIG_ESP_SWD_RTT_TASK_STACK, rtt,
+                    CONFIG_ESP_SWD_RTT_TASK_PRIO, &rtt->task) != pdPASS) {
+        ESP_LOGE(RTT_TAG, "Failed to create poll task");
+        rtt->task = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+void swd_rtt_stop(swd_rtt_t *rtt)
+{
+    if (rtt->task == NULL) {
+        return;
+    }
+
+    rtt->stop = true;
+    xTaskNotifyGive(rtt->task);
+    xSemaphoreTake(rtt->stopped, portMAX_DELAY);
+    rtt->task = NULL;
+}
+
+// Read up to len bytes of an up-channel, waiting at most timeout for the first one
+uint32_t swd_rtt_read(swd_rtt_t *rtt, uint8_t channel, uint8_t *dst, uint32_t len, TickType_t timeout)
+{
+    if (channel >= rtt->up_count) {
+        return 0;
+    }
+
+    return xStreamBufferReceive(rtt->up[channel].stream, dst, len, timeout);
+}
+
+// Queue data for a down-channel, returns the number of bytes queued
+uint32_t swd_rtt_write(swd_rtt_t *rtt, uint8_t channel, const uint8_t *data, uint32_t len, TickType_t timeout)
+{
+    uint32_t n;
+
+    if (channel >= rtt->down_count) {
+        return 0;
+    }
+
+    n = xStreamBufferSend(rtt->down[channel].stream, data, len, timeout);
+    if (n > 0 && rtt->task != NULL) {
+        xTaskNotifyGive(rtt->task);
+    }
+
+    return n;
+}
+
+void swd_rtt_get_stats(const swd_rtt_t *rtt, swd_rtt_stats_t *stats)
+{
+    *stats = rtt->stats;
+}
+
+void swd_rtt_close(swd_rtt_t *rtt)
+{
+    if (rtt == NULL) {
+        return;
+    }
+
+    swd_rtt_stop(rtt);
+    if (rtt->ctx != NULL) {
+        swd_ctx_release(rtt->ctx);
+    }
+
+    for (uint32_t i = 0; i < CONFIG_ESP_SWD_RTT_MAX_CHANNELS; i++) {
+        if (rtt->up[i].stream != NULL) {
+            vStreamBufferDelete(rtt->up[i].stream);
+        }
+        if (rtt->down[i].stream != NULL) {
+            vStreamBufferDelete(rtt->down[i].stream);
+        }
+    }
+
+    if (rtt->stopped != NULL) {
+        vSemaphoreDelete(rtt->stopped);
+    }
+    free(rtt->bounce);
+    free(rtt);
+}
+
+// Drop the cached control block address of a firmware build
+uint8_t swd_rtt_forget(uint32_t build_tag)
+{
+    nvs_handle_t nvs;
+    char key[16];
+
+    rtt_cache_key(build_tag, key);
+    if (nvs_open(RTT_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return 0;
+    }
+
+    nvs_erase_key(nvs, key);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+    return 1;
+}
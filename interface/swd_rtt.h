@@ -0,0 +1,52 @@
+/**
+ * @file    swd_rtt.h
+ * @brief   SEGGER RTT host over swd_read_memory()/swd_write_memory()
+ *
+ * The _SEGGER_RTT control block is found by scanning target RAM for its ID
+ * string, one word per aligned address. With a non-zero build tag the address
+ * is kept in NVS, so later sessions with the same firmware only verify it.
+ *
+ * Every poll reads the WrOff/RdOff pairs of all up-buffers in one
+ * auto-increment block, then only the new bytes of the channels that have any,
+ * and moves them into per-channel stream buffers on the probe. Data queued with
+ * swd_rtt_write() is copied into the target's down-buffers on the same pass.
+ * The poll task halves its interval while data flows and doubles it while the
+ * target is idle, between ESP_SWD_RTT_POLL_MIN_US and ESP_SWD_RTT_POLL_MAX_US.
+ * It blocks between polls, so it never waits less than one FreeRTOS tick.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct swd_rtt swd_rtt_t;
+
+typedef struct {
+    uint32_t polls;
+    uint32_t bytes_up;      // Target to probe
+    uint32_t bytes_down;    // Probe to target
+    uint32_t stalls;        // Polls that left data on the target because a stream buffer was full
+    uint32_t interval_us;   // Current poll interval of the poll task
+} swd_rtt_stats_t;
+
+swd_rtt_t *swd_rtt_open(uint32_t ram_start, uint32_t ram_size, uint32_t build_tag);
+uint32_t swd_rtt_address(const swd_rtt_t *rtt);
+uint8_t swd_rtt_up_count(const swd_rtt_t *rtt);
+uint8_t swd_rtt_down_count(const swd_rtt_t *rtt);
+uint8_t swd_rtt_poll(swd_rtt_t *rtt);
+uint8_t swd_rtt_start(swd_rtt_t *rtt);
+void swd_rtt_stop(swd_rtt_t *rtt);
+uint32_t swd_rtt_read(swd_rtt_t *rtt, uint8_t channel, uint8_t *dst, uint32_t len, TickType_t timeout);
+uint32_t swd_rtt_write(swd_rtt_t *rtt, uint8_t channel, const uint8_t *data, uint32_t len, TickType_t timeout);
+void swd_rtt_get_stats(const swd_rtt_t *rtt, swd_rtt_stats_t *stats);
+void swd_rtt_close(swd_rtt_t *rtt);
+uint8_t swd_rtt_forget(uint32_t build_tag);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,409 @@
+/**
+ * @file    swd_sampler.c
+ * @brief   Implementation of swd_sampler.h
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
+
+#include "swd_sampler.h"
+#include "swd_host.h"
+
+#include <esp_log.h>
+#define SMP_TAG "swd_sampler"
+
+#ifndef CONFIG_ESP_SWD_SAMPLER_TASK_STACK
+#define CONFIG_ESP_SWD_SAMPLER_TASK_STACK 3072
+#endif
+
+#ifndef CONFIG_ESP_SWD_SAMPLER_TASK_PRIO
+#define CONFIG_ESP_SWD_SAMPLER_TASK_PRIO 20
+#endif
+
+#ifndef CONFIG_ESP_SWD_SAMPLER_TASK_CORE
+#define CONFIG_ESP_SWD_SAMPLER_TASK_CORE -1
+#endif
+
+// Items at most this many bytes apart share a block: reading the gap costs
+// less than the TAR write, first posted read and RDBUFF of a new block
+#define SMP_MERGE_GAP       8
+
+// Shortest period esp_timer_start_periodic() accepts
+#define SMP_MIN_PERIOD_US   50
+
+typedef struct {
+    uint32_t addr;          // Word aligned
+    uint32_t size;          // Whole words
+    uint32_t ofs;           // Position in the scratch buffer
+} SMP_BLOCK;
+
+typedef struct {
+    uint32_t addr;
+    uint32_t ofs;           // Position of the value in the scratch buffer
+    uint8_t width;
+} SMP_ITEM;
+
+struct swd_sampler {
+    swd_ctx_t *ctx;
+    uint32_t count;
+    SMP_ITEM *items;        // In the caller's order
+    uint32_t block_count;
+    SMP_BLOCK *blocks;
+    uint8_t *scratch;
+    uint32_t rec_size;      // int64_t timestamp followed by count values
+    uint8_t *rec;           // Built by the sampler task
+    uint8_t *rx;            // Used by swd_sampler_read()
+    QueueHandle_t queue;
+    esp_timer_handle_t timer;
+    TaskHandle_t task;
+    SemaphoreHandle_t stopped;
+    volatile bool stop;
+    portMUX_TYPE lock;      // Guards armed and busy against the timer callback
+    bool armed;
+    volatile uint32_t busy; // Timer callbacks past the armed check
+    uint32_t period_us;
+    int64_t t0;
+    uint64_t tick;
+    uint64_t jitter_sum;
+    swd_sampler_stats_t stats;
+};
+
+// Sort by address and merge neighbouring items into word aligned blocks
+static uint8_t smp_build_blocks(swd_sampler_t *smp)
+{
+    uint32_t *order = malloc(smp->count * sizeof(uint32_t));
+    uint32_t *block_of = malloc(smp->count * sizeof(uint32_t));
+    uint32_t scratch_size = 0;
+    uint32_t start, end;
+
+    smp->blocks = malloc(smp->count * sizeof(SMP_BLOCK));
+    if (order == NULL || block_of == NULL || smp->blocks == NULL) {
+        free(order);
+        free(block_of);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < smp->count; i++) {
+        uint32_t j = i;
+
+        while (j > 0 && smp->items[order[j - 1]].addr > smp->items[i].addr) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    smp->block_count = 0;
+    for (uint32_t i = 0; i < smp->count; i++) {
+        SMP_ITEM *item = &smp->items[order[i]];
+        SMP_BLOCK *cur = (smp->block_count > 0) ? &smp->blocks[smp->block_count - 1] : NULL;
+
+        start = item->addr & ~0x3UL;
+        end = (item->addr + item->width + 3) & ~0x3UL;
+
+        if (cur != NULL && start <= cur->addr + cur->size + SMP_MERGE_GAP) {
+            if (end > cur->addr + cur->size) {
+                cur->size = end - cur->addr;
+            }
+        } else {
+            cur = &smp->blocks[smp->block_count++];
+            cur->addr = start;
+            cur->size = end - start;
+        }
+        block_of[order[i]] = smp->block_count - 1;
+    }
+
+    for (uint32_t i = 0; i < smp->block_count; i++) {
+        smp->blocks[i].ofs = scratch_size;
+        scratch_size += smp->blocks[i].size;
+    }
+
+    for (uint32_t i = 0; i < smp->count; i++) {
+        SMP_BLOCK *block = &smp->blocks[block_of[i]];
+        smp->items[i].ofs = block->ofs + (smp->items[i].addr - block->addr);
+    }
+
+    free(order);
+    free(block_of);
+
+    smp->scratch = malloc(scratch_size);
+    return smp->scratch != NULL;
+}
+
+// Read every block and fill the record, values in the caller's item order
+static uint8_t smp_sample(swd_sampler_t *smp, int64_t now)
+{
+    uint32_t *values = (uint32_t *)(smp->rec + sizeof(int64_t));
+    uint8_t ok = 1;
+
+    // One record is read without other tasks on the context getting in between
+    swd_ctx_lock(smp->ctx);
+    for (uint32_t i = 0; i < smp->block_count && ok; i++) {
+        SMP_BLOCK *block = &smp->blocks[i];
+
+        ok = swd_read_memory(block->addr, smp->scratch + block->ofs, block->size);
+    }
+    swd_ctx_unlock(smp->ctx);
+
+    if (!ok) {
+        return 0;
+    }
+
+    memcpy(smp->rec, &now, sizeof(now));
+    for (uint32_t i = 0; i < smp->count; i++) {
+        SMP_ITEM *item = &smp->items[i];
+        uint32_t val = 0;
+
+        memcpy(&val, smp->scratch + item->ofs, item->width);
+        values[i] = val;
+    }
+
+    return 1;
+}
+
+// esp_timer_stop() doesn't wait for a callback already running on the other core,
+// swd_sampler_stop() waits for busy to drop before the task goes away
+static void smp_timer_cb(void *arg)
+{
+    swd_sampler_t *smp = arg;
+
+    portENTER_CRITICAL(&smp->lock);
+    if (!smp->armed) {
+        portEXIT_CRITICAL(&smp->lock);
+        return;
+    }
+    smp->busy++;
+    portEXIT_CRITICAL(&smp->lock);
+
+    xTaskNotifyGive(smp->task);
+
+    portENTER_CRITICAL(&smp->lock);
+    smp->busy--;
+    portEXIT_CRITICAL(&smp->lock);
+}
+
+static void smp_worker(void *arg)
+{
+    swd_sampler_t *smp = arg;
+    uint32_t n;
+    int64_t now, dev;
+
+    swd_ctx_bind(smp->ctx);
+
+    while (true) {
+        // More than one pending notification means periods went by unsampled
+        n = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (smp->stop) {
+            break;
+        }
+
+        now = esp_timer_get_time();
+        smp->tick += n;
+        smp->stats.missed += n - 1;
+
+        dev = now - (smp->t0 + (int64_t)smp->tick * smp->period_us);
+        if (dev < 0) {
+            dev = -dev;
+        }
+
+        if (!smp_sample(smp, now)) {
+            smp->stats.errors++;
+            continue;
+        }
+
+        smp->stats.samples++;
+        smp->jitter_sum += dev;
+        if (dev > smp->stats.jitter_max_us) {
+            smp->stats.jitter_max_us = dev;
+        }
+        smp->stats.jitter_avg_us = smp->jitter_sum / smp->stats.samples;
+        smp->stats.rate_hz = (now > smp->t0) ? (uint32_t)((uint64_t)smp->stats.samples * 1000000 / (now - smp->t0)) : 0;
+
+        if (xQueueSend(smp->queue, smp->rec, 0) != pdTRUE) {
+            smp->stats.overruns++;
+        }
+    }
+
+    xSemaphoreGive(smp->stopped);
+    vTaskDelete(NULL);
+}
+
+// records is the number of samples buffered until swd_sampler_read() picks them up
+swd_sampler_t *swd_sampler_create(const swd_watch_item_t *items, uint32_t count, uint32_t records)
+{
+    swd_sampler_t *smp;
+
+    if (count == 0 || records == 0) {
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (items[i].width != 1 && items[i].width != 2 && items[i].width != 4) {
+            ESP_LOGE(SMP_TAG, "Invalid width %u at 0x%08lx", items[i].width, items[i].addr);
+            return NULL;
+        }
+    }
+
+    smp = calloc(1, sizeof(*smp));
+    if (smp == NULL) {
+        ESP_LOGE(SMP_TAG, "Out of memory");
+        return NULL;
+    }
+
+    portMUX_INITIALIZE(&smp->lock);
+    smp->count = count;
+    smp->rec_size = sizeof(int64_t) + count * sizeof(uint32_t);
+    smp->items = malloc(count * sizeof(SMP_ITEM));
+    smp->rec = malloc(smp->rec_size);
+    smp->rx = malloc(smp->rec_size);
+    smp->queue = xQueueCreate(records, smp->rec_size);
+    smp->stopped = xSemaphoreCreateBinary();
+
+    if (smp->items == NULL || smp->rec == NULL || smp->rx == NULL || smp->queue == NULL || smp->stopped == NULL) {
+        ESP_LOGE(SMP_TAG, "Out of memory");
+        swd_sampler_destroy(smp);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        smp->items[i].addr = items[i].addr;
+        smp->items[i].width = items[i].width;
+    }
+
+    if (!smp_build_blocks(smp)) {
+        ESP_LOGE(SMP_TAG, "Out of memory");
+        swd_sampler_destroy(smp);
+        return NULL;
+    }
+
+    smp->stats.blocks = smp->block_count;
+    return smp;
+}
+
+// The sampler task takes over the calling task's context until swd_sampler_stop()
+uint8_t swd_sampler_start(swd_sampler_t *smp, uint32_t rate_hz)
+{
+    BaseType_t core = CONFIG_ESP_SWD_SAMPLER_TASK_CORE < 0 ? tskNO_AFFINITY : CONFIG_ESP_SWD_SAMPLER_TASK_CORE;
+    esp_timer_create_args_t args = {
+        .callback = smp_timer_cb,
+        .arg = smp,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "swd_sampler",
+    };
+
+    if (smp->task != NULL || rate_hz == 0) {
+        return 0;
+    }
+
+    if (rate_hz > 1000000 / SMP_MIN_PERIOD_US) {
+        ESP_LOGE(SMP_TAG, "Rate %lu Hz above the esp_timer limit of %u Hz", rate_hz, 1000000 / SMP_MIN_PERIOD_US);
+        return 0;
+    }
+
+    smp->ctx = swd_ctx_current();
+    swd_ctx_acquire(smp->ctx);
+    smp->period_us = 1000000 / rate_hz;
+    smp->stop = false;
+    smp->tick = 0;
+    smp->jitter_sum = 0;
+    memset(&smp->stats, 0, sizeof(smp->stats));
+    smp->stats.blocks = smp->block_count;
+
+    if (smp->timer == NULL && esp_timer_create(&args, &smp->timer) != ESP_OK) {
+        ESP_LOGE(SMP_TAG, "Failed to create timer");
+        swd_ctx_release(smp->ctx);
+        return 0;
+    }
+
+    if (xTaskCreatePinnedToCore(smp_worker, "swd_sampler", CONFIG_ESP_SWD_SAMPLER_TASK_STACK, smp,
+                                CONFIG_ESP_SWD_SAMPLER_TASK_PRIO, &smp->task, core) != pdPASS) {
+        ESP_LOGE(SMP_TAG, "Failed to create sampler task");
+        smp->task = NULL;
+        swd_ctx_release(smp->ctx);
+        return 0;
+    }
+
+    portENTER_CRITICAL(&smp->lock);
+    smp->armed = true;
+    portEXIT_CRITICAL(&smp->lock);
+
+    smp->t0 = esp_timer_get_time();
+    if (esp_timer_start_periodic(smp->timer, smp->period_us) != ESP_OK) {
+        ESP_LOGE(SMP_TAG, "Failed to start timer");
+        swd_sampler_stop(smp);
+        return 0;
+    }
+
+    return 1;
+}
+
+void swd_sampler_stop(swd_sampler_t *smp)
+{
+    if (smp->task == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&smp->lock);
+    smp->armed = false;
+    portEXIT_CRITICAL(&smp->lock);
+
+    esp_timer_stop(smp->timer);
+    while (smp->busy != 0) {
+        vTaskDelay(1);
+    }
+
+    smp->stop = true;
+    xTaskNotifyGive(smp->task);
+    xSemaphoreTake(smp->stopped, portMAX_DELAY);
+    smp->task = NULL;
+    swd_ctx_release(smp->ctx);
+}
+
+// Take the oldest record, values has one entry per watch item in creation order
+uint8_t swd_sampler_read(swd_sampler_t *smp, int64_t *timestamp_us, uint32_t *values, TickType_t timeout)
+{
+    if (xQueueReceive(smp->queue, smp->rx, timeout) != pdTRUE) {
+        return 0;
+    }
+
+    memcpy(timestamp_us, smp->rx, sizeof(int64_t));
+    memcpy(values, smp->rx + sizeof(int64_t), smp->count * sizeof(uint32_t));
+    return 1;
+}
+
+void swd_sampler_get_stats(const swd_sampler_t *smp, swd_sampler_stats_t *stats)
+{
+    *stats = smp->stats;
+}
+
+void swd_sampler_destroy(swd_sampler_t *smp)
+{
+    if (smp == NULL) {
+        return;
+    }
+
+    swd_sampler_stop(smp);
+
+    if (smp->timer != NULL) {
+        esp_timer_delete(smp->timer);
+    }
+    if (smp->queue != NULL) {
+        vQueueDelete(smp->queue);
+    }
+    if (smp->stopped != NULL) {
+        vSemaphoreDelete(smp->stopped);
+    }
+    free(smp->items);
+    free(smp->blocks);
+    free(smp->scratch);
+    free(smp->rec);
+    free(smp->rx);
+    free(smp);
+}
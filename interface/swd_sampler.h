@@ -0,0 +1,50 @@
+/**
+ * @file    swd_sampler.h
+ * @brief   Fixed-rate sampling of target variables while the target runs
+ *
+ * The watch list is sorted by address once, and items that are close enough
+ * are merged into word aligned blocks read with one auto-increment access each.
+ * A periodic esp_timer wakes a high priority sampler task which reads all blocks,
+ * timestamps the record and queues it into a queue allocated up front. A full
+ * queue drops the new record and counts an overrun. Timer periods that passed
+ * while a sample was still being read are counted as missed. Rates above
+ * 20 kHz, the shortest esp_timer period of 50 us, are rejected.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct swd_sampler swd_sampler_t;
+
+typedef struct {
+    uint32_t addr;
+    uint8_t width;          // 1, 2 or 4 bytes, values are zero extended
+} swd_watch_item_t;
+
+typedef struct {
+    uint32_t samples;
+    uint32_t overruns;      // Records dropped because the queue was full
+    uint32_t missed;        // Timer periods skipped because a sample took too long
+    uint32_t errors;        // Failed block reads
+    uint32_t blocks;        // Reads per sample after merging
+    uint32_t rate_hz;       // Achieved sample rate
+    uint32_t jitter_max_us; // Largest distance of a sample from its schedule
+    uint32_t jitter_avg_us;
+} swd_sampler_stats_t;
+
+swd_sampler_t *swd_sampler_create(const swd_watch_item_t *items, uint32_t count, uint32_t records);
+uint8_t swd_sampler_start(swd_sampler_t *smp, uint32_t rate_hz);
+void swd_sampler_stop(swd_sampler_t *smp);
+uint8_t swd_sampler_read(swd_sampler_t *smp, int64_t *timestamp_us, uint32_t *values, TickType_t timeout);
+void swd_sampler_get_stats(const swd_sampler_t *smp, swd_sampler_stats_t *stats);
+void swd_sampler_destroy(swd_sampler_t *smp);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,514 @@
+/**
+ * @file    freertos_posix.c
+ * @brief   The FreeRTOS calls used by the units under test, on top of POSIX threads
+ *
+ * Tasks are threads with a notification counter, timeouts are converted from
+ * ticks at configTICK_RATE_HZ. Every ulTaskNotifyTake() timeout is recorded so
+ * the test can check that no task asked to block for less than one tick.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "freertos/stream_buffer.h"
+#include "freertos_posix.h"
+
+struct host_task {
+    pthread_t thread;
+    TaskFunction_t fn;
+    void *arg;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t notify;
+};
+
+struct host_sem {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int count;
+};
+
+struct host_stream {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t size;
+    size_t head;
+    size_t used;
+    uint8_t data[];
+};
+
+struct host_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t length;
+    size_t item_size;
+    size_t head;
+    size_t used;
+    uint8_t data[];
+};
+
+struct host_events {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    EventBits_t bits;
+};
+
+static __thread struct host_task *current_task = NULL;
+static struct host_task main_task = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_mutex_t wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static TickType_t min_wait = portMAX_DELAY;
+static uint32_t zero_waits = 0;
+static uint32_t tasks_created = 0;
+
+static void deadline(TickType_t ticks, struct timespec *ts)
+{
+    uint64_t ns = (uint64_t)ticks * (1000000000ULL / configTICK_RATE_HZ);
+
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ns / 1000000000ULL;
+    ts->tv_nsec += ns % 1000000000ULL;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+// Wait on cond until pred() holds or ticks passed, lock held by the caller
+static int wait_for(pthread_cond_t *cond, pthread_mutex_t *lock, TickType_t ticks, int (*pred)(void *), void *arg)
+{
+    struct timespec ts;
+
+    if (ticks == portMAX_DELAY) {
+        while (!pred(arg)) {
+            pthread_cond_wait(cond, lock);
+        }
+        return 1;
+    }
+
+    deadline(ticks, &ts);
+    while (!pred(arg)) {
+        if (pthread_cond_timedwait(cond, lock, &ts) == ETIMEDOUT) {
+            return pred(arg);
+        }
+    }
+    return 1;
+}
+
+static void *task_entry(void *arg)
+{
+    struct host_task *task = arg;
+
+    current_task = task;
+    task->fn(task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *handle)
+{
+    struct host_task *task = calloc(1, sizeof(*task));
+
+    if (task == NULL) {
+        return pdFAIL;
+    }
+
+    task->fn = fn;
+    task->arg = arg;
+    pthread_mutex_init(&task->lock, NULL);
+    pthread_cond_init(&task->cond, NULL);
+    *handle = task;
+
+    if (pthread_create(&task->thread, NULL, task_entry, task) != 0) {
+        free(task);
+        return pdFAIL;
+    }
+
+    pthread_detach(task->thread);
+    __atomic_add_fetch(&tasks_created, 1, __ATOMIC_SEQ_CST);
+    return pdPASS;
+}
+
+// Only a task deleting itself is supported, the handle stays allocated
+// Threads go wherever the host scheduler puts them
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *handle, BaseType_t core)
+{
+    TaskHandle_t task;
+
+    return xTaskCreate(fn, name, stack, arg, prio, (handle != NULL) ? handle : &task);
+}
+
+// Only a task deleting itself is supported, the handle stays allocated
+void vTaskDelete(TaskHandle_t task)
+{
+    (void)task;
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec ts = {
+        .tv_sec = ticks / configTICK_RATE_HZ,
+        .tv_nsec = (long)(ticks % configTICK_RATE_HZ) * (1000000000L / configTICK_RATE_HZ),
+    };
+
+    nanosleep(&ts, NULL);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return (current_task != NULL) ? current_task : &main_task;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->lock);
+    task->notify++;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+static int notified(void *arg)
+{
+    return ((struct host_task *)arg)->notify != 0;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    struct host_task *task = xTaskGetCurrentTaskHandle();
+    uint32_t val;
+
+    pthread_mutex_lock(&wait_lock);
+    if (ticks < min_wait) {
+        min_wait = ticks;
+    }
+    if (ticks == 0) {
+        zero_waits++;
+    }
+    pthread_mutex_unlock(&wait_lock);
+
+    pthread_mutex_lock(&task->lock);
+    wait_for(&task->cond, &task->lock, ticks, notified, task);
+    val = task->notify;
+    if (val != 0) {
+        task->notify = clear ? 0 : val - 1;
+    }
+    pthread_mutex_unlock(&task->lock);
+
+    return val;
+}
+
+void host_wait_stats(TickType_t *min_ticks, uint32_t *zero)
+{
+    pthread_mutex_lock(&wait_lock);
+    *min_ticks = min_wait;
+    *zero = zero_waits;
+    min_wait = portMAX_DELAY;
+    zero_waits = 0;
+    pthread_mutex_unlock(&wait_lock);
+}
+
+uint32_t host_tasks_created(void)
+{
+    return __atomic_load_n(&tasks_created, __ATOMIC_SEQ_CST);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    struct host_sem *sem = calloc(1, sizeof(*sem));
+
+    if (sem != NULL) {
+        pthread_mutex_init(&sem->lock, NULL);
+        pthread_cond_init(&sem->cond, NULL);
+    }
+    return sem;
+}
+
+// Not recursive and without priority inheritance, enough for mutual exclusion
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buf)
+{
+    SemaphoreHandle_t sem = xSemaphoreCreateBinary();
+
+    (void)buf;
+    if (sem != NULL) {
+        sem->count = 1;
+    }
+    return sem;
+}
+
+static int sem_given(void *arg)
+{
+    return ((struct host_sem *)arg)->count != 0;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    BaseType_t ret;
+
+    pthread_mutex_lock(&sem->lock);
+    ret = wait_for(&sem->cond, &sem->lock, ticks, sem_given, sem) ? pdTRUE : pdFALSE;
+    if (ret) {
+        sem->count = 0;
+    }
+    pthread_mutex_unlock(&sem->lock);
+
+    return ret;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    sem->count = 1;
+    pthread_cond_signal(&sem->cond);
+    pthread_mutex_unlock(&sem->lock);
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    pthread_mutex_destroy(&sem->lock);
+    pthread_cond_destroy(&sem->cond);
+    free(sem);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct host_queue *queue = calloc(1, sizeof(*queue) + (size_t)length * item_size);
+
+    if (queue != NULL) {
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->cond, NULL);
+        queue->length = length;
+        queue->item_size = item_size;
+    }
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->cond);
+    free(queue);
+}
+
+static int queue_has_space(void *arg)
+{
+    struct host_queue *queue = arg;
+    return queue->used < queue->length;
+}
+
+static int queue_has_item(void *arg)
+{
+    return ((struct host_queue *)arg)->used != 0;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+    BaseType_t ret = pdFALSE;
+
+    pthread_mutex_lock(&queue->lock);
+    if (wait_for(&queue->cond, &queue->lock, ticks, queue_has_space, queue)) {
+        memcpy(&queue->data[((queue->head + queue->used) % queue->length) * queue->item_size], item, queue->item_size);
+        queue->used++;
+        pthread_cond_broadcast(&queue->cond);
+        ret = pdTRUE;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return ret;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+    BaseType_t ret = pdFALSE;
+
+    pthread_mutex_lock(&queue->lock);
+    if (wait_for(&queue->cond, &queue->lock, ticks, queue_has_item, queue)) {
+        memcpy(item, &queue->data[queue->head * queue->item_size], queue->item_size);
+        queue->head = (queue->head + 1) % queue->length;
+        queue->used--;
+        pthread_cond_broadcast(&queue->cond);
+        ret = pdTRUE;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return ret;
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    struct host_events *group = calloc(1, sizeof(*group));
+
+    if (group != NULL) {
+        pthread_mutex_init(&group->lock, NULL);
+        pthread_cond_init(&group->cond, NULL);
+    }
+    return group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group)
+{
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->cond);
+    free(group);
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    EventBits_t ret;
+
+    pthread_mutex_lock(&group->lock);
+    group->bits |= bits;
+    ret = group->bits;
+    pthread_cond_broadcast(&group->cond);
+    pthread_mutex_unlock(&group->lock);
+
+    return ret;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    EventBits_t ret;
+
+    pthread_mutex_lock(&group->lock);
+    ret = group->bits;
+    group->bits &= ~bits;
+    pthread_mutex_unlock(&group->lock);
+
+    return ret;
+}
+
+struct events_wait {
+    struct host_events *group;
+    EventBits_t bits;
+    BaseType_t all;
+};
+
+static int events_set(void *arg)
+{
+    struct events_wait *w = arg;
+    EventBits_t set = w->group->bits & w->bits;
+
+    return w->all ? (set == w->bits) : (set != 0);
+}
+
+// Returns the bits at the time the wait ended, like FreeRTOS
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear, BaseType_t all, TickType_t ticks)
+{
+    struct events_wait w = {group, bits, all};
+    EventBits_t ret;
+
+    pthread_mutex_lock(&group->lock);
+    if (wait_for(&group->cond, &group->lock, ticks, events_set, &w) && clear) {
+        ret = group->bits;
+        group->bits &= ~bits;
+    } else {
+        ret = group->bits;
+    }
+    pthread_mutex_unlock(&group->lock);
+
+    return ret;
+}
+
+StreamBufferHandle_t xStreamBufferCreate(size_t size, size_t trigger)
+{
+    struct host_stream *sb = calloc(1, sizeof(*sb) + size);
+
+    (void)trigger;
+    if (sb != NULL) {
+        pthread_mutex_init(&sb->lock, NULL);
+        pthread_cond_init(&sb->cond, NULL);
+        sb->size = size;
+    }
+    return sb;
+}
+
+void vStreamBufferDelete(StreamBufferHandle_t sb)
+{
+    pthread_mutex_destroy(&sb->lock);
+    pthread_cond_destroy(&sb->cond);
+    free(sb);
+}
+
+static int stream_has_space(void *arg)
+{
+    struct host_stream *sb = arg;
+    return sb->used < sb->size;
+}
+
+static int stream_has_data(void *arg)
+{
+    return ((struct host_stream *)arg)->used != 0;
+}
+
+// Like FreeRTOS, copies what fits once there is room for anything
+size_t xStreamBufferSend(StreamBufferHandle_t sb, const void *data, size_t len, TickType_t ticks)
+{
+    size_t n;
+
+    pthread_mutex_lock(&sb->lock);
+    wait_for(&sb->cond, &sb->lock, ticks, stream_has_space, sb);
+
+    n = sb->size - sb->used;
+    if (n > len) {
+        n = len;
+    }
+    for (size_t i = 0; i < n; i++) {
+        sb->data[(sb->head + sb->used + i) % sb->size] = ((const uint8_t *)data)[i];
+    }
+    sb->used += n;
+
+    pthread_cond_broadcast(&sb->cond);
+    pthread_mutex_unlock(&sb->lock);
+    return n;
+}
+
+size_t xStreamBufferReceive(StreamBufferHandle_t sb, void *data, size_t len, TickType_t ticks)
+{
+    size_t n;
+
+    pthread_mutex_lock(&sb->lock);
+    wait_for(&sb->cond, &sb->lock, ticks, stream_has_data, sb);
+
+    n = (sb->used < len) ? sb->used : len;
+    for (size_t i = 0; i < n; i++) {
+        ((uint8_t *)data)[i] = sb->data[(sb->head + i) % sb->size];
+    }
+    sb->head = (sb->head + n) % sb->size;
+    sb->used -= n;
+
+    pthread_cond_broadcast(&sb->cond);
+    pthread_mutex_unlock(&sb->lock);
+    return n;
+}
+
+size_t xStreamBufferBytesAvailable(StreamBufferHandle_t sb)
+{
+    size_t n;
+
+    pthread_mutex_lock(&sb->lock);
+    n = sb->used;
+    pthread_mutex_unlock(&sb->lock);
+    return n;
+}
+
+size_t xStreamBufferSpacesAvailable(StreamBufferHandle_t sb)
+{
+    size_t n;
+
+    pthread_mutex_lock(&sb->lock);
+    n = sb->size - sb->used;
+    pthread_mutex_unlock(&sb->lock);
+    return n;
+}
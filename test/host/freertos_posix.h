@@ -0,0 +1,15 @@
+/**
+ * @file    freertos_posix.h
+ * @brief   Test hooks of freertos_posix.c
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+
+// Shortest ulTaskNotifyTake() timeout and number of zero timeouts since the last call
+void host_wait_stats(TickType_t *min_ticks, uint32_t *zero);
+
+// Number of successful xTaskCreate() calls so far
+uint32_t host_tasks_created(void);
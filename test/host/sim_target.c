@@ -0,0 +1,414 @@
+/**
+ * @file    sim_target.c
+ * @brief   Implementation of sim_target.h, plus the swd_host.h and NVS calls of the units under test
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "swd_host.h"
+#include "nvs.h"
+#include "sim_target.h"
+
+#define SIM_NVS_ENTRIES 8
+
+// SEGGER_RTT_CB and SEGGER_RTT_BUFFER layout
+#define CB_HDR_SIZE     24
+#define DESC_SIZE       24
+#define DESC_BUF        4
+#define DESC_SIZE_OFS   8
+#define DESC_WROFF      12
+#define DESC_RDOFF      16
+
+struct swd_ctx {
+    int users;
+    volatile uint8_t abort;
+};
+
+static struct swd_ctx sim_ctx;
+static uint8_t ram[SIM_RAM_SIZE];
+static pthread_mutex_t ram_lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_stats_t stats;
+static uint8_t fail_reads;
+static uint32_t latency_us;
+static uint32_t cb_addr, up_count;
+
+static struct {
+    char key[16];
+    uint32_t val;
+} nvs[SIM_NVS_ENTRIES];
+
+static pthread_t producer;
+static uint32_t producer_ch, producer_len, producer_seed;
+
+static uint8_t *ram_ptr(uint32_t addr, uint32_t len)
+{
+    if (addr < SIM_RAM_START || addr - SIM_RAM_START > SIM_RAM_SIZE || len > SIM_RAM_SIZE - (addr - SIM_RAM_START)) {
+        return NULL;
+    }
+
+    return &ram[addr - SIM_RAM_START];
+}
+
+void sim_reset(void)
+{
+    pthread_mutex_lock(&ram_lock);
+    memset(ram, 0, sizeof(ram));
+    memset(&stats, 0, sizeof(stats));
+    memset(nvs, 0, sizeof(nvs));
+    fail_reads = 0;
+    latency_us = 0;
+    pthread_mutex_unlock(&ram_lock);
+}
+
+void sim_fill(uint32_t addr, const void *data, uint32_t len)
+{
+    pthread_mutex_lock(&ram_lock);
+    memcpy(ram_ptr(addr, len), data, len);
+    pthread_mutex_unlock(&ram_lock);
+}
+
+void sim_put32(uint32_t addr, uint32_t val)
+{
+    sim_fill(addr, &val, 4);
+}
+
+uint32_t sim_get32(uint32_t addr)
+{
+    uint32_t val;
+
+    pthread_mutex_lock(&ram_lock);
+    memcpy(&val, ram_ptr(addr, 4), 4);
+    pthread_mutex_unlock(&ram_lock);
+    return val;
+}
+
+void sim_stats(sim_stats_t *out)
+{
+    pthread_mutex_lock(&ram_lock);
+    *out = stats;
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&ram_lock);
+}
+
+void sim_fail_reads(uint8_t fail)
+{
+    pthread_mutex_lock(&ram_lock);
+    fail_reads = fail;
+    pthread_mutex_unlock(&ram_lock);
+}
+
+void sim_latency(uint32_t us)
+{
+    pthread_mutex_lock(&ram_lock);
+    latency_us = us;
+    pthread_mutex_unlock(&ram_lock);
+}
+
+// Time on the wire, spent outside the RAM lock so the target keeps running
+static void sim_wire_delay(void)
+{
+    uint32_t us;
+    struct timespec ts;
+
+    pthread_mutex_lock(&ram_lock);
+    us = latency_us;
+    pthread_mutex_unlock(&ram_lock);
+
+    if (us != 0) {
+        ts.tv_sec = us / 1000000;
+        ts.tv_nsec = (long)(us % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+}
+
+void sim_rtt_setup(uint32_t cb, uint32_t up, const uint32_t *up_size, uint32_t down, const uint32_t *down_size, uint32_t buf_area)
+{
+    char id[16] = "SEGGER RTT";
+    uint32_t desc = cb + CB_HDR_SIZE;
+
+    cb_addr = cb;
+    up_count = up;
+    sim_fill(cb, id, sizeof(id));
+    sim_put32(cb + 16, up);
+    sim_put32(cb + 20, down);
+
+    for (uint32_t i = 0; i < up + down; i++, desc += DESC_SIZE) {
+        uint32_t size = (i < up) ? up_size[i] : down_size[i - up];
+
+        sim_put32(desc + DESC_BUF, (size != 0) ? buf_area : 0);
+        sim_put32(desc + DESC_SIZE_OFS, size);
+        sim_put32(desc + DESC_WROFF, 0);
+        sim_put32(desc + DESC_RDOFF, 0);
+        buf_area += (size + 3) & ~3UL;
+    }
+}
+
+uint32_t sim_up_desc(uint32_t ch)
+{
+    return cb_addr + CB_HDR_SIZE + ch * DESC_SIZE;
+}
+
+uint32_t sim_down_desc(uint32_t ch)
+{
+    return cb_addr + CB_HDR_SIZE + (up_count + ch) * DESC_SIZE;
+}
+
+// SEGGER_RTT_WriteNoLock() in NO_BLOCK_TRIM mode
+uint32_t sim_up_write(uint32_t ch, const uint8_t *data, uint32_t len)
+{
+    uint32_t desc = sim_up_desc(ch);
+    uint32_t buf, size, wr, rd, n = 0;
+    uint8_t *mem;
+
+    pthread_mutex_lock(&ram_lock);
+    mem = ram_ptr(desc, DESC_SIZE);
+    memcpy(&buf, mem + DESC_BUF, 4);
+    memcpy(&size, mem + DESC_SIZE_OFS, 4);
+    memcpy(&wr, mem + DESC_WROFF, 4);
+    memcpy(&rd, mem + DESC_RDOFF, 4);
+
+    while (n < len && (wr + 1) % size != rd) {
+        *ram_ptr(buf + wr, 1) = data[n++];
+        wr = (wr + 1) % size;
+    }
+
+    memcpy(mem + DESC_WROFF, &wr, 4);
+    pthread_mutex_unlock(&ram_lock);
+    return n;
+}
+
+// SEGGER_RTT_Read()
+uint32_t sim_down_read(uint32_t ch, uint8_t *dst, uint32_t len)
+{
+    uint32_t desc = sim_down_desc(ch);
+    uint32_t buf, size, wr, rd, n = 0;
+    uint8_t *mem;
+
+    pthread_mutex_lock(&ram_lock);
+    mem = ram_ptr(desc, DESC_SIZE);
+    memcpy(&buf, mem + DESC_BUF, 4);
+    memcpy(&size, mem + DESC_SIZE_OFS, 4);
+    memcpy(&wr, mem + DESC_WROFF, 4);
+    memcpy(&rd, mem + DESC_RDOFF, 4);
+
+    while (n < len && rd != wr) {
+        dst[n++] = *ram_ptr(buf + rd, 1);
+        rd = (rd + 1) % size;
+    }
+
+    memcpy(mem + DESC_RDOFF, &rd, 4);
+    pthread_mutex_unlock(&ram_lock);
+    return n;
+}
+
+uint8_t sim_pattern(uint32_t seed, uint32_t i)
+{
+    uint32_t x = (seed ^ i) * 2654435761u;
+
+    return (uint8_t)(x >> 24);
+}
+
+static void *producer_main(void *arg)
+{
+    struct timespec idle = {.tv_nsec = 50000};
+    uint8_t chunk[37];
+    uint32_t done = 0, n;
+
+    (void)arg;
+    while (done < producer_len) {
+        // Odd sized writes, so they straddle the buffer end at varying offsets
+        n = producer_len - done;
+        if (n > sizeof(chunk)) {
+            n = sizeof(chunk);
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            chunk[i] = sim_pattern(producer_seed, done + i);
+        }
+
+        n = sim_up_write(producer_ch, chunk, n);
+        done += n;
+        if (n == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+void sim_producer_start(uint32_t ch, uint32_t len, uint32_t seed)
+{
+    producer_ch = ch;
+    producer_len = len;
+    producer_seed = seed;
+    pthread_create(&producer, NULL, producer_main, NULL);
+}
+
+void sim_producer_join(void)
+{
+    pthread_join(producer, NULL);
+}
+
+uint32_t sim_nvs_entries(void)
+{
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < SIM_NVS_ENTRIES; i++) {
+        n += (nvs[i].key[0] != 0);
+    }
+    return n;
+}
+
+// Probe side, the subset of swd_host.h used by the units under test. An abort
+// requested through swd_ctx_set_abort() fails the transfer, like on the wire.
+
+uint8_t swd_read_memory(uint32_t address, uint8_t *data, uint32_t size)
+{
+    uint8_t *mem;
+
+    sim_wire_delay();
+    if (sim_ctx.abort) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&ram_lock);
+    mem = ram_ptr(address, size);
+    if (mem != NULL && !fail_reads) {
+        memcpy(data, mem, size);
+        stats.reads++;
+        stats.bytes_read += size;
+    }
+    pthread_mutex_unlock(&ram_lock);
+
+    return mem != NULL && !fail_reads;
+}
+
+uint8_t swd_write_memory(uint32_t address, uint8_t *data, uint32_t size)
+{
+    uint8_t *mem;
+
+    sim_wire_delay();
+    if (sim_ctx.abort) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&ram_lock);
+    mem = ram_ptr(address, size);
+    if (mem != NULL) {
+        memcpy(mem, data, size);
+        stats.writes++;
+    }
+    pthread_mutex_unlock(&ram_lock);
+
+    return mem != NULL;
+}
+
+uint8_t swd_write_word(uint32_t addr, uint32_t val)
+{
+    return swd_write_memory(addr, (uint8_t *)&val, 4);
+}
+
+uint8_t swd_clear_errors(void)
+{
+    return 1;
+}
+
+void swd_ctx_set_abort(swd_ctx_t *ctx, uint8_t abort)
+{
+    ctx->abort = abort;
+}
+
+swd_ctx_t *swd_ctx_current(void)
+{
+    return &sim_ctx;
+}
+
+swd_ctx_t *swd_ctx_bind(swd_ctx_t *ctx)
+{
+    return &sim_ctx;
+}
+
+void swd_ctx_lock(swd_ctx_t *ctx)
+{
+}
+
+void swd_ctx_unlock(swd_ctx_t *ctx)
+{
+}
+
+void swd_ctx_acquire(swd_ctx_t *ctx)
+{
+    __atomic_add_fetch(&ctx->users, 1, __ATOMIC_SEQ_CST);
+}
+
+void swd_ctx_release(swd_ctx_t *ctx)
+{
+    __atomic_sub_fetch(&ctx->users, 1, __ATOMIC_SEQ_CST);
+}
+
+int sim_ctx_users(void)
+{
+    return __atomic_load_n(&sim_ctx.users, __ATOMIC_SEQ_CST);
+}
+
+// NVS, a single namespace is enough for the control block cache
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle)
+{
+    *handle = 1;
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *value)
+{
+    for (uint32_t i = 0; i < SIM_NVS_ENTRIES; i++) {
+        if (nvs[i].key[0] != 0 && strcmp(nvs[i].key, key) == 0) {
+            *value = nvs[i].val;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    uint32_t free_slot = SIM_NVS_ENTRIES;
+
+    for (uint32_t i = 0; i < SIM_NVS_ENTRIES; i++) {
+        if (nvs[i].key[0] != 0 && strcmp(nvs[i].key, key) == 0) {
+            nvs[i].val = value;
+            return ESP_OK;
+        }
+        if (nvs[i].key[0] == 0 && free_slot == SIM_NVS_ENTRIES) {
+            free_slot = i;
+        }
+    }
+
+    if (free_slot == SIM_NVS_ENTRIES) {
+        return ESP_FAIL;
+    }
+    strncpy(nvs[free_slot].key, key, sizeof(nvs[free_slot].key) - 1);
+    nvs[free_slot].val = value;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    for (uint32_t i = 0; i < SIM_NVS_ENTRIES; i++) {
+        if (nvs[i].key[0] != 0 && strcmp(nvs[i].key, key) == 0) {
+            memset(&nvs[i], 0, sizeof(nvs[i]));
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
@@ -0,0 +1,51 @@
+/**
+ * @file    sim_target.h
+ * @brief   Simulated target RAM and RTT firmware side for the host tests
+ *
+ * The probe side reaches the RAM through swd_read_memory(), swd_write_memory()
+ * and swd_write_word(), which count their calls. The firmware side works like
+ * SEGGER_RTT_WriteNoLock()/SEGGER_RTT_Read() and may run in its own thread;
+ * both sides take the same lock per access, like word accesses on the bus.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define SIM_RAM_START   0x20000000
+#define SIM_RAM_SIZE    0x40000
+
+typedef struct {
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t bytes_read;
+} sim_stats_t;
+
+void sim_reset(void);
+void sim_fill(uint32_t addr, const void *data, uint32_t len);
+void sim_put32(uint32_t addr, uint32_t val);
+uint32_t sim_get32(uint32_t addr);
+void sim_stats(sim_stats_t *stats);
+void sim_fail_reads(uint8_t fail);
+// Time each swd_read_memory()/swd_write_memory() call spends on the wire
+void sim_latency(uint32_t us);
+
+// Control block at cb with up/down buffers placed from buf_area on, sizes of 0 leave a buffer unconfigured
+void sim_rtt_setup(uint32_t cb, uint32_t up_count, const uint32_t *up_size, uint32_t down_count, const uint32_t *down_size, uint32_t buf_area);
+uint32_t sim_up_desc(uint32_t ch);
+uint32_t sim_down_desc(uint32_t ch);
+
+// Firmware side, both return the number of bytes moved
+uint32_t sim_up_write(uint32_t ch, const uint8_t *data, uint32_t len);
+uint32_t sim_down_read(uint32_t ch, uint8_t *dst, uint32_t len);
+
+// Firmware thread writing len bytes of sim_pattern() to an up-buffer, waiting while it's full
+void sim_producer_start(uint32_t ch, uint32_t len, uint32_t seed);
+void sim_producer_join(void);
+uint8_t sim_pattern(uint32_t seed, uint32_t i);
+
+// NVS namespace contents, for the control block address cache
+uint32_t sim_nvs_entries(void);
+
+// swd_ctx_acquire() calls not yet matched by swd_ctx_release()
+int sim_ctx_users(void);
@@ -0,0 +1,12 @@
+/**
+ * @file    esp_err.h
+ * @brief   Host test stand-in for the ESP-IDF header
+ */
+
+#pragma once
+
+typedef int esp_err_t;
+
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NVS_NOT_FOUND   0x1102
@@ -0,0 +1,15 @@
+/**
+ * @file    esp_heap_caps.h
+ * @brief   Host test stand-in for the ESP-IDF header, every capability is plain malloc()
+ */
+
+#pragma once
+
+#include <stdlib.h>
+
+#define MALLOC_CAP_8BIT         (1 << 2)
+#define MALLOC_CAP_INTERNAL     (1 << 11)
+
+#define heap_caps_malloc(size, caps)        malloc(size)
+#define heap_caps_calloc(n, size, caps)     calloc(n, size)
+#define heap_caps_free(ptr)                 free(ptr)
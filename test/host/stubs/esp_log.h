@@ -0,0 +1,13 @@
+/**
+ * @file    esp_log.h
+ * @brief   Host test stand-in for the ESP-IDF header, prints the format string only
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E %s: %s\n", tag, fmt)
+#define ESP_LOGW(tag, fmt, ...) fprintf(stderr, "W %s: %s\n", tag, fmt)
+#define ESP_LOGI(tag, fmt, ...) do { } while (0)
+#define ESP_LOGD(tag, fmt, ...) do { } while (0)
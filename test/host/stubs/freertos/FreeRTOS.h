@@ -0,0 +1,36 @@
+/**
+ * @file    FreeRTOS.h
+ * @brief   Host test stand-in, the API used by the units under test on top of POSIX threads
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+// Same tick rate as the ESP-IDF default, so sub-tick poll intervals are exercised
+#define configTICK_RATE_HZ      100
+#define portTICK_PERIOD_MS      (1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY           ((TickType_t)0xffffffffUL)
+#define pdMS_TO_TICKS(ms)       ((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+
+#define pdFALSE                 0
+#define pdTRUE                  1
+#define pdFAIL                  pdFALSE
+#define pdPASS                  pdTRUE
+#define tskNO_AFFINITY          0x7fffffff
+
+// Critical sections only exclude other holders of the same spinlock, like on a dual core ESP32
+typedef struct {
+    pthread_mutex_t mutex;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED    {PTHREAD_MUTEX_INITIALIZER}
+#define portMUX_INITIALIZE(mux)         pthread_mutex_init(&(mux)->mutex, NULL)
+#define portENTER_CRITICAL(mux)         pthread_mutex_lock(&(mux)->mutex)
+#define portEXIT_CRITICAL(mux)          pthread_mutex_unlock(&(mux)->mutex)
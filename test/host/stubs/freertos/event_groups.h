@@ -0,0 +1,17 @@
+/**
+ * @file    event_groups.h
+ * @brief   Host test stand-in, see freertos_posix.c
+ */
+
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct host_events *EventGroupHandle_t;
+typedef uint32_t EventBits_t;
+
+EventGroupHandle_t xEventGroupCreate(void);
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits);
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear, BaseType_t all, TickType_t ticks);
+void vEventGroupDelete(EventGroupHandle_t group);
@@ -0,0 +1,15 @@
+/**
+ * @file    queue.h
+ * @brief   Host test stand-in, see freertos_posix.c
+ */
+
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct host_queue *QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks);
+void vQueueDelete(QueueHandle_t queue);
@@ -0,0 +1,21 @@
+/**
+ * @file    semphr.h
+ * @brief   Host test stand-in, see freertos_posix.c
+ */
+
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct host_sem *SemaphoreHandle_t;
+
+// The host semaphore is allocated on the heap, the buffer only keeps the call signature
+typedef struct {
+    uint8_t unused;
+} StaticSemaphore_t;
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buf);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+void vSemaphoreDelete(SemaphoreHandle_t sem);
@@ -0,0 +1,17 @@
+/**
+ * @file    stream_buffer.h
+ * @brief   Host test stand-in, see freertos_posix.c
+ */
+
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct host_stream *StreamBufferHandle_t;
+
+StreamBufferHandle_t xStreamBufferCreate(size_t size, size_t trigger);
+void vStreamBufferDelete(StreamBufferHandle_t sb);
+size_t xStreamBufferSend(StreamBufferHandle_t sb, const void *data, size_t len, TickType_t ticks);
+size_t xStreamBufferReceive(StreamBufferHandle_t sb, void *data, size_t len, TickType_t ticks);
+size_t xStreamBufferBytesAvailable(StreamBufferHandle_t sb);
+size_t xStreamBufferSpacesAvailable(StreamBufferHandle_t sb);
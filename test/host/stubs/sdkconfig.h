@@ -0,0 +1,17 @@
+/**
+ * @file    sdkconfig.h
+ * @brief   Host test configuration, small buffers and chunks so wrap-around, stalls and cancels are hit
+ */
+
+#pragma once
+
+#define CONFIG_ESP_SWD_RTT_MAX_CHANNELS     4
+#define CONFIG_ESP_SWD_RTT_STREAM_SIZE      256
+#define CONFIG_ESP_SWD_RTT_CHUNK            64
+#define CONFIG_ESP_SWD_RTT_POLL_MIN_US      1000
+#define CONFIG_ESP_SWD_RTT_POLL_MAX_US      50000
+
+#define CONFIG_ESP_SWD_ASYNC_MAX_OPS        4
+#define CONFIG_ESP_SWD_ASYNC_CHUNK_SIZE     64
+
+#define CONFIG_ESP_SWD_LZ4_MAX_BLOCK        65536
@@ -0,0 +1,299 @@
+/**
+ * @file    test_async.c
+ * @brief   swd_async.c worker against a simulated target, built and run on the host
+ *
+ *   cmake -S test/host -B build/host && cmake --build build/host
+ *   ctest --test-dir build/host --output-on-failure
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos_posix.h"
+#include "sim_target.h"
+#include "swd_async.h"
+
+#define DATA_ADDR       (SIM_RAM_START + 0x1000)
+#define DATA_SIZE       4096
+#define INIT_THREADS    4
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint8_t buf[DATA_SIZE];
+
+static void fill_buf(uint32_t seed)
+{
+    for (uint32_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = sim_pattern(seed, i);
+    }
+}
+
+static uint32_t check_buf(const uint8_t *data, uint32_t len, uint32_t seed)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        if (data[i] != sim_pattern(seed, i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static pthread_barrier_t init_barrier;
+static swd_async_op_t *init_ops[INIT_THREADS];
+
+static void *init_thread(void *arg)
+{
+    uintptr_t n = (uintptr_t)arg;
+
+    pthread_barrier_wait(&init_barrier);
+    init_ops[n] = swd_write_memory_async(DATA_ADDR + n * 16, buf, 16, NULL, NULL);
+    return NULL;
+}
+
+// Several tasks submitting their first transfer at the same time share one worker
+static void test_concurrent_init(void)
+{
+    pthread_t threads[INIT_THREADS];
+    uint32_t tasks = host_tasks_created();
+
+    sim_reset();
+    fill_buf(1);
+    pthread_barrier_init(&init_barrier, NULL, INIT_THREADS);
+
+    for (uintptr_t i = 0; i < INIT_THREADS; i++) {
+        pthread_create(&threads[i], NULL, init_thread, (void *)i);
+    }
+    for (uint32_t i = 0; i < INIT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    CHECK(host_tasks_created() == tasks + 1);
+    for (uint32_t i = 0; i < INIT_THREADS; i++) {
+        CHECK(init_ops[i] != NULL);
+        if (init_ops[i] != NULL) {
+            CHECK(swd_async_wait(init_ops[i], portMAX_DELAY) == SWD_ASYNC_DONE);
+            swd_async_release(init_ops[i]);
+        }
+    }
+
+    pthread_barrier_destroy(&init_barrier);
+    CHECK(swd_async_init());
+    CHECK(host_tasks_created() == tasks + 1);
+}
+
+static void test_write_wait(void)
+{
+    uint8_t back[DATA_SIZE];
+    swd_async_op_t *op;
+
+    sim_reset();
+    fill_buf(2);
+
+    op = swd_write_memory_async(DATA_ADDR, buf, sizeof(buf), NULL, NULL);
+    CHECK(op != NULL);
+    if (op == NULL) {
+        return;
+    }
+
+    CHECK(swd_async_wait(op, portMAX_DELAY) == SWD_ASYNC_DONE);
+    CHECK(swd_async_poll(op) == SWD_ASYNC_DONE);
+    CHECK(swd_async_progress(op) == sizeof(buf));
+    CHECK(!swd_async_cancel(op));
+    swd_async_release(op);
+
+    for (uint32_t i = 0; i < sizeof(back); i += 4) {
+        uint32_t word = sim_get32(DATA_ADDR + i);
+        memcpy(&back[i], &word, 4);
+    }
+    CHECK(check_buf(back, sizeof(back), 2));
+}
+
+typedef struct {
+    SemaphoreHandle_t done;
+    swd_async_op_t *op;
+    swd_async_state_t state;
+    uint32_t calls;
+} cb_record_t;
+
+// Releases the handle itself, the submitter only waits for the semaphore
+static void read_cb(swd_async_op_t *op, swd_async_state_t state, void *arg)
+{
+    cb_record_t *rec = arg;
+
+    rec->op = op;
+    rec->state = state;
+    rec->calls++;
+    swd_async_release(op);
+    xSemaphoreGive(rec->done);
+}
+
+static void test_read_callback(void)
+{
+    uint8_t dst[DATA_SIZE];
+    cb_record_t rec = {0};
+    swd_async_op_t *op;
+
+    sim_reset();
+    fill_buf(3);
+    for (uint32_t i = 0; i < sizeof(buf); i += 4) {
+        uint32_t word;
+        memcpy(&word, &buf[i], 4);
+        sim_put32(DATA_ADDR + i, word);
+    }
+
+    rec.done = xSemaphoreCreateBinary();
+    memset(dst, 0, sizeof(dst));
+
+    // More rounds than slots, so every slot is released by the callback and reused
+    for (uint32_t round = 0; round < 3 * 4; round++) {
+        op = swd_read_memory_async(DATA_ADDR, dst, sizeof(dst), read_cb, &rec);
+        CHECK(op != NULL);
+        if (op == NULL) {
+            break;
+        }
+
+        CHECK(xSemaphoreTake(rec.done, pdMS_TO_TICKS(2000)));
+        CHECK(rec.op == op);
+        CHECK(rec.state == SWD_ASYNC_DONE);
+        CHECK(check_buf(dst, sizeof(dst), 3));
+    }
+    CHECK(rec.calls == 3 * 4);
+
+    vSemaphoreDelete(rec.done);
+}
+
+// Keeps the worker busy after the state went final
+static void slow_cb(swd_async_op_t *op, swd_async_state_t state, void *arg)
+{
+    struct timespec ts = {.tv_nsec = 200000};
+
+    nanosleep(&ts, NULL);
+}
+
+// A poller that releases as soon as it sees the final state must not leave a late
+// done bit behind for the next transfer in that slot
+static void test_poll_reuse(void)
+{
+    swd_async_op_t *op;
+    swd_async_state_t state;
+    uint32_t bad = 0;
+
+    sim_reset();
+    fill_buf(4);
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        op = swd_write_memory_async(DATA_ADDR, buf, 8, slow_cb, NULL);
+        if (op == NULL) {
+            bad++;
+            continue;
+        }
+
+        if (i & 1) {
+            do {
+                state = swd_async_poll(op);
+            } while (state == SWD_ASYNC_PENDING || state == SWD_ASYNC_RUNNING);
+        } else {
+            state = swd_async_wait(op, portMAX_DELAY);
+        }
+
+        bad += (state != SWD_ASYNC_DONE);
+        swd_async_release(op);
+    }
+
+    CHECK(bad == 0);
+}
+
+static void test_cancel(void)
+{
+    swd_async_op_t *running, *queued, *op;
+    uint8_t dst[DATA_SIZE];
+
+    sim_reset();
+    fill_buf(5);
+    sim_latency(2000);
+
+    running = swd_write_memory_async(DATA_ADDR, buf, sizeof(buf), NULL, NULL);
+    queued = swd_read_memory_async(DATA_ADDR, dst, sizeof(dst), NULL, NULL);
+    CHECK(running != NULL && queued != NULL);
+    if (running == NULL || queued == NULL) {
+        return;
+    }
+
+    // Slots are taken until released
+    op = swd_write_memory_async(DATA_ADDR, buf, 4, NULL, NULL);
+    CHECK(op != NULL);
+    CHECK(swd_async_wait(op, 0) != SWD_ASYNC_DONE);
+
+    while (swd_async_progress(running) == 0) {
+        vTaskDelay(1);
+    }
+
+    CHECK(swd_async_poll(queued) == SWD_ASYNC_PENDING);
+    CHECK(swd_async_cancel(queued));
+    CHECK(swd_async_cancel(running));
+
+    CHECK(swd_async_wait(running, portMAX_DELAY) == SWD_ASYNC_CANCELLED);
+    CHECK(swd_async_progress(running) > 0 && swd_async_progress(running) < sizeof(buf));
+    CHECK(swd_async_wait(queued, portMAX_DELAY) == SWD_ASYNC_CANCELLED);
+    CHECK(swd_async_progress(queued) == 0);
+    CHECK(!swd_async_cancel(running));
+
+    // The abort of the cancelled transfer doesn't leak into the next one
+    CHECK(swd_async_wait(op, portMAX_DELAY) == SWD_ASYNC_DONE);
+
+    swd_async_release(running);
+    swd_async_release(queued);
+    swd_async_release(op);
+    sim_latency(0);
+}
+
+static void test_failure(void)
+{
+    swd_async_op_t *op;
+
+    sim_reset();
+    fill_buf(6);
+
+    // The second 64 byte chunk runs past the end of RAM
+    op = swd_write_memory_async(SIM_RAM_START + SIM_RAM_SIZE - 100, buf, 200, NULL, NULL);
+    CHECK(op != NULL);
+    if (op == NULL) {
+        return;
+    }
+
+    CHECK(swd_async_wait(op, portMAX_DELAY) == SWD_ASYNC_FAILED);
+    CHECK(swd_async_progress(op) == 64);
+    swd_async_release(op);
+}
+
+int main(void)
+{
+    test_concurrent_init();
+    test_write_wait();
+    test_read_callback();
+    test_poll_reuse();
+    test_cancel();
+    test_failure();
+
+    CHECK(sim_ctx_users() == 0);
+
+    if (failures != 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("All async tests passed\n");
+    return 0;
+}
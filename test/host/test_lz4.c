@@ -0,0 +1,237 @@
+/**
+ * @file    test_lz4.c
+ * @brief   swd_lz4.c against frames written by the lz4 tool, built and run on the host
+ *
+ *   cmake -S test/host -B build/host && cmake --build build/host
+ *   ctest --test-dir build/host --output-on-failure
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos_posix.h"
+#include "sim_target.h"
+#include "swd_lz4.h"
+
+#define IMAGE_ADDR      SIM_RAM_START
+#define IMAGE_SIZE      200000
+#define PAGE_SIZE       1000
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint8_t image[IMAGE_SIZE];
+
+typedef struct {
+    uint8_t *data;
+    uint32_t len;
+    uint32_t pos;
+} frame_t;
+
+// Compressible runs with incompressible stretches, so both stored and compressed blocks show up
+static void make_image(void)
+{
+    uint32_t x = 1;
+
+    for (uint32_t i = 0; i < sizeof(image); i++) {
+        x = x * 1103515245 + 12345;
+        image[i] = ((i / 8192) % 3 == 2) ? (x >> 16) : sim_pattern(i / 256, i % 64);
+    }
+}
+
+static uint8_t pack(const char *flags, frame_t *frame)
+{
+    char cmd[256];
+    FILE *f;
+    long len;
+
+    f = fopen("lz4_image.bin", "wb");
+    if (f == NULL || fwrite(image, 1, sizeof(image), f) != sizeof(image)) {
+        return 0;
+    }
+    fclose(f);
+
+    snprintf(cmd, sizeof(cmd), "\"%s\" -q -f %s lz4_image.bin lz4_image.lz4", LZ4_PROGRAM, flags);
+    if (system(cmd) != 0) {
+        return 0;
+    }
+
+    f = fopen("lz4_image.lz4", "rb");
+    if (f == NULL) {
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    frame->data = malloc(len);
+    frame->len = len;
+    frame->pos = 0;
+    if (fread(frame->data, 1, len, f) != (size_t)len) {
+        len = -1;
+    }
+    fclose(f);
+    return len > 0;
+}
+
+static uint8_t read_frame(uint8_t *dst, uint32_t len, void *arg)
+{
+    frame_t *frame = arg;
+
+    if (len > frame->len - frame->pos) {
+        return 0;
+    }
+
+    memcpy(dst, frame->data + frame->pos, len);
+    frame->pos += len;
+    return 1;
+}
+
+// Stands in for the flash pipeline, pulls the image page by page into target RAM
+uint8_t swd_flash_program_stream(const swd_flash_config_t *cfg, uint32_t addr, uint32_t size, swd_flash_fetch_cb_t fetch, void *arg)
+{
+    uint8_t page[PAGE_SIZE];
+    uint32_t n;
+
+    for (uint32_t ofs = 0; ofs < size; ofs += n) {
+        n = size - ofs < sizeof(page) ? size - ofs : sizeof(page);
+        if (fetch(addr + ofs, page, n, arg) != n) {
+            return 0;
+        }
+        sim_fill(addr + ofs, page, n);
+    }
+
+    return 1;
+}
+
+static uint8_t image_in_ram(void)
+{
+    for (uint32_t i = 0; i < sizeof(image); i += 4) {
+        uint32_t word = sim_get32(IMAGE_ADDR + i);
+
+        if (memcmp(&word, &image[i], sizeof(image) - i < 4 ? sizeof(image) - i : 4) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint8_t write_memory(frame_t *frame)
+{
+    sim_reset();
+    frame->pos = 0;
+    return swd_lz4_write_memory(IMAGE_ADDR, read_frame, frame) && image_in_ram();
+}
+
+static uint8_t flash_program(frame_t *frame)
+{
+    swd_flash_config_t cfg = {0};
+
+    sim_reset();
+    frame->pos = 0;
+    return swd_lz4_flash_program(&cfg, IMAGE_ADDR, read_frame, frame) && image_in_ram();
+}
+
+// Plain lz4 -B4 output, streamed to the end mark
+static void test_default_frame(void)
+{
+    frame_t frame;
+
+    CHECK(pack("-B4", &frame));
+    CHECK(write_memory(&frame));
+    CHECK(frame.pos == frame.len);
+
+    // The flash pipeline needs the content size
+    CHECK(!flash_program(&frame));
+    free(frame.data);
+}
+
+static void test_content_size(void)
+{
+    swd_lz4_stream_t *s;
+    frame_t frame;
+
+    CHECK(pack("-B4 -BX --content-size", &frame));
+
+    s = swd_lz4_open(read_frame, &frame);
+    CHECK(s != NULL);
+    if (s != NULL) {
+        CHECK(swd_lz4_image_size(s) == IMAGE_SIZE);
+        swd_lz4_close(s);
+    }
+
+    CHECK(flash_program(&frame));
+    CHECK(frame.pos == frame.len);
+    CHECK(write_memory(&frame));
+
+    // A flipped byte fails the block or content checksum
+    frame.data[frame.len / 2] ^= 0x40;
+    CHECK(!write_memory(&frame));
+    CHECK(!flash_program(&frame));
+    frame.data[frame.len / 2] ^= 0x40;
+
+    // So does a stream cut short
+    frame.len -= 3;
+    CHECK(!write_memory(&frame));
+    CHECK(!flash_program(&frame));
+    free(frame.data);
+}
+
+// Small blocks under the declared 64 KiB maximum, no checksums
+static void test_small_blocks(void)
+{
+    frame_t frame;
+
+    CHECK(pack("-B4096 --no-frame-crc", &frame));
+    CHECK(write_memory(&frame));
+    free(frame.data);
+}
+
+static void test_rejected(void)
+{
+    frame_t frame;
+
+    // Linked blocks
+    CHECK(pack("-B4 -BD", &frame));
+    frame.pos = 0;
+    CHECK(swd_lz4_open(read_frame, &frame) == NULL);
+    free(frame.data);
+
+    // Blocks above CONFIG_ESP_SWD_LZ4_MAX_BLOCK
+    CHECK(pack("-B5", &frame));
+    CHECK(!write_memory(&frame));
+
+    // Header checksum
+    frame.data[6] ^= 1;
+    frame.pos = 0;
+    CHECK(swd_lz4_open(read_frame, &frame) == NULL);
+    free(frame.data);
+}
+
+int main(void)
+{
+    make_image();
+
+    test_default_frame();
+    test_content_size();
+    test_small_blocks();
+    test_rejected();
+
+    remove("lz4_image.bin");
+    remove("lz4_image.lz4");
+
+    if (failures != 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("All lz4 tests passed\n");
+    return 0;
+}
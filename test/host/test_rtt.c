@@ -0,0 +1,350 @@
+/**
+ * @file    test_rtt.c
+ * @brief   swd_rtt.c against a simulated target, built and run on the host
+ *
+ *   cmake -S test/host -B build/host && cmake --build build/host
+ *   ctest --test-dir build/host --output-on-failure
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos_posix.h"
+#include "sim_target.h"
+#include "swd_rtt.h"
+
+#define CB_ADDR         (SIM_RAM_START + 0x0400)
+#define BUF_AREA        (SIM_RAM_START + 0x8000)
+
+#define DESC_WROFF      12
+#define DESC_RDOFF      16
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint8_t noise(uint32_t i)
+{
+    return sim_pattern(0x5eed, i);
+}
+
+// Fill RAM with noise holding a near miss of the ID, so only the real one matches
+static void fill_noise(void)
+{
+    uint8_t buf[256];
+
+    for (uint32_t ofs = 0; ofs < SIM_RAM_SIZE; ofs += sizeof(buf)) {
+        for (uint32_t i = 0; i < sizeof(buf); i++) {
+            buf[i] = noise(ofs + i);
+        }
+        sim_fill(SIM_RAM_START + ofs, buf, sizeof(buf));
+    }
+    sim_fill(SIM_RAM_START + 0x0100, "SEGGER RTX\0\0\0\0\0\0", 16);
+}
+
+static uint32_t check_pattern(const uint8_t *data, uint32_t len, uint32_t seed, uint32_t first)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        if (data[i] != sim_pattern(seed, first + i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void test_scan_and_cache(void)
+{
+    const uint32_t up[] = {64};
+    const uint32_t down[] = {16};
+    // The scan reads 64 byte chunks that advance by 52, chunk 20 ends in the middle of this ID
+    uint32_t cb = SIM_RAM_START + 52 * 20 + 56;
+    uint32_t moved = SIM_RAM_START + 0x3000;
+    sim_stats_t st;
+    swd_rtt_t *rtt;
+
+    sim_reset();
+    fill_noise();
+    sim_rtt_setup(cb, 1, up, 1, down, BUF_AREA);
+
+    rtt = swd_rtt_open(SIM_RAM_START, 0x4000, 0x1234);
+    CHECK(rtt != NULL);
+    if (rtt == NULL) {
+        return;
+    }
+    CHECK(swd_rtt_address(rtt) == cb);
+    CHECK(swd_rtt_up_count(rtt) == 1);
+    CHECK(swd_rtt_down_count(rtt) == 1);
+    CHECK(sim_nvs_entries() == 1);
+    swd_rtt_close(rtt);
+
+    // Same build tag: verify the cached address, no scan
+    sim_stats(&st);
+    rtt = swd_rtt_open(SIM_RAM_START, 0x4000, 0x1234);
+    sim_stats(&st);
+    CHECK(rtt != NULL && swd_rtt_address(rtt) == cb);
+    CHECK(st.reads == 3);
+    swd_rtt_close(rtt);
+
+    // New firmware layout under the same tag: the stale address fails to verify and is replaced
+    fill_noise();
+    sim_rtt_setup(moved, 1, up, 1, down, BUF_AREA);
+    rtt = swd_rtt_open(SIM_RAM_START, 0x4000, 0x1234);
+    CHECK(rtt != NULL && swd_rtt_address(rtt) == moved);
+    swd_rtt_close(rtt);
+
+    sim_stats(&st);
+    rtt = swd_rtt_open(SIM_RAM_START, 0x4000, 0x1234);
+    sim_stats(&st);
+    CHECK(rtt != NULL && swd_rtt_address(rtt) == moved);
+    CHECK(st.reads == 3);
+    swd_rtt_close(rtt);
+
+    CHECK(swd_rtt_forget(0x1234));
+    CHECK(sim_nvs_entries() == 0);
+
+    // Nothing outside the scanned range
+    CHECK(swd_rtt_open(SIM_RAM_START, 0x2000, 0) == NULL);
+    CHECK(sim_nvs_entries() == 0);
+}
+
+static void test_idle_poll(void)
+{
+    const uint32_t up[] = {32, 32, 32};
+    const uint32_t down[] = {16};
+    swd_rtt_stats_t stats;
+    sim_stats_t st;
+    swd_rtt_t *rtt;
+
+    sim_reset();
+    sim_rtt_setup(CB_ADDR, 3, up, 1, down, BUF_AREA);
+    rtt = swd_rtt_open(SIM_RAM_START, SIM_RAM_SIZE, 0);
+    CHECK(rtt != NULL);
+    if (rtt == NULL) {
+        return;
+    }
+
+    // All up-buffer offsets in one block, nothing for the empty down-channel
+    sim_stats(&st);
+    CHECK(swd_rtt_poll(rtt));
+    CHECK(swd_rtt_poll(rtt));
+    sim_stats(&st);
+    CHECK(st.reads == 2);
+    CHECK(st.bytes_read == 2 * (2 * 24 + 8));
+    CHECK(st.writes == 0);
+
+    swd_rtt_get_stats(rtt, &stats);
+    CHECK(stats.polls == 2);
+    CHECK(stats.bytes_up == 0);
+
+    // A failing read fails the poll, the next one recovers
+    sim_fail_reads(1);
+    CHECK(!swd_rtt_poll(rtt));
+    sim_fail_reads(0);
+    CHECK(swd_rtt_poll(rtt));
+
+    swd_rtt_close(rtt);
+}
+
+static void test_up_wrap(void)
+{
+    const uint32_t up[] = {32, 32};
+    uint8_t data[64], got[64];
+    swd_rtt_t *rtt;
+
+    sim_reset();
+    sim_rtt_setup(CB_ADDR, 2, up, 0, NULL, BUF_AREA);
+    rtt = swd_rtt_open(SIM_RAM_START, SIM_RAM_SIZE, 0);
+    CHECK(rtt != NULL);
+    if (rtt == NULL) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < sizeof(data); i++) {
+        data[i] = sim_pattern(1, i);
+    }
+
+    CHECK(sim_up_write(0, data, 20) == 20);
+    CHECK(swd_rtt_poll(rtt));
+    CHECK(swd_rtt_read(rtt, 0, got, sizeof(got), 0) == 20);
+    CHECK(check_pattern(got, 20, 1, 0));
+
+    // Channel 0 wraps at 32, channel 1 does not
+    CHECK(sim_up_write(0, data + 20, 30) == 30);
+    for (uint32_t i = 0; i < 25; i++) {
+        data[i] = sim_pattern(2, i);
+    }
+    CHECK(sim_up_write(1, data, 25) == 25);
+
+    CHECK(swd_rtt_poll(rtt));
+    CHECK(swd_rtt_read(rtt, 0, got, sizeof(got), 0) == 30);
+    CHECK(check_pattern(got, 30, 1, 20));
+    CHECK(swd_rtt_read(rtt, 1, got, sizeof(got), 0) == 25);
+    CHECK(check_pattern(got, 25, 2, 0));
+
+    CHECK(sim_get32(sim_up_desc(0) + DESC_RDOFF) == 18);
+    CHECK(sim_get32(sim_up_desc(1) + DESC_RDOFF) == 25);
+    CHECK(swd_rtt_read(rtt, 2, got, sizeof(got), 0) == 0);
+
+    swd_rtt_close(rtt);
+}
+
+static void test_down_wrap(void)
+{
+    const uint32_t up[] = {32};
+    const uint32_t down[] = {16};
+    uint8_t data[20], got[32];
+    swd_rtt_stats_t stats;
+    swd_rtt_t *rtt;
+
+    sim_reset();
+    sim_rtt_setup(CB_ADDR, 1, up, 1, down, BUF_AREA);
+    rtt = swd_rtt_open(SIM_RAM_START, SIM_RAM_SIZE, 0);
+    CHECK(rtt != NULL);
+    if (rtt == NULL) {
+        return;
+    }
+
+    // Two bytes the target has not read yet, so 13 bytes fit with one kept free
+    sim_put32(sim_down_desc(0) + DESC_WROFF, 5);
+    sim_put32(sim_down_desc(0) + DESC_RDOFF, 3);
+
+    for (uint32_t i = 0; i < sizeof(data); i++) {
+        data[i] = sim_pattern(3, i);
+    }
+    CHECK(swd_rtt_write(rtt, 0, data, sizeof(data), 0) == sizeof(data));
+    CHECK(swd_rtt_write(rtt, 1, data, sizeof(data), 0) == 0);
+
+    CHECK(swd_rtt_poll(rtt));
+    swd_rtt_get_stats(rtt, &stats);
+    CHECK(stats.bytes_down == 13);
+    CHECK(sim_get32(sim_down_desc(0) + DESC_WROFF) == 2);
+
+    CHECK(sim_down_read(0, got, sizeof(got)) == 15);
+    CHECK(check_pattern(got + 2, 13, 3, 0));
+
+    CHECK(swd_rtt_poll(rtt));
+    swd_rtt_get_stats(rtt, &stats);
+    CHECK(stats.bytes_down == 20);
+    CHECK(sim_down_read(0, got, sizeof(got)) == 7);
+    CHECK(check_pattern(got, 7, 3, 13));
+
+    swd_rtt_close(rtt);
+}
+
+static void test_stall(void)
+{
+    const uint32_t up[] = {512};
+    uint8_t data[400], got[400];
+    swd_rtt_stats_t stats;
+    swd_rtt_t *rtt;
+
+    sim_reset();
+    sim_rtt_setup(CB_ADDR, 1, up, 0, NULL, BUF_AREA);
+    rtt = swd_rtt_open(SIM_RAM_START, SIM_RAM_SIZE, 0);
+    CHECK(rtt != NULL);
+    if (rtt == NULL) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < sizeof(data); i++) {
+        data[i] = sim_pattern(4, i);
+    }
+    CHECK(sim_up_write(0, data, sizeof(data)) == sizeof(data));
+
+    // The stream buffer takes 256 bytes, the rest stays on the target
+    CHECK(swd_rtt_poll(rtt));
+    swd_rtt_get_stats(rtt, &stats);
+    CHECK(stats.stalls == 1);
+    CHECK(stats.bytes_up == 256);
+    CHECK(sim_get32(sim_up_desc(0) + DESC_RDOFF) == 256);
+
+    CHECK(swd_rtt_read(rtt, 0, got, sizeof(got), 0) == 256);
+    CHECK(swd_rtt_poll(rtt));
+    CHECK(swd_rtt_read(rtt, 0, got + 256, sizeof(got) - 256, 0) == 144);
+    CHECK(check_pattern(got, sizeof(got), 4, 0));
+
+    swd_rtt_get_stats(rtt, &stats);
+    CHECK(stats.stalls == 1);
+    CHECK(sim_get32(sim_up_desc(0) + DESC_RDOFF) == sizeof(data));
+
+    swd_rtt_close(rtt);
+}
+
+static void test_poll_task(void)
+{
+    const uint32_t up[] = {256};
+    const uint32_t total = 20000;
+    uint8_t got[200];
+    uint32_t done = 0, n;
+    swd_rtt_stats_t stats;
+    TickType_t min_ticks;
+    uint32_t zero;
+    swd_rtt_t *rtt;
+
+    sim_reset();
+    sim_rtt_setup(CB_ADDR, 1, up, 0, NULL, BUF_AREA);
+    rtt = swd_rtt_open(SIM_RAM_START, SIM_RAM_SIZE, 0);
+    CHECK(rtt != NULL);
+    if (rtt == NULL) {
+        return;
+    }
+
+    host_wait_stats(&min_ticks, &zero);
+    CHECK(swd_rtt_start(rtt));
+    CHECK(!swd_rtt_poll(rtt));
+    sim_producer_start(0, total, 5);
+
+    while (done < total) {
+        n = swd_rtt_read(rtt, 0, got, sizeof(got), pdMS_TO_TICKS(2000));
+        if (n == 0) {
+            break;
+        }
+        if (!check_pattern(got, n, 5, done)) {
+            CHECK(!"data out of order");
+            break;
+        }
+        done += n;
+    }
+
+    sim_producer_join();
+    swd_rtt_stop(rtt);
+    CHECK(done == total);
+
+    swd_rtt_get_stats(rtt, &stats);
+    CHECK(stats.bytes_up == total);
+    CHECK(stats.polls > 0);
+    CHECK(stats.interval_us >= 1000 && stats.interval_us <= 50000);
+
+    // The 1 ms minimum interval is below one tick at 100 Hz, the task still has to block
+    host_wait_stats(&min_ticks, &zero);
+    CHECK(min_ticks >= 1);
+    CHECK(zero == 0);
+
+    swd_rtt_close(rtt);
+}
+
+int main(void)
+{
+    test_scan_and_cache();
+    test_idle_poll();
+    test_up_wrap();
+    test_down_wrap();
+    test_stall();
+    test_poll_task();
+
+    CHECK(sim_ctx_users() == 0);
+
+    if (failures != 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("All RTT tests passed\n");
+    return 0;
+}